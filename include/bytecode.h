@@ -46,13 +46,31 @@
 //    [1]       : Evaluation context (more precisely, the Scope for it)
 //    [2..N]    : Local variables, temporaries, output slots
 //    [-1..-M]  : Input arguments, captured values (closure)
+//
+//   Once a procedure is built, its chain of ops is lowered into flat
+//   streams of 'Instr', with operand indices and jump targets as indices
+//   in the stream. The most common ops are then dispatched by a switch
+//   instead of a virtual call. Other ops keep their virtual 'Run'.
+//
+//   Arithmetic on natural and real values is lowered to instructions that
+//   keep their result unboxed in a register attached to the frame slot.
+//   The value is only boxed into a tree when it escapes, i.e. when a generic
+//   op may look at the slot, or when the procedure returns it.
+//
+//   The interpreter evaluates the program, and calls 'Invoke' for each
+//   declaration it selects. Declarations whose parameters are all natural
+//   or real values run as bytecode if the code built for them only uses
+//   ops known to behave like the interpreter. A null result from bytecode
+//   means that it could not complete, e.g. because no candidate matched,
+//   and the interpreter then evaluates the declaration itself.
 
 #include "tree.h"
 #include "context.h"
-#include "evaluator.h"
+#include "interpreter.h"
 
 #include <vector>
 #include <map>
+#include <set>
 #include <iostream>
 
 XL_BEGIN
@@ -60,6 +78,7 @@ XL_BEGIN
 struct Op;                     // An individual operation
 struct Code;                   // A sequence of operations
 struct Procedure;              // Internal representation of functions
+struct EvalStack;              // Per-thread stack of frames
 struct CallOp;                 // A call operation
 struct CodeBuilder;            // Code generator
 typedef std::vector<Op *> Ops; // Sequence of operations
@@ -67,6 +86,13 @@ typedef std::map<Tree *, int>  TreeIDs;
 typedef std::map<Tree *, Op *> TreeOps;
 typedef std::vector<int>       ParmOrder;
 typedef Tree_p *               Data;
+struct Instr;                  // A lowered operation
+struct Registers;              // Unboxed values while executing a stream
+typedef std::vector<Instr>     Stream;  // Flat sequence of lowered ops
+typedef std::vector<Stream>    Streams; // Streams for a code and its evals
+typedef std::map<Op *, uint>   OpIndex; // Index of ops in a stream
+typedef std::map<Tree *, Tree *> TreeTypes; // Statically known types
+typedef std::set<Code *>       CodeSet; // Codes already checked
 
 
 
@@ -76,22 +102,29 @@ typedef Tree_p *               Data;
 //
 // ============================================================================
 
-class Bytecode : public Evaluator
+class Bytecode : public Interpreter
 // ----------------------------------------------------------------------------
 //   An evaluation based on some intermediate byte code
 // ----------------------------------------------------------------------------
+//   The interpreter evaluates the program and type checks, and runs the
+//   declarations that were compiled to bytecode through 'Invoke'
 {
 public:
     Bytecode();
     ~Bytecode();
 
-    Tree *              Evaluate(Scope *, Tree *input) override;
-    Tree *              TypeCheck(Scope *, Tree *type, Tree *val) override;
+    Tree *              Invoke(Scope *scope, Tree *self,
+                               Infix *decl, TreeList &args) override;
+    void                Invalidate(Tree *source) override;
 
 public:
     static Procedure *  Compile(Context *context,
                                 Tree *input, Tree *type,
                                 TreeIDs &parms, TreeList &captured);
+    static Procedure *  Compile(Scope *scope, Infix *decl, TreeList &args);
+
+private:
+    std::vector<Code *> retired;        // Invalidated, maybe still called
 };
 
 
@@ -121,6 +154,32 @@ public:
 };
 
 
+struct Instr
+// ----------------------------------------------------------------------------
+//   An operation lowered into a flat stream
+// ----------------------------------------------------------------------------
+{
+    enum Kind : uint8
+    {
+        OP,                     // Call the virtual 'Run' of 'op'
+        CONST,                  // Result is the value of a ConstOp
+        VALUE,                  // Result is data[a]
+        STORE,                  // data[a] is the result
+        CLEAR,                  // Clear data[a..b]
+        EVAL,                   // Evaluate stream b once into data[a]
+        WHEN,                   // Go to 'fail' unless data[a] is true
+        ARITH,                  // Unboxed arithmetic on data[a], data[b]
+    };
+    enum { END = ~0U };         // Index for the end of the stream
+
+    Op *                op;     // Original op
+    int                 a, b;   // Operands
+    uint                next;   // Index of next instruction
+    uint                fail;   // Index of next instruction on failure
+    Kind                kind;   // What the instruction does
+};
+
+
 struct Code : public Op, Info
 // ----------------------------------------------------------------------------
 //    A sequence of operations (may be local evaluation code in a function)
@@ -130,6 +189,8 @@ struct Code : public Op, Info
     Tree_p              self;
     Op *                ops;
     Ops                 instrs;
+    Streams             streams;        // Lowered code we own
+    Streams *           lowered;        // Lowered code we run, maybe shared
 public:
     Code(Context *, Tree *self);
     Code(Context *, Tree *self, Op *instr);
@@ -138,6 +199,13 @@ public:
     virtual Op *        Run(Data data);
 
     void                SetOps(Op **ops, Ops *instr, uint outId);
+    void                Lower();
+    uint                Lower(Op *entry, OpIndex &lowered);
+    void                Execute(Data data);
+    void                Execute(uint stream, Data data, Registers &regs);
+    void                Box(Data data, Registers &regs);
+    void                Box(Data data, Registers &regs, int id);
+    bool                Runnable(CodeSet &checked);
     virtual void        Dump(std::ostream &out);
     static void         Dump(std::ostream &out, Op *ops, Ops &instrs);
     static text         Ref(Op *op, text sep, text set, text null);
@@ -160,6 +228,8 @@ public:
     ~Procedure();
 
     virtual Op *        Run(Data data);
+    Op *                Call(Data args);
+    Op *                Invoke(Data data, bool moveArgs);
     virtual void        Dump(std::ostream &out);
     virtual uint        Inputs()        { return nInputs; }
     virtual uint        Locals()        { return nLocals; }
@@ -173,6 +243,85 @@ public:
 
 
 
+union Register
+// ----------------------------------------------------------------------------
+//   An unboxed natural or real value
+// ----------------------------------------------------------------------------
+{
+    ulonglong           natural;
+    double              real;
+};
+
+
+struct Registers
+// ----------------------------------------------------------------------------
+//   Unboxed values for the first slots of a frame while its code executes
+// ----------------------------------------------------------------------------
+//   When a register is live, it holds the value of the slot and the Tree_p
+//   in the frame is stale. Live registers are boxed before generic ops run.
+{
+    enum { COUNT = 32 };        // Slots that can hold an unboxed value
+
+    Registers(): live(0), real(0) {}
+
+    bool                Live(int id)    { return uint(id) < COUNT &&
+                                                 ((live >> id) & 1); }
+    bool                IsReal(int id)  { return (real >> id) & 1; }
+    void                Kill(int id)    { if (uint(id) < COUNT)
+                                              live &= ~(1U << id); }
+    void                Set(int id, Register r, bool isReal)
+    {
+        uint32 bit = 1U << id;
+        value[id] = r;
+        live |= bit;
+        real = isReal ? (real | bit) : (real & ~bit);
+    }
+    void                Copy(int to, int from)
+    {
+        Set(to, value[from], IsReal(from));
+    }
+
+    Register            value[COUNT];
+    uint32              live;           // Registers holding the slot value
+    uint32              real;           // Registers holding a real value
+};
+
+
+
+struct EvalStack
+// ----------------------------------------------------------------------------
+//   Per-thread stack holding the frames of running procedures
+// ----------------------------------------------------------------------------
+//   Slots are allocated in large segments and reused, so that calls do not
+//   allocate memory. Frames are popped in the reverse order of their push.
+{
+    EvalStack();
+    ~EvalStack();
+
+    Data                Push(uint size);
+    void                Pop(Data frame, uint size);
+    static EvalStack &  Current();
+
+    uint                depth;          // Number of frames in use
+    char *              base;           // Machine stack when depth was 0
+    static const size_t STACK_BUDGET = 6 << 20; // Machine stack for frames
+
+private:
+    struct Segment
+    {
+        Tree_p *        base;           // Slots in the segment
+        uint            size;           // Number of slots
+        uint            used;           // Slots in use by frames
+    };
+    typedef std::vector<Segment> Segments;
+    static const uint   SEGMENT_SIZE = 1 << 14; // Minimum segment slots
+
+    Segments            segments;       // Segments allocated so far
+    uint                current;        // Segment holding the top frame
+};
+
+
+
 // ============================================================================
 //
 //    Build code from the input
@@ -212,9 +361,11 @@ public:
     int         ValueID(Tree *);
     int         CaptureID(Tree *);
     int         Evaluate(Context *, Tree *, bool deferEval = false);
+    Tree *      KnownType(Context *, Tree *);
     int         EvaluationTemporary(Tree *);
     void        Enclose(Context *context, Scope *old, Tree *what);
-    int         Bind(Name *name, Tree *value, Tree *type=nullptr);
+    int         Bind(Name *name, Tree *value, int valueID,
+                     Tree *type = nullptr);
     CallOp *    Call(Context *context, Tree *value, Tree *type,
                      TreeIDs &inputs, ParmOrder &parms);
 
@@ -225,7 +376,8 @@ public:
     // Adding an opcode
     void        Add(Op *op);
     void        AddEval(int id, Op *op);
-    void        AddTypeCheck(Context *, Tree *value, Tree *type);
+    bool        AddTypeCheck(Context *, Tree *value, Tree *type,
+                             int valueID = 0);
 
     // Success at end of declaration
     void        Success();
@@ -238,9 +390,11 @@ public:
     TreeIDs     outputs;        // Output arguments
     TreeIDs     values;         // Local variables and evaluation temporaries
     TreeList   &captured;       // Captured values from enclosing contexts
+    uint        nValues;        // Number of value IDs allocated
     uint        nEvals;         // Max number of evals on all candidates
     uint        nParms;         // Max number of parms on all candidates
     uint        candidates;     // Number of candidates found
+    uint        matched;        // Number of candidates that generated code
     Tree_p      test;           // Current form to test
     Tree_p      resultType;     // Result type declared in rewrite
     Context_p   context;        // Evaluation context
@@ -250,6 +404,7 @@ public:
     Op *        successOp;      // Exit instruction in case of success
     Ops         instrs;         // All instructions
     TreeOps     subexprs;       // Code generated for sub-expressions
+    TreeTypes   types;          // Machine type of sub-expressions if known
     ParmOrder   parms;          // Indices for parameters
     bool        defer;          // Deferred evaluation
 };
@@ -312,7 +467,7 @@ inline Tree *DataArg(Data data, uint index)
 //    Return the Nth input argument
 // ----------------------------------------------------------------------------
 {
-    return data[~index];
+    return data[~int(index)];
 }
 
 
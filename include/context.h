@@ -194,13 +194,15 @@ XL_BEGIN
 // ============================================================================
 
 struct Context;                                 // Execution context
+struct LookupCache;                             // Inline cache for lookups
+struct ScopeTable;                              // Flat table for a scope
+struct RewriteChildren;                         // Children of a declaration
 
 // Give names to components of a symbol table
 typedef Prefix                          Scope;
 typedef GCPtr<Scope>                    Scope_p;
 typedef Infix                           Rewrite;
 typedef GCPtr<Rewrite>                  Rewrite_p;
-typedef Infix                           RewriteChildren;
 typedef GCPtr<RewriteChildren>          RewriteChildren_p;
 
 typedef GCPtr<Context>                  Context_p;
@@ -233,6 +235,9 @@ struct Context
 // walking through the local symbol table using a tree hash.
 // This makes it possible to implement tree balancing and O(log N) lookups
 // in a local symbol table.
+// The hash of what D defines is computed once when D is entered, and kept
+// in the L ; R node, which is a RewriteChildren with a field for it.
+// This way, lookups only compare integers until they find a candidate.
 
 // A declaration generally has the form From->To, where From is the
 // form we match, and To is the implementation. There are variants in From:
@@ -260,9 +265,11 @@ public:
 
     // Phases of evaluation
     bool                ProcessDeclarations(Tree *what);
+    bool                CollectDeclarations(Tree *what, RewriteList &decls);
 
     // Adding definitions to the context
     Rewrite *           Enter(Infix *decl, bool overwrite=false);
+    uint                EnterAll(RewriteList &decls);
     Rewrite *           Define(Tree *from, Tree *to, bool overwrite=false);
     Rewrite *           Define(text name, Tree *to, bool overwrite=false);
     Tree *              Assign(Tree *target, Tree *source);
@@ -296,14 +303,16 @@ public:
     Tree *              Lookup(Tree *what,
                                lookup_fn lookup, void *info,
                                bool recurse=true);
+    Tree *              CachedLookup(Tree *what,
+                                     lookup_fn lookup, void *info);
     Rewrite *           Reference(Tree *form, bool recurse=true);
     Tree *              DeclaredPattern(Tree *form);
     Tree *              Bound(Tree *form,bool recurse=true);
     Tree *              Bound(Tree *form, bool rec, Rewrite_p *rw,Scope_p *ctx);
     Tree *              Named(text name, bool recurse=true);
     bool                IsEmpty();
-    bool                HasRewritesFor(kind k);
-    void                HasOneRewriteFor(kind k);
+    static bool         HasRewritesFor(kind k);
+    static void         HasOneRewriteFor(kind k);
 
     // List rewrites of a given type
     ulong               ListNames(text begin, RewriteList &list,
@@ -312,11 +321,20 @@ public:
 
     // The hash code used in the rewrite table
     static ulong        Hash(Tree *input);
+    static ulong        HashText(const text &t);
     static inline ulong Rehash(ulong h) { return (h>>1) ^ (h<<31); }
+    static void         RestoreHashes(Scope *scope);
 
     // Clear the symbol table
     void                Clear();
 
+    // Flat representation for large or read-only scopes
+    void                Compact();
+    static ScopeTable * Table(Scope *scope);
+
+    // Invalidate inline lookup caches if a cached scope changes
+    static void         ScopeChanged(Scope *scope);
+
     // Dump symbol tables
     static void         Dump(std::ostream &out, Scope *symbols, bool recurse);
     static void         Dump(std::ostream &out, Rewrite *locals);
@@ -325,10 +343,117 @@ public:
 public:
     Scope_p             symbols;
     static uint         hasRewritesForKind;
+    static ulong        generation;
     GARBAGE_COLLECT(Context);
 };
 
 
+struct LookupCache : Info
+// ----------------------------------------------------------------------------
+//   Inline cache recording lookup candidates on a call site
+// ----------------------------------------------------------------------------
+//   For each scope on the lookup path, we record the declarations whose
+//   hash matches the call site, in the order Lookup would find them.
+//   Entries are keyed by scope identity and by Context::generation.
+//   The cache starts monomorphic, and becomes polymorphic up to SIZE scopes.
+//   Only scopes deep enough to make walking them costly are recorded.
+//   While candidates are being tried, recursive lookups on the same call
+//   site do not replace entries, so that the candidates remain valid.
+{
+    enum { SIZE = 4, MIN_DEPTH = 4 };
+    typedef std::vector<Infix *> Candidates;
+    struct Entry
+    {
+        Entry(): scope(nullptr), generation(0), candidates() {}
+        Scope *         scope;
+        ulong           generation;
+        Candidates      candidates;
+    };
+
+    LookupCache(ulong hash): hash(hash), count(0), victim(0), busy(0) {}
+    Entry *             Find(Scope *scope);
+    Entry *             Insert(Scope *scope);
+
+public:
+    ulong               hash;
+    uint                count;
+    uint                victim;
+    uint                busy;
+    Entry               entries[SIZE];
+};
+
+
+struct ScopeTable : Info
+// ----------------------------------------------------------------------------
+//   Flat open-addressed table of the declarations in a scope
+// ----------------------------------------------------------------------------
+//   Lookups in large scopes chase pointers through many Infix nodes.
+//   For such scopes, Context::Compact builds a table of (hash, decl) pairs,
+//   aligned on cache lines, and probed linearly. Declarations with the same
+//   hash are found in the order they were entered, like with the tree.
+//   The tree remains the reference for introspection and Context::Dump.
+//   Arrays replaced when the table grows are kept until the table dies,
+//   so that a lookup in progress can keep using them.
+{
+    struct Entry
+    {
+        ulong           hash;
+        Infix *         decl;
+    };
+    enum { CACHE_LINE = 64, MIN_CAPACITY = 64 };
+
+    ScopeTable(uint capacity);
+    ~ScopeTable();
+    void                Insert(ulong hash, Infix *decl);
+
+private:
+    static Entry *      AllocateEntries(uint capacity);
+    void                Grow();
+
+public:
+    Entry *             entries;
+    uint                mask;
+    uint                count;
+    std::vector<Entry *>retired;
+};
+
+
+inline ScopeTable *Context::Table(Scope *scope)
+// ----------------------------------------------------------------------------
+//   Return the flat table for a scope if there is one
+// ----------------------------------------------------------------------------
+{
+    return scope->info ? scope->GetInfo<ScopeTable>() : nullptr;
+}
+
+
+struct LookupCacheScope : Info
+// ----------------------------------------------------------------------------
+//   Mark a scope as recorded in some lookup cache
+// ----------------------------------------------------------------------------
+//   Destroying the marked scope invalidates caches to avoid false hits
+//   if another scope is later allocated at the same address.
+{
+    ~LookupCacheScope();
+};
+
+
+struct RewriteChildren : Infix
+// ----------------------------------------------------------------------------
+//   The L ; R node of a symbol table entry, with the hash of what it declares
+// ----------------------------------------------------------------------------
+//   Lookups compare this hash instead of rehashing each declaration
+//   on the search path. Entries that were not created by Context::Enter,
+//   e.g. read back by the serializer, have a plain Infix instead,
+//   see Context::RestoreHashes.
+{
+    RewriteChildren(Tree *l, Tree *r, ulong hash, TreePosition pos):
+        Infix(REWRITE_CHILDREN_NAME, l, r, pos), hash(hash) {}
+    ulong               hash;
+    GARBAGE_COLLECT(RewriteChildren);
+};
+
+
 // ============================================================================
 //
 //    Meaning adapters - Make it more explicit what happens in code
@@ -371,7 +496,7 @@ inline Infix *RewriteDeclaration(Rewrite *rw)
 }
 
 
-inline RewriteChildren *RewriteNext(Rewrite *rw)
+inline Infix *RewriteNext(Rewrite *rw)
 // ----------------------------------------------------------------------------
 //   Find the children of a rewrite during lookup
 // ----------------------------------------------------------------------------
@@ -777,6 +902,20 @@ inline Tree * PatternBase(Tree *form)
 }
 
 
+inline ulong RewriteHash(Rewrite *rw)
+// ----------------------------------------------------------------------------
+//   Return the hash of what a rewrite declares, kept in its children
+// ----------------------------------------------------------------------------
+//   Entries that were neither entered nor restored by RestoreHashes
+//   have plain children, so the hash is computed again
+{
+    if (Allocator<RewriteChildren>::IsAllocated(rw->right))
+        return ((RewriteChildren *) (Tree *) rw->right)->hash;
+    Infix *decl = RewriteDeclaration(rw);
+    return Context::Hash(PatternBase(decl->left));
+}
+
+
 inline Tree * AnnotatedType(Tree *what)
 // ----------------------------------------------------------------------------
 //   If we have a declaration with 'X as Type', return Type
@@ -50,6 +50,9 @@ public:
 
     virtual Tree *      Evaluate(Scope *, Tree *source) = 0;
     virtual Tree *      TypeCheck(Scope *, Tree *type, Tree *value) = 0;
+
+    // Drop code cached for a declaration or statement that was reloaded
+    virtual void        Invalidate(Tree *source XL_UNUSED) {}
 };
 
 XL_END
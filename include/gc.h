@@ -55,6 +55,7 @@ RECORDER_DECLARE(memory);
 XL_BEGIN
 
 struct GarbageCollector;
+struct BackgroundSweeper;
 template <class Object, typename ValueType=void> struct GCPtr;
 
 
@@ -97,6 +98,14 @@ struct TypeAllocator
     typedef volatile Chunk *Chunk_vp;
     typedef std::vector<Chunk_vp> Chunks;
 
+    struct Magazine
+    {
+        Chunk_vp            free;           // Per-thread free list
+        uint                count;          // Number of chunks in free list
+        uint                allocated;      // Allocations not yet reported
+        uint                freed;          // Deletions not yet reported
+    };
+
 public:
     TypeAllocator(kstring name, uint objectSize);
     virtual ~TypeAllocator();
@@ -104,6 +113,7 @@ public:
     void *              Allocate() NEW_THROW;
     void                Delete(void *);
     virtual void        Finalize(void *);
+    virtual bool        CanSweep(void *);
 
     static TypeAllocator *ValidPointer(TypeAllocator *ptr);
     static TypeAllocator *AllocatorPointer(TypeAllocator *ptr);
@@ -116,8 +126,11 @@ public:
     static void *       InUse(void *ptr);
     static void         UpdateInUseRange(Chunk_vp chunk);
     static void         ScheduleDelete(Chunk_vp);
-    bool                CheckLeakedPointers();
-    bool                Sweep();
+    static void         DrainMagazines();
+    static void         ReportMagazines();
+    bool                CheckLeakedPointers(bool defer = false);
+    bool                Sweep(bool background = false);
+    bool                SweepForeground();
     void                ResetStatistics();
 
     void *operator new(size_t size) NEW_THROW;
@@ -129,8 +142,10 @@ public:
         PTR_MASK        = 15,           // Special bits we take out of the ptr
         CHUNKALIGN_MASK = 7,            // Alignment for chunks
         ALLOCATED       = 0,            // Just allocated
-        IN_USE          = 1             // Set if already marked this time
+        IN_USE          = 1,            // Set if already marked this time
+        IN_ARENA        = 2             // Set if release deferred to arena
     };
+    enum { MAGAZINE_SIZE = 64 };        // Chunks moved at once per thread
 
 public:
     struct Listener
@@ -144,6 +159,16 @@ public:
     void AddListener(Listener *l) { listeners.insert(l); }
     bool CanDelete(void *object);
 
+protected:
+    Magazine &          LocalMagazine();
+    void *              AllocateChunk();
+    Chunk_vp            Refill(Magazine &magazine);
+    Chunk_vp            ArenaAllocate();
+    void                ArenaEscape(Chunk_vp chunk);
+    void                ArenaDonate(char *block, uint used);
+    void                Drain(Magazine &magazine, uint keep);
+    void                Report(Magazine &magazine);
+
 protected:
     GarbageCollector *  gc;
     kstring             name;
@@ -154,9 +179,11 @@ protected:
     Listeners           listeners;
     Atomic<Chunk_vp>    freeList;
     Atomic<Chunk_vp>    toDelete;
+    Atomic<Chunk_vp>    foreground;
     Atomic<uint>        available;
     Atomic<uint>        freedCount;
 
+    uint                index;
     uint                chunkSize;
     uint                objectSize;
     uint                alignedSize;
@@ -166,6 +193,7 @@ protected:
     uint                totalCount;
 
     friend struct GarbageCollector;
+    friend struct GCArena;
 
 public:
     static void *       lowestAddress;
@@ -173,9 +201,21 @@ public:
     static void *       lowestAllocatorAddress;
     static void *       highestAllocatorAddress;
     static Atomic<uint> finalizing;
+    static bool         atomicCounts;
 } __attribute__((aligned(16)));
 
 
+inline bool SweepInBackground(const void *)
+// ----------------------------------------------------------------------------
+//   By default, objects are finalized by the thread that owns them
+// ----------------------------------------------------------------------------
+//   Types whose destructor touches no shared state overload this, so that
+//   the background sweeper may finalize them (see BackgroundSweeper)
+{
+    return false;
+}
+
+
 template <class Object>
 struct Allocator : TypeAllocator
 // ----------------------------------------------------------------------------
@@ -193,6 +233,7 @@ public:
     static Object *     Allocate(size_t size) NEW_THROW;
     static void         Delete(Object *);
     virtual void        Finalize(void *object);
+    virtual bool        CanSweep(void *object);
     static bool         IsAllocated(void *ptr);
 
 private:
@@ -201,6 +242,30 @@ private:
 
 
 
+// ****************************************************************************
+//
+//   Evaluation arena - Release temporaries wholesale
+//
+// ****************************************************************************
+
+struct GCArena
+// ----------------------------------------------------------------------------
+//   Bump-allocate objects while active, and release them wholesale
+// ----------------------------------------------------------------------------
+//   Objects allocated in the arena come from per-thread regions instead of
+//   the free lists. They are not finalized when their reference count drops
+//   to zero, nor by garbage collection. When the outermost arena ends,
+//   those that are still unreferenced are finalized at once, and the region
+//   is reused as is. Region blocks holding objects that escaped are handed
+//   over to their allocator, so that escaped objects never move.
+//   Like for a safe point, there must be no uncaptured pointer in flight.
+{
+    GCArena(uint limit);
+    ~GCArena();
+};
+
+
+
 // ****************************************************************************
 //
 //   Garbage collection root pointer
@@ -252,12 +317,23 @@ struct GCPtr
     Object& operator*() const                   { return *pointer; }
     operator ValueType() const                  { return *pointer; }
 
+    // Exchange two pointers owned by the same thread, counts are unchanged
+    void Swap(GCPtr &o)
+    {
+        Object *tmp = pointer;
+        pointer = o.pointer;
+        o.pointer = tmp;
+    }
+
     // Two threads may be assigning to this GCPtr at the same time,
     // e.g. if we update a same Tree child from two different threads.
     GCPtr& Assign(Object *oldVal, Object *newVal)
     {
-        while (!Atomic<Object *>::SetQ(pointer, oldVal, newVal))
-            oldVal = pointer;
+        if (TA::atomicCounts)
+            while (!Atomic<Object *>::SetQ(pointer, oldVal, newVal))
+                oldVal = pointer;
+        else
+            pointer = newVal;
         if (newVal != oldVal)
         {
             TA::Acquire(newVal);
@@ -322,8 +398,9 @@ struct GarbageCollector
 
     static void                 MustRun()       { gc->mustRun |= 1U; }
     static bool                 Running()       { return gc->running; }
+    static bool                 Background()    { return gc->sweeper; }
     static bool                 SafePoint();
-    static bool                 Sweep();
+    static bool                 Sweep(bool background = false);
 
     static void *               DebugPointer(void *ptr);
 
@@ -343,12 +420,14 @@ private:
 private:
     typedef std::vector<TypeAllocator *> Allocators;
     typedef TypeAllocator::Listeners     Listeners;
+    friend struct TypeAllocator;
 
     static GarbageCollector *   gc;
 
     Allocators                  allocators;
     Atomic<uint>                mustRun;
     Atomic<uint>                running;
+    BackgroundSweeper *         sweeper;
 };
 
 
@@ -445,7 +524,10 @@ inline void TypeAllocator::Acquire(void *pointer)
         XL_ASSERT (IsAllocated(pointer));
 
         Chunk_vp chunk = ((Chunk_vp) pointer) - 1;
-        ++chunk->count;
+        if (atomicCounts)
+            Atomic<uint>::Add(chunk->count, 1);
+        else
+            ++chunk->count;
     }
 }
 
@@ -463,7 +545,9 @@ inline void TypeAllocator::Release(void *pointer)
 
         Chunk_vp chunk = ((Chunk_vp) pointer) - 1;
         XL_ASSERT(chunk->count);
-        uint count = --chunk->count;
+        uint count = atomicCounts
+            ? Atomic<uint>::Sub(chunk->count, 1) - 1
+            : --chunk->count;
         if (!count)
             ScheduleDelete(chunk);
     }
@@ -494,7 +578,11 @@ inline void *TypeAllocator::InUse(void *pointer)
     {
         XL_ASSERT (((intptr_t) pointer & CHUNKALIGN_MASK) == 0);
         Chunk_vp chunk = ((Chunk_vp) pointer) - 1;
-        uint bits = Atomic<uintptr_t>::Or(chunk->bits, IN_USE);
+        uintptr_t bits = chunk->bits;
+        if (atomicCounts)
+            bits = Atomic<uintptr_t>::Or(chunk->bits, IN_USE);
+        else
+            chunk->bits = bits | IN_USE;
         if (!chunk->count && (~bits & IN_USE))
             UpdateInUseRange(chunk);
     }
@@ -508,8 +596,20 @@ inline void TypeAllocator::UpdateInUseRange(Chunk_vp chunk)
 // ----------------------------------------------------------------------------
 {
     TypeAllocator *allocator = ValidPointer(chunk->allocator);
-    allocator->lowestInUse.Minimize((uintptr_t) chunk);
-    allocator->highestInUse.Maximize((uintptr_t) (chunk + 1));
+    uintptr_t low = (uintptr_t) chunk;
+    uintptr_t high = (uintptr_t) (chunk + 1);
+    if (atomicCounts)
+    {
+        allocator->lowestInUse.Minimize(low);
+        allocator->highestInUse.Maximize(high);
+    }
+    else
+    {
+        if (allocator->lowestInUse > low)
+            allocator->lowestInUse = low;
+        if (allocator->highestInUse < high)
+            allocator->highestInUse = high;
+    }
 }
 
 
@@ -594,6 +694,16 @@ void Allocator<Object>::Finalize(void *obj)
 }
 
 
+template <class Object> inline
+bool Allocator<Object>::CanSweep(void *obj)
+// ----------------------------------------------------------------------------
+//   Check if the background sweeper can finalize the object
+// ----------------------------------------------------------------------------
+{
+    return listeners.empty() && SweepInBackground((const Object *) obj);
+}
+
+
 template <class Object> inline
 bool Allocator<Object>::IsAllocated(void *ptr)
 // ----------------------------------------------------------------------------
@@ -67,6 +67,12 @@ public:
 
     static Opcode *     SetInfo(Infix *decl, Opcode *opcode);
     static Opcode *     OpcodeInfo(Infix *decl);
+
+public:
+    // Tiered execution: run compiled code for a declaration if available
+    virtual Tree *      Invoke(Scope *scope, Tree *self,
+                               Infix *decl, TreeList &args);
+    static Interpreter *tiered;
 };
 
 
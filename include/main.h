@@ -113,6 +113,14 @@ struct Main
     virtual int         LoadFile(text file, text modname="");
     int                 Run();
 
+    // Incremental reload of modified source files
+    virtual bool        Reload();
+    bool                Reload(SourceFile &sf);
+
+    // Precompiled image of the builtins
+    Tree *              LoadImage(text file, text image);
+    bool                SaveImage(text file, text image, Tree *tree);
+
     // Error checking
     void                Log(Error &e)   { errors->Log(e); }
     uint                HadErrors() { return errors->Count(); }
@@ -155,8 +163,10 @@ namespace Opt
 {
 extern NaturalOption    optimize;
 extern NaturalOption    remoteForks;
+extern BooleanOption    reload;
 extern TextOption       stylesheet;
 extern BooleanOption    emitIR;
+extern BooleanOption    jitCache;
 }
 
 XL_END
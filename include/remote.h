@@ -47,6 +47,10 @@ const uint XL_DEFAULT_PORT = 1205;
 int     xl_tell(Scope *, text host, Tree *body);
 Tree_p  xl_ask(Scope *, text host, Tree *body);
 Tree_p  xl_invoke(Scope *, text host, Tree *body);
+uint    xl_ask_async(Scope *, text host, Tree *body);
+Tree_p  xl_await(Scope *, uint request);
+Tree_p  xl_await_all(Scope *, Tree *requests);
+Tree_p  xl_ask_all(Scope *, Tree *hosts, Tree *body);
 int     xl_reply(Scope *, Tree *body);
 Tree_p  xl_listen_received();
 Tree_p  xl_listen_hook(Tree *body);
@@ -40,7 +40,8 @@
 #include "base.h"
 #include "tree.h"
 #include "action.h"
-#include <iostream>
+#include <unordered_map>
+#include <vector>
 
 
 XL_BEGIN
@@ -61,18 +62,20 @@ enum SerializationTag
 };
 
 
-typedef std::map<text, longlong>        text_map;
-typedef std::map<longlong, text>        text_ids;
+typedef std::unordered_map<text, longlong>      text_map;
+typedef std::vector<text>                       text_ids;
 
 
 struct Serializer
 // ----------------------------------------------------------------------------
-//    Serialize a tree to a stream
+//    Serialize a tree into a memory buffer
 // ----------------------------------------------------------------------------
+//    The buffer and the string table keep their storage when reset, so that
+//    a serializer can be reused for many trees without allocating.
 {
     typedef Tree *value_type;
 
-    Serializer(std::ostream &out);
+    Serializer();
     ~Serializer() {}
 
     // Serialization of the canonical nodes
@@ -87,44 +90,48 @@ struct Serializer
     Tree *      DoChild(Tree *child);
     Tree *      Do(Tree *what);
 
-    bool        IsValid()       { return out.good(); }
+    bool        IsValid()       { return valid; }
+    void        Reset();
 
-    static void Write(std::ostream &out, Tree *tree)
-    {
-        Serializer s(out);
-        tree->Do(s);
-    }
+    // Serialized data
+    const char *Data() const    { return buffer.data(); }
+    size_t      Size() const    { return buffer.size(); }
+    const text &Buffer() const  { return buffer; }
 
 public:
     // Writing data (low level)
     void        WriteSigned(longlong);
     void        WriteUnsigned(ulonglong);
     void        WriteReal(double);
-    void        WriteText(text);
+    void        WriteText(const text &);
     void        WriteChild(Tree *child);
 
 protected:
-    std::ostream &      out;
+    text                buffer;
     text_map            texts;
+    bool                valid;
 };
 
 
 struct Deserializer
 // ----------------------------------------------------------------------------
-//   Reconstruct a tree from its serialized form
+//   Reconstruct a tree from its serialized form in memory
 // ----------------------------------------------------------------------------
+//   The data is not copied, and must remain valid while reading from it.
 {
-    Deserializer(std::istream &in, TreePosition pos = Tree::NOWHERE);
+    Deserializer(const char *data, size_t size,
+                 TreePosition pos = Tree::NOWHERE);
     ~Deserializer();
 
     // Deserialize a tree from the input and return it, or return NULL
     Tree *      ReadTree();
-    bool        IsValid()       { return in.good(); }
+    bool        IsValid()       { return valid; }
 
-    static Tree *Read(std::istream &in)
+    static Tree *Read(const char *data, size_t size)
     {
-        Deserializer d(in);
-        return d.ReadTree();
+        Deserializer d(data, size);
+        Tree *result = d.ReadTree();
+        return d.IsValid() ? result : nullptr;
     }
 
 public:
@@ -135,7 +142,9 @@ public:
     text        ReadText();
 
 protected:
-    std::istream &      in;
+    const char *        current;
+    const char *        end;
+    bool                valid;
     TreePosition        pos;
     text_ids            texts;
 };
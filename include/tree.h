@@ -199,6 +199,15 @@ private:
 };
 
 
+inline bool SweepInBackground(const Tree *tree)
+// ----------------------------------------------------------------------------
+//   A tree without info only releases its children, any thread can do that
+// ----------------------------------------------------------------------------
+{
+    return tree->info.Get() == nullptr;
+}
+
+
 
 // ============================================================================
 //
@@ -43,6 +43,7 @@
 
 #include <algorithm>
 #include <sstream>
+#include <typeinfo>
 
 
 RECORDER(bytecode_output, 64, "Output of the bytecode generator");
@@ -57,39 +58,124 @@ XL_BEGIN
 //
 // ============================================================================
 
-Tree *Bytecode::Evaluate(Scope *scope, Tree *what)
+struct DeclarationCode : Info
 // ----------------------------------------------------------------------------
-//   Compile bytecode and then evaluate it
+//   The procedure running a declaration invoked by the interpreter
 // ----------------------------------------------------------------------------
 {
-    TreeIDs  noParms;
-    TreeList captured;
-    Context_p context = new Context(scope);
+    DeclarationCode(Procedure *proc): proc(proc) {}
+    Procedure *         proc;   // Verified procedure, null to interpret
+};
 
-    Procedure *proc = Compile(context, what, nullptr, noParms, captured);
-    Tree_p result = what;
-    if (proc)
+
+Bytecode::Bytecode()
+// ----------------------------------------------------------------------------
+//   Constructor for the bytecode evaluator
+// ----------------------------------------------------------------------------
+{
+    tiered = this;
+    record(bytecode, "Created bytecode evaluator %p", this);
+}
+
+
+Bytecode::~Bytecode()
+// ----------------------------------------------------------------------------
+//   Destructor for the bytecode evaluator
+// ----------------------------------------------------------------------------
+{
+    if (tiered == this)
+        tiered = nullptr;
+    for (Code *code : retired)
+        code->Delete();
+    record(bytecode, "Destroyed bytecode evaluator %p", this);
+}
+
+
+Tree *Bytecode::Invoke(Scope *scope, Tree *self, Infix *decl, TreeList &args)
+// ----------------------------------------------------------------------------
+//   Run the bytecode for a declaration selected by the interpreter
+// ----------------------------------------------------------------------------
+//   Returning null lets the interpreter evaluate the body. If the bytecode
+//   could not complete, the declaration is interpreted from then on.
+{
+    DeclarationCode *info = decl->GetInfo<DeclarationCode>();
+    if (!info)
     {
-        XL_ASSERT(proc->Inputs() == 0);
-        uint size = captured.size();
-        captured.push_back(what);
-        captured.push_back(scope);
-        Data data = &captured[size];
-        Op *op = proc;
-        while(op)
-            op = op->Run(data);
-        result = DataResult(data);
+        info = new DeclarationCode(Compile(scope, decl, args));
+        decl->SetInfo<DeclarationCode>(info);
+        record(bytecode, "Declaration %t %+s",
+               decl->left, info->proc ? "compiled" : "interpreted");
+    }
+    Procedure *proc = info->proc;
+    if (!proc)
+        return nullptr;
+
+    // Inputs are at negative indices, the first one at -1
+    uint     size = args.size();
+    TreeList data(size + 2);
+    for (uint a = 0; a < size; a++)
+        data[size - 1 - a] = args[a];
+    Data frame = &data[size];
+
+    // Nested frames are limited from the outermost bytecode call
+    char       here;
+    EvalStack &stack = EvalStack::Current();
+    Save<char *> saveBase(stack.base, stack.depth ? stack.base : &here);
+
+    // Errors are reported by the interpreter if the bytecode gives up
+    Errors errors;
+    proc->Run(frame);
+    Tree *result = DataResult(frame);
+    if (errors.Swallowed() || !result)
+    {
+        record(bytecode, "Declaration %t failed on %t, interpreting it",
+               decl->left, self);
+        info->proc = nullptr;
+        return nullptr;
     }
     return result;
 }
 
 
-Tree * Bytecode::TypeCheck(Scope *scope, Tree *type, Tree *val)
+void Bytecode::Invalidate(Tree *source)
 // ----------------------------------------------------------------------------
-//   Perform a type check for the given value
+//   Detach the code compiled for a tree and its children
 // ----------------------------------------------------------------------------
+//   Calls compiled in other procedures point directly to the code, and
+//   closures may still refer to it, so it is retired rather than deleted.
 {
-    return val;
+    TreeList pending;
+    pending.push_back(source);
+    while (!pending.empty())
+    {
+        Tree *tree = pending.back();
+        pending.pop_back();
+        while (Code *code = tree->Remove<Code>())
+        {
+            record(bytecode, "Retired code %p for %t", code, tree);
+            retired.push_back(code);
+        }
+        tree->Purge<DeclarationCode>();
+        if (Infix *infix = tree->AsInfix())
+        {
+            pending.push_back(infix->left);
+            pending.push_back(infix->right);
+        }
+        else if (Prefix *prefix = tree->AsPrefix())
+        {
+            pending.push_back(prefix->left);
+            pending.push_back(prefix->right);
+        }
+        else if (Postfix *postfix = tree->AsPostfix())
+        {
+            pending.push_back(postfix->left);
+            pending.push_back(postfix->right);
+        }
+        else if (Block *block = tree->AsBlock())
+        {
+            pending.push_back(block->child);
+        }
+    }
 }
 
 
@@ -105,6 +191,106 @@ Procedure *Bytecode::Compile(Context *ctx, Tree *what, Tree *type,
 }
 
 
+static bool declarationParameters(Context *ctx, Tree *pattern,
+                                  TreeIDs &inputs, Tree_p &type,
+                                  TreeList &args)
+// ----------------------------------------------------------------------------
+//   Define the parameters of a pattern, fail unless all are natural or real
+// ----------------------------------------------------------------------------
+//   Parameters are numbered in the order the interpreter binds them
+{
+    switch(pattern->Kind())
+    {
+    case NATURAL:
+    case REAL:
+    case TEXT:
+        return true;
+
+    case NAME:
+        // Parameters without a type are passed as closures
+        return false;
+
+    case BLOCK:
+        return declarationParameters(ctx, ((Block *) pattern)->child,
+                                     inputs, type, args);
+
+    case PREFIX:
+    {
+        Prefix *prefix = (Prefix *) pattern;
+        if (!prefix->left->AsName() &&
+            !declarationParameters(ctx, prefix->left, inputs, type, args))
+            return false;
+        return declarationParameters(ctx, prefix->right, inputs, type, args);
+    }
+
+    case POSTFIX:
+    {
+        Postfix *postfix = (Postfix *) pattern;
+        if (!postfix->right->AsName() &&
+            !declarationParameters(ctx, postfix->right, inputs, type, args))
+            return false;
+        return declarationParameters(ctx, postfix->left, inputs, type, args);
+    }
+
+    case INFIX:
+    {
+        Infix *infix = (Infix *) pattern;
+        if (infix->name == ":")
+        {
+            Name *name = infix->left->AsName();
+            Tree *bound = ctx->Bound(infix->right);
+            uint index = inputs.size();
+            if (!name || index >= args.size() ||
+                (bound != natural_type && bound != real_type))
+                return false;
+            Rewrite *rw = ctx->Define(infix, args[index]);
+            inputs[rw->left] = ~index;
+            return true;
+        }
+        if (infix->name == "as")
+        {
+            type = infix->right;
+            return declarationParameters(ctx, infix->left, inputs, type, args);
+        }
+        if (infix->name == "when")
+            return declarationParameters(ctx, infix->left, inputs, type, args);
+        return declarationParameters(ctx, infix->left, inputs, type, args) &&
+               declarationParameters(ctx, infix->right, inputs, type, args);
+    }
+    }
+    return false;
+}
+
+
+Procedure *Bytecode::Compile(Scope *scope, Infix *decl, TreeList &args)
+// ----------------------------------------------------------------------------
+//   Compile the body of a declaration, return null if it must be interpreted
+// ----------------------------------------------------------------------------
+{
+    // Names like 'A is 5' are interpreted, since they may be assigned
+    Context_p argsCtx = new Context(scope);
+    argsCtx->CreateScope();
+    TreeIDs   inputs;
+    Tree_p    type;
+    Tree     *pattern = decl->left;
+    if (pattern->AsName() ||
+        !declarationParameters(argsCtx, pattern, inputs, type, args))
+        return nullptr;
+    if (inputs.size() != args.size())
+        return nullptr;
+
+    // Errors during compilation only mean that we interpret the declaration
+    Errors     errors;
+    TreeList   captured;
+    Procedure *proc = Compile(argsCtx, decl->right, type, inputs, captured);
+    CodeSet    checked;
+    if (errors.Swallowed() || !proc || captured.size() ||
+        !proc->Runnable(checked))
+        return nullptr;
+    return proc;
+}
+
+
 
 // ============================================================================
 //
@@ -202,8 +388,8 @@ struct EvalOp : FailOp
             return success;
         }
 
-        // Otherwise, go to the fail bytecode
-        return fail;
+        // Otherwise, the code gave up, stop here
+        return nullptr;
     }
 
     virtual kstring     OpID()          { return "eval"; }
@@ -310,6 +496,33 @@ struct ClosureOp : Op
 };
 
 
+struct GlobalOp : Op
+// ----------------------------------------------------------------------------
+//    Read the current value of a global declaration, give up unless constant
+// ----------------------------------------------------------------------------
+{
+    GlobalOp(Infix *decl): decl(decl) {}
+    Infix_p decl;
+
+    virtual Op *        Run(Data data)
+    {
+        Tree *value = decl->right;
+        if (!value->IsConstant())
+        {
+            DataResult(data, nullptr);
+            return nullptr;
+        }
+        DataResult(data, value);
+        return success;
+    }
+    virtual kstring     OpID()  { return "global"; }
+    virtual void        Dump(std::ostream &out)
+    {
+        out << OpID() << "\t" << decl->left;
+    }
+};
+
+
 struct ValueOp : Op
 // ----------------------------------------------------------------------------
 //    Return a tree that we know was already evaluated
@@ -355,9 +568,9 @@ struct CallOp : Op
 //    Call a subroutine using the given inputs
 // ----------------------------------------------------------------------------
 {
-    CallOp(Code *target, uint outId, ParmOrder &parms)
+    CallOp(Procedure *target, uint outId, ParmOrder &parms)
         : target(target), outId(outId), parms(parms) {}
-    Code  *     target;
+    Procedure * target;
     int         outId;
     ParmOrder   parms;
 
@@ -366,22 +579,21 @@ struct CallOp : Op
         uint sz = parms.size();
         Data out = data + outId;
 
-        // Copy result and scope
-        DataResult(out, DataResult(data));
-        DataScope (out, DataScope (data));
-
-        // Copy all parameters
+        // Copy all parameters, the callee sets its own self and scope
         for (uint p = 0; p < sz; p++)
         {
             int parmId = parms[p];
-            out[~p] = data[parmId];
+            out[~int(p)] = data[parmId];
         }
-        Op *remaining = target->Run(out);
+        Op *remaining = target->Call(out);
         XL_ASSERT(!remaining);
         if (remaining)
             return remaining;
 
-        DataResult(data, out[0]);
+        // A null result means that the callee gave up
+        data[0] = out[0];
+        if (!data[0].Pointer())
+            return nullptr;
         return success;
     }
 
@@ -412,7 +624,12 @@ struct TypeCheckOp : FailOp
         Scope *scope = DataScope(data);
         Tree *cast = xl_typecheck(scope, data[type], data[value]);
         if (!cast)
+        {
+            // Without a failure exit, e.g. for a result type, give up
+            if (!fail)
+                DataResult(data, nullptr);
             return fail;
+        }
         DataResult(data, cast);
         return success;
     }
@@ -425,6 +642,177 @@ struct TypeCheckOp : FailOp
 };
 
 
+struct NumericOp : Op
+// ----------------------------------------------------------------------------
+//   Arithmetic or comparison on natural or real values
+// ----------------------------------------------------------------------------
+//   When lowered, the operation runs on unboxed values. The original opcode
+//   is kept for the generic path, e.g. to report errors or division by zero.
+{
+    enum Arith
+    {
+        ADD, SUB, MUL, UDIV, UREM, SHL, SHR, AND, OR, XOR, NEG, NOT,
+        EQ, NE, UGT, UGE, ULT, ULE, SGT, SGE, SLT, SLE,
+        FADD, FSUB, FMUL, FDIV, FNEG,
+        FEQ, FNE, FGT, FGE, FLT, FLE,
+        NONE
+    };
+
+    NumericOp(Opcode *opcode, Arith arith, int left, int right)
+        : opcode(opcode), arith(arith), left(left), right(right)
+    {
+        opcode->success = this;
+    }
+    ~NumericOp()
+    {
+        delete opcode;
+    }
+    Opcode *    opcode;
+    Arith       arith;
+    int         left, right;
+
+    virtual Op *        Run(Data data)
+    {
+        Op *next = opcode->Run(data);
+        return next == this ? success : next;
+    }
+
+    static Arith Lookup(Opcode *opcode)
+    {
+        static const struct { kstring name; Arith arith; } table[] =
+        {
+            { "Add", ADD },     { "Sub", SUB },         { "Mul", MUL },
+            { "UDiv", UDIV },   { "SDiv", UDIV },
+            { "URem", UREM },   { "SRem", UREM },
+            { "Shl", SHL },     { "LShr", SHR },        { "AShr", SHR },
+            { "And", AND },     { "Or", OR },           { "Xor", XOR },
+            { "Neg", NEG },     { "Not", NOT },
+            { "ICmpEQ", EQ },   { "ICmpNE", NE },
+            { "ICmpUGT", UGT }, { "ICmpUGE", UGE },
+            { "ICmpULT", ULT }, { "ICmpULE", ULE },
+            { "ICmpSGT", SGT }, { "ICmpSGE", SGE },
+            { "ICmpSLT", SLT }, { "ICmpSLE", SLE },
+            { "FAdd", FADD },   { "FSub", FSUB },       { "FMul", FMUL },
+            { "FDiv", FDIV },   { "FNeg", FNEG },
+            { "FCmpOEQ", FEQ }, { "FCmpONE", FNE },
+            { "FCmpOGT", FGT }, { "FCmpOGE", FGE },
+            { "FCmpOLT", FLT }, { "FCmpOLE", FLE },
+            { "FCmpUEQ", FEQ }, { "FCmpUNE", FNE },
+            { "FCmpUGT", FGT }, { "FCmpUGE", FGE },
+            { "FCmpULT", FLT }, { "FCmpULE", FLE },
+        };
+        kstring name = opcode->OpID();
+        for (auto &entry : table)
+            if (strcmp(entry.name, name) == 0)
+                return entry.arith;
+        return NONE;
+    }
+
+    static bool Operand(Data data, Registers &regs, int id, bool real,
+                        Register &value)
+    {
+        if (regs.Live(id))
+        {
+            value = regs.value[id];
+            return regs.IsReal(id) == real;
+        }
+        Tree *tree = data[id].Pointer();
+        if (!tree)
+            return false;
+        if (real)
+        {
+            if (Real *rval = tree->AsReal())
+            {
+                value.real = rval->value;
+                return true;
+            }
+            return false;
+        }
+        if (Natural *nval = tree->AsNatural())
+        {
+            value.natural = nval->value;
+            return true;
+        }
+        return false;
+    }
+
+    bool Compute(Data data, Registers &regs)
+    // ------------------------------------------------------------------------
+    //   Compute on unboxed values, return false to take the generic path
+    // ------------------------------------------------------------------------
+    {
+        bool real = arith >= FADD;
+        Register l, r, result;
+        result.natural = 0;
+        if (!Operand(data, regs, left, real, l) ||
+            !Operand(data, regs, right, real, r))
+            return false;
+
+        ulonglong ul = l.natural, ur = r.natural;
+        longlong  sl = longlong(ul), sr = longlong(ur);
+        double    fl = l.real, fr = r.real;
+        bool      test = false;
+        switch(arith)
+        {
+        case ADD:       result.natural = ul + ur;               break;
+        case SUB:       result.natural = ul - ur;               break;
+        case MUL:       result.natural = ul * ur;               break;
+        case UDIV:      if (!ur) return false;
+                        result.natural = ul / ur;               break;
+        case UREM:      if (!ur) return false;
+                        result.natural = ul % ur;               break;
+        case SHL:       result.natural = ul << ur;              break;
+        case SHR:       result.natural = ul >> ur;              break;
+        case AND:       result.natural = ul & ur;               break;
+        case OR:        result.natural = ul | ur;               break;
+        case XOR:       result.natural = ul ^ ur;               break;
+        case NEG:       result.natural = -sl;                   break;
+        case NOT:       result.natural = ~ul;                   break;
+        case FADD:      result.real = fl + fr;                  break;
+        case FSUB:      result.real = fl - fr;                  break;
+        case FMUL:      result.real = fl * fr;                  break;
+        case FDIV:      if (fr == 0.0) return false;
+                        result.real = fl / fr;                  break;
+        case FNEG:      result.real = -fl;                      break;
+
+        case EQ:        test = ul == ur;                        goto boolean;
+        case NE:        test = ul != ur;                        goto boolean;
+        case UGT:       test = ul >  ur;                        goto boolean;
+        case UGE:       test = ul >= ur;                        goto boolean;
+        case ULT:       test = ul <  ur;                        goto boolean;
+        case ULE:       test = ul <= ur;                        goto boolean;
+        case SGT:       test = sl >  sr;                        goto boolean;
+        case SGE:       test = sl >= sr;                        goto boolean;
+        case SLT:       test = sl <  sr;                        goto boolean;
+        case SLE:       test = sl <= sr;                        goto boolean;
+        case FEQ:       test = fl == fr;                        goto boolean;
+        case FNE:       test = fl != fr;                        goto boolean;
+        case FGT:       test = fl >  fr;                        goto boolean;
+        case FGE:       test = fl >= fr;                        goto boolean;
+        case FLT:       test = fl <  fr;                        goto boolean;
+        case FLE:       test = fl <= fr;                        goto boolean;
+        case NONE:      return false;
+        }
+
+        // Natural or real result stays unboxed in the result register
+        regs.Set(0, result, real);
+        return true;
+
+    boolean:
+        // Boolean results are shared names, no need for a register
+        data[0] = test ? xl_true : xl_false;
+        regs.Kill(0);
+        return true;
+    }
+
+    virtual kstring     OpID()  { return "numeric"; }
+    virtual void        Dump(std::ostream &out)
+    {
+        out << opcode->OpID() << "\t" << left << "," << right;
+    }
+};
+
+
 struct IndexOp : FailOp
 // ----------------------------------------------------------------------------
 //    Index operation, i.e. unknown prefix
@@ -531,15 +919,16 @@ struct IndexOp : FailOp
 
 struct FormErrorOp : Op
 // ----------------------------------------------------------------------------
-//   When we fail with all candidates, report an error
+//   When we fail with all candidates, give up and let the interpreter report
 // ----------------------------------------------------------------------------
 {
     FormErrorOp(Tree *self): self(self) {}
     Tree_p self;
     virtual Op *        Run(Data data)
     {
-        Ooops("No pattern matches $1", self);
-        return success;
+        record(bytecode, "No pattern matches %t", self);
+        DataResult(data, nullptr);
+        return nullptr;
     }
     virtual kstring     OpID()  { return "error"; };
 };
@@ -571,7 +960,8 @@ Code::Code(Context *ctx, Tree *self)
 // ----------------------------------------------------------------------------
 //    Create a new code from the given ops
 // ----------------------------------------------------------------------------
-    : context(ctx), self(self), ops(nullptr), instrs()
+    : context(ctx), self(self), ops(nullptr), instrs(),
+      streams(), lowered(&streams)
 {}
 
 
@@ -579,7 +969,8 @@ Code::Code(Context *context, Tree *self, Op *ops)
 // ----------------------------------------------------------------------------
 //    Create a new code from the given ops
 // ----------------------------------------------------------------------------
-    : context(context), self(self), ops(ops), instrs()
+    : context(context), self(self), ops(ops), instrs(),
+      streams(), lowered(&streams)
 {
     for (Op *op = ops; op; op = op->success)
         instrs.push_back(op);
@@ -623,7 +1014,14 @@ void Code::SetOps(Op **newOps, Ops *instrsToTakeOver, uint outId)
         if (FailOp *fop = dynamic_cast<FailOp *>(op))
             while (LabelOp *label = dynamic_cast<LabelOp *>(fop->fail))
                 fop->fail = label->success;
+
+        // Code that generated no instruction, e.g. 'N', starts at a label
+        if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+            while (LabelOp *label = dynamic_cast<LabelOp *>(eval->ops))
+                eval->ops = label->success;
     }
+    while (LabelOp *label = dynamic_cast<LabelOp *>(ops))
+        ops = label->success;
     for (uint i = 0; i < max; i++)
     {
         Op *op = instrs[i];
@@ -649,9 +1047,7 @@ Op *Code::Run(Data data)
     data[1] = scope;
 
     // Run all instructions we have in that code
-    Op *op = ops;
-    while (op)
-        op = op->Run(data);
+    Execute(data);
 
     // We were successful
     return success;
@@ -740,8 +1136,9 @@ Procedure::Procedure(Procedure *original, Data data, ParmOrder &capture)
       nInputs(original->nInputs), nLocals(original->nLocals),
       captured()
 {
-    // We have no instrs, so we don't "own" the instructions
+    // We have no instrs, so we don't "own" the instructions or streams
     ops = original->ops;
+    lowered = original->lowered;
 
     // Copy data in the closure from current data
     uint max = capture.size();
@@ -767,22 +1164,56 @@ Op *Procedure::Run(Data data)
 //   Create a new scope and run all instructions in the sequence
 // ----------------------------------------------------------------------------
 {
-    Scope *scope     = context->Symbols();
-    uint   frameSize = FrameSize();
-    uint   offset    = OffsetSize();
-    Data   frame     = new Tree_p[frameSize];
-    Data   newData   = frame + offset;
+    return Invoke(data, false);
+}
+
+
+Op *Procedure::Call(Data args)
+// ----------------------------------------------------------------------------
+//   Run with arguments that the caller no longer needs after the call
+// ----------------------------------------------------------------------------
+{
+    return Invoke(args, true);
+}
+
+
+Op *Procedure::Invoke(Data data, bool moveArgs)
+// ----------------------------------------------------------------------------
+//   Push a frame on the evaluation stack and run the procedure in it
+// ----------------------------------------------------------------------------
+//   When moveArgs is set, input arguments are moved from the caller without
+//   touching their reference count, the callee borrowing the caller's copy.
+{
+    Scope     *scope     = context->Symbols();
+    uint       frameSize = FrameSize();
+    uint       offset    = OffsetSize();
+    EvalStack &stack     = EvalStack::Current();
+
+    // Give up rather than overflow the machine stack
+    char here;
+    if (size_t(stack.base - &here) > EvalStack::STACK_BUDGET)
+    {
+        record(bytecode, "Stack depth exceeded in %t", self);
+        data[0] = nullptr;
+        return success;
+    }
+    Data       frame     = stack.Push(frameSize);
+    Data       newData   = frame + offset;
 
     // Initialize self and scope
     newData[0] = self;
     newData[1] = scope;
 
-    // Copy input arguments
+    // Move or copy input arguments
     uint inputs   = Inputs();
     Data oarg = &newData[-1];
     Data iarg = &data[-1];
-    for (uint a = 0; a < inputs; a++)
-        *oarg-- = *iarg--;
+    if (moveArgs)
+        for (uint a = 0; a < inputs; a++)
+            (*oarg--).Swap(*iarg--);
+    else
+        for (uint a = 0; a < inputs; a++)
+            *oarg-- = *iarg--;
 
     // Copy closure data if any
     uint closures = Closures();
@@ -794,16 +1225,13 @@ Op *Procedure::Run(Data data)
     }
 
     // Execute the following instructions in the newly created data context
-    Op *op = ops;
-    while (op)
-        op = op->Run(newData);
+    Execute(newData);
 
-    // Copy result and current context to the old data
-    Tree *result = DataResult(newData);
-    DataResult(data, result);
+    // Copy result to the old data
+    data[0] = newData[0];
 
-    // Destroy the frame, we no longer need it
-    delete[] frame;
+    // Pop the frame, releasing the values it holds
+    stack.Pop(frame, frameSize);
 
     // Evaluate next instruction
     return success;
@@ -825,6 +1253,106 @@ void Procedure::Dump(std::ostream &out)
 
 
 
+// ============================================================================
+//
+//   Evaluation stack
+//
+// ============================================================================
+
+const uint EvalStack::SEGMENT_SIZE;
+
+
+EvalStack::EvalStack()
+// ----------------------------------------------------------------------------
+//   Create an empty evaluation stack, segments are allocated on first push
+// ----------------------------------------------------------------------------
+    : depth(0), base(nullptr), segments(), current(0)
+{}
+
+
+EvalStack::~EvalStack()
+// ----------------------------------------------------------------------------
+//   Free the segments, releasing frames still live if the thread exits
+// ----------------------------------------------------------------------------
+{
+    for (Segment &segment : segments)
+        delete[] segment.base;
+}
+
+
+Data EvalStack::Push(uint size)
+// ----------------------------------------------------------------------------
+//   Return 'size' consecutive null slots for a new frame
+// ----------------------------------------------------------------------------
+{
+    // Check if there is room in the segment holding the top frame
+    depth++;
+    if (current < segments.size())
+    {
+        Segment &top = segments[current];
+        if (top.used + size <= top.size)
+        {
+            Data frame = top.base + top.used;
+            top.used += size;
+            return frame;
+        }
+        if (top.used)
+            current++;
+    }
+
+    // Allocate a segment unless there is a spare one large enough
+    if (current == segments.size() || segments[current].size < size)
+    {
+        uint    max     = size > SEGMENT_SIZE ? size : SEGMENT_SIZE;
+        Segment segment = { new Tree_p[max], max, 0 };
+        if (current < segments.size())
+        {
+            delete[] segments[current].base;
+            segments[current] = segment;
+        }
+        else
+        {
+            segments.push_back(segment);
+        }
+        record(bytecode, "Stack segment %u has %u slots", current, max);
+    }
+
+    Segment &top = segments[current];
+    Data frame = top.base;
+    top.used = size;
+    return frame;
+}
+
+
+void EvalStack::Pop(Data frame, uint size)
+// ----------------------------------------------------------------------------
+//   Release the values in the top frame and make its slots available
+// ----------------------------------------------------------------------------
+{
+    Segment &segment = segments[current];
+    XL_ASSERT(frame + size == segment.base + segment.used &&
+              "Popping a frame that is not on top of the stack");
+    for (uint s = 0; s < size; s++)
+        if (frame[s].Pointer())
+            frame[s] = nullptr;
+    segment.used -= size;
+    if (!segment.used && current)
+        current--;
+    depth--;
+}
+
+
+EvalStack &EvalStack::Current()
+// ----------------------------------------------------------------------------
+//   Return the evaluation stack for the current thread
+// ----------------------------------------------------------------------------
+{
+    static thread_local EvalStack stack;
+    return stack;
+}
+
+
+
 // ============================================================================
 //
 //   Building a code sequence and variants
@@ -837,11 +1365,11 @@ CodeBuilder::CodeBuilder(TreeList &captured)
 // ----------------------------------------------------------------------------
     : ops(nullptr), lastOp(&ops),
       inputs(), values(), captured(captured),
-      nEvals(0), nParms(0), candidates(0),
+      nValues(0), nEvals(0), nParms(0), candidates(0), matched(0),
       test(nullptr), resultType(nullptr),
       context(nullptr), parmsCtx(nullptr), argsCtx(nullptr),
       failOp(nullptr), successOp(nullptr),
-      instrs(), subexprs(), parms(), defer(false)
+      instrs(), subexprs(), types(), parms(), defer(false)
 {}
 
 
@@ -904,41 +1432,41 @@ void CodeBuilder::AddEval(int id, Op *op)
 }
 
 
-void CodeBuilder::AddTypeCheck(Context *context, Tree *what, Tree *type)
+bool CodeBuilder::AddTypeCheck(Context *context, Tree *what, Tree *type,
+                               int valueID)
 // ----------------------------------------------------------------------------
-//   Add type check if necessary
+//   Add type check if necessary, return true if we generated one
 // ----------------------------------------------------------------------------
+//   A dynamic type check leaves the possibly converted value as the result
 {
     if (type)
         if (Name *name = type->AsName())
             if (Tree *original = context->Bound(name))
                 type = original;
-    if (resultType)
-        if (Name *name = resultType->AsName())
-            if (Tree *original = context->Bound(name))
-                resultType = original;
 
-    // Unify form for 'catch-all' type
+    // Unify form for 'catch-all' type, which does not need a check
     if (!type)
         type = tree_type;
-    if (!resultType)
-        resultType = tree_type;
-    if (resultType == tree_type)
-        return;
+    if (type == tree_type)
+        return false;
 
     // Check if we have some static match
     if (what->IsConstant())
         if (xl_typecheck(context->Symbols(), type, what))
-            return;
-
-    // Check if types match statically
-    if (type == resultType)
-        return;
+            return false;
+    if (KnownType(context, what) == type)
+        return false;
 
     // Otherwise, we need to generate a dynamic match
-    int valueID = ValueID(what);
+    if (!valueID)
+    {
+        // Evaluating the type overwrites the result, save it first
+        valueID = ValueID(what);
+        Add(new StoreOp(valueID));
+    }
     int typeID = Evaluate(context, type);
     Add(new TypeCheckOp(valueID, typeID, failOp));
+    return true;
 }
 
 
@@ -969,7 +1497,7 @@ void CodeBuilder::InstructionsSuccess(uint neOld)
 //    At end of an instruction, mark success by recording number of evals
 // ----------------------------------------------------------------------------
 {
-    uint ne = values.size();
+    uint ne = nValues;
     if (nEvals < ne)
         nEvals = ne;
     if (ne > neOld)
@@ -1054,12 +1582,12 @@ static Tree *compileLookup(Scope *evalScope, Scope *declScope,
     Save<Tree_p>    saveSelf(builder->test, self);
     Save<Context_p> saveContext(builder->context, context);
     Save<Context_p> saveArgsCtx(builder->argsCtx, argsCtx);
+    Save<Tree_p>    saveResultType(builder->resultType, nullptr);
 
     // Create the exit point for failed evaluation
     Op *         oldFailOp = builder->failOp;
     Op *         failOp = new LabelOp("fail");
     builder->failOp = failOp;
-    builder->resultType = nullptr;
 
     // We start with new parameters for each candidate
     ParmOrder           noParms;
@@ -1105,6 +1633,16 @@ static Tree *compileLookup(Scope *evalScope, Scope *declScope,
             // Remove the instructions that were added and the failed exit
             *lastOp = nullptr;
             uint lastNow = builder->instrs.size();
+            Ops removed(builder->instrs.begin() + lastInstrSize,
+                        builder->instrs.end());
+            TreeOps &subexprs = builder->subexprs;
+            for (auto it = subexprs.begin(); it != subexprs.end(); )
+            {
+                if (count(removed.begin(), removed.end(), (*it).second))
+                    it = subexprs.erase(it);
+                else
+                    ++it;
+            }
             for (uint i = lastInstrSize; i < lastNow; i++)
                 delete builder->instrs[i];
             builder->instrs.resize(lastInstrSize);
@@ -1131,16 +1669,23 @@ static Tree *compileLookup(Scope *evalScope, Scope *declScope,
         // Cached callback - Make a copy
         XL_ASSERT(!opcode->success);
         Opcode *clone = opcode->Clone();
-        clone->SetParms(builder->parms);
-        builder->Add(clone);
+        ParmOrder &parms = builder->parms;
+        clone->SetParms(parms);
+        NumericOp::Arith arith = NumericOp::Lookup(clone);
+        if (arith != NumericOp::NONE && parms.size())
+            builder->Add(new NumericOp(clone, arith,
+                                       parms.front(), parms.back()));
+        else
+            builder->Add(clone);
         record(bytecode,
                "Compile %d:%d (%t) OPCODE %O SELF",
                depth, cindex, self, (Op *) opcode);
     }
     else if (isLeaf)
     {
-        // Assign an ID for names
-        builder->Evaluate(context, defined);
+        // Assign an ID for names, typed parameters generate no code
+        int id = builder->Evaluate(context, defined);
+        builder->Add(new ValueOp(id));
     }
     else
     {
@@ -1154,6 +1699,19 @@ static Tree *compileLookup(Scope *evalScope, Scope *declScope,
     // Successful evaluation
     builder->Success();
 
+    // If this is the only code generated, the result type is known
+    if (strength == CodeBuilder::ALWAYS && !builder->matched)
+    {
+        Tree *type = builder->resultType;
+        if (type)
+            if (Name *typeName = type->AsName())
+                if (Tree *found = argsCtx->Bound(typeName))
+                    type = found;
+        if (type == natural_type || type == real_type)
+            builder->types[self] = type;
+    }
+    builder->matched++;
+
     // Keep looking for other declarations
     record(bytecode, "Compile %d:%d (%t) SUCCESS",
            depth, cindex, self);
@@ -1204,6 +1762,7 @@ Procedure *CodeBuilder::Compile(Context *ctx, Tree *what,
         proc->nInputs = nArgs + captured.size();
         proc->nLocals = nEvals + nParms + 2;
         proc->captured = captured;
+        proc->Lower();
 
         record(bytecode_output, "Code %t: %O", what, (Op *) proc);
 
@@ -1263,6 +1822,7 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
     while (what)
     {
         Save<TreeIDs> saveEvals(values, values);
+        uint          firstValue = nValues;
 
         // Create new success exit for this expression
         Op *success = new LabelOp("success");
@@ -1270,6 +1830,7 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
 
         // Lookup candidates (and count them)
         Save<uint> saveCandidates(candidates, 0);
+        Save<uint> saveMatched(matched, 0);
         ctx->Lookup(what, compileLookup, this);
 
         if (candidates)
@@ -1283,7 +1844,7 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
             lastOp = &success->success;
             instrs.push_back(success);
 
-            InstructionsSuccess(saveEvals.saved.size());
+            InstructionsSuccess(firstValue);
             return true;
         }
 
@@ -1301,7 +1862,7 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
         case NAME:
             // If not looked up, return the original
             Add(new ConstOp(what));
-            InstructionsSuccess(saveEvals.saved.size());
+            InstructionsSuccess(firstValue);
             return true;
 
         case BLOCK:
@@ -1320,7 +1881,7 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
             Add(new ConstOp(what));
             if (hasDecls)
                 ctx->PopScope();
-            InstructionsSuccess(saveEvals.saved.size());
+            InstructionsSuccess(firstValue);
             return true;
         }
 
@@ -1349,7 +1910,7 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
                     name->value == "extern" ||
                     name->value == "data")
                 {
-                    InstructionsSuccess(saveEvals.saved.size());
+                    InstructionsSuccess(firstValue);
                     return true;
                 }
             }
@@ -1388,6 +1949,7 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
                         success = new LabelOp("lambda_s");
                         successOp = success;
                         Save<uint> saveCand(candidates, 0);
+                        Save<uint> saveMatched(matched, 0);
                         compileLookup(originalScope, originalScope,
                                       arg, lifx, this);
                         if (candidates)
@@ -1396,7 +1958,7 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
                             *lastOp = success;
                             lastOp = &success->success;
                             instrs.push_back(success);
-                            InstructionsSuccess(saveEvals.saved.size());
+                            InstructionsSuccess(firstValue);
                             return true;
                         }
                         delete success;
@@ -1418,7 +1980,7 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
                 instrs.push_back(failOp);
             }
             Add (new IndexOp(calleeID, argID, failOp));
-            InstructionsSuccess(saveEvals.saved.size());
+            InstructionsSuccess(firstValue);
             return true;
         }
 
@@ -1448,7 +2010,7 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
             if (name == "is")
             {
                 // Declarations evaluate last non-declaration result, or self
-                InstructionsSuccess(saveEvals.saved.size());
+                InstructionsSuccess(firstValue);
                 return true;
             }
 
@@ -1463,7 +2025,7 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
 
             // All other cases: return the input as is
             Add(new ConstOp(what));
-            InstructionsSuccess(saveEvals.saved.size());
+            InstructionsSuccess(firstValue);
             return true;
         }
         }
@@ -1489,7 +2051,8 @@ int CodeBuilder::ValueID(Tree *self)
     TreeIDs::iterator found = values.find(self);
     if (found == values.end())
     {
-        id = values.size() + 2;
+        // IDs are never reused, since code for sub-expressions may be shared
+        id = nValues++ + 2;
         values[self] = id;
     }
     else
@@ -1583,6 +2146,14 @@ int CodeBuilder::Evaluate(Context *ctx, Tree *self, bool deferEval)
             case GLOBAL:
             {
                 id = ValueID(rw);
+                if (!value->GetInfo<Opcode>())
+                {
+                    // Global values may be assigned, read them when used
+                    Op *global = new GlobalOp(rw);
+                    instrs.push_back(global);
+                    AddEval(id, global);
+                    evaluate = false;
+                }
                 break;
             }
 
@@ -1635,6 +2206,47 @@ int CodeBuilder::Evaluate(Context *ctx, Tree *self, bool deferEval)
 }
 
 
+Tree *CodeBuilder::KnownType(Context *ctx, Tree *self)
+// ----------------------------------------------------------------------------
+//   Return the natural or real type of a value if statically known
+// ----------------------------------------------------------------------------
+{
+    while (Block *block = self->AsBlock())
+        self = block->child;
+    if (self->AsNatural())
+        return natural_type;
+    if (self->AsReal())
+        return real_type;
+
+    // Sub-expressions that only matched a declaration with a known type
+    TreeTypes::iterator found = types.find(self);
+    if (found != types.end())
+        return (*found).second;
+
+    // Parameters that were type-checked by the caller
+    if (Name *name = self->AsName())
+    {
+        Rewrite_p rw;
+        Scope_p   scope;
+        if (ctx->Bound(name, true, &rw, &scope))
+        {
+            if (ScopeDepth(scope) == PARAMETER)
+            {
+                if (Tree *type = AnnotatedType(rw->left))
+                {
+                    if (Name *typeName = type->AsName())
+                        if (Tree *bound = ctx->Bound(typeName))
+                            type = bound;
+                    if (type == natural_type || type == real_type)
+                        return type;
+                }
+            }
+        }
+    }
+    return nullptr;
+}
+
+
 int CodeBuilder::EvaluationTemporary(Tree *self)
 // ----------------------------------------------------------------------------
 //    Create an evaluation temporary
@@ -1888,8 +2500,8 @@ CodeBuilder::strength CodeBuilder::Do(Name *what)
         return SOMETIMES;
     }
 
-    Evaluate(context, test, true);
-    Bind(what, test);
+    int id = Evaluate(context, test, true);
+    Bind(what, test, id);
     return ALWAYS;
 }
 
@@ -2009,28 +2621,47 @@ CodeBuilder::strength CodeBuilder::Do(Infix *what)
         {
             if (namedType == tree_type)
             {
-                Evaluate(context, test, true);
-                Bind(name, test);
+                int id = Evaluate(context, test, true);
+                Bind(name, test, id);
                 return ALWAYS;
             }
             Scope *scope = context->Symbols();
             if (Tree *cast = xl_typecheck(scope, namedType, test))
             {
                 test = cast;
-                Evaluate(context, test);
-                Bind(name, test, namedType);
+                int id = Evaluate(context, test);
+                Bind(name, test, id, namedType);
                 return ALWAYS;
             }
 
             // Check if this is a builtin type vs. a constant
             if (test->IsConstant())
                 return NEVER;
+
+            // Check if we statically know the machine type of the value
+            if (Tree *known = KnownType(context, test))
+            {
+                if (known == namedType)
+                {
+                    int id = Evaluate(context, test);
+                    Bind(name, test, id, namedType);
+                    return ALWAYS;
+                }
+                if (namedType == natural_type || namedType == text_type)
+                    return NEVER;
+            }
         }
 
         // In all other cases, we need do perform dynamic evaluation to check
-        Evaluate(context, test);
-        AddTypeCheck(context, test, type);
-        Bind(name, test, type);
+        int id = Evaluate(context, test);
+        if (AddTypeCheck(context, test, type, id) &&
+            namedType != natural_type && namedType != text_type)
+        {
+            // Bind the checked value, which may be converted, e.g. to real
+            id = ValueID(what);
+            Add(new StoreOp(id));
+        }
+        Bind(name, test, id, type);
         return SOMETIMES;
     }
 
@@ -2111,7 +2742,7 @@ CodeBuilder::strength CodeBuilder::DoLeftRight(Tree *wl, Tree *wr,
 }
 
 
-int CodeBuilder::Bind(Name *name, Tree *value, Tree *type)
+int CodeBuilder::Bind(Name *name, Tree *value, int valueID, Tree *type)
 // ----------------------------------------------------------------------------
 //   Enter a new binding in the current context
 // ----------------------------------------------------------------------------
@@ -2130,12 +2761,362 @@ int CodeBuilder::Bind(Name *name, Tree *value, Tree *type)
     outputs[rw->left] = parmId;
 
     // Record parameter order for calls
-    uint id = ValueID(value);
-    parms.push_back(id);
+    parms.push_back(valueID);
 
     return parmId;
 }
 
+
+
+// ============================================================================
+//
+//    Lowering ops into flat instruction streams
+//
+// ============================================================================
+
+void Code::Lower()
+// ----------------------------------------------------------------------------
+//   Lower the code into streams, stream 0 being the entry point
+// ----------------------------------------------------------------------------
+{
+    OpIndex lowered;
+    streams.clear();
+    Lower(ops, lowered);
+    record(bytecode, "Lowered %t into %u streams", self, streams.size());
+}
+
+
+uint Code::Lower(Op *entry, OpIndex &lowered)
+// ----------------------------------------------------------------------------
+//   Lower the ops reachable from entry into a stream, return its index
+// ----------------------------------------------------------------------------
+{
+    OpIndex::iterator found = lowered.find(entry);
+    if (found != lowered.end())
+        return (*found).second;
+    uint streamID = streams.size();
+    lowered[entry] = streamID;
+    streams.push_back(Stream());
+
+    // Number the reachable ops, keeping success paths contiguous
+    OpIndex index;
+    Ops     order, work;
+    work.push_back(entry);
+    while (!work.empty())
+    {
+        Op *op = work.back();
+        work.pop_back();
+        if (!op || index.count(op))
+            continue;
+        index[op] = order.size();
+        order.push_back(op);
+        work.push_back(op->Fail());
+        work.push_back(op->success);
+    }
+    auto indexOf = [&index](Op *op) -> uint
+    {
+        return op ? index[op] : uint(Instr::END);
+    };
+
+    // Build the instructions
+    Stream stream;
+    stream.reserve(order.size());
+    for (Op *op : order)
+    {
+        Instr instr = { op, 0, 0, indexOf(op->success), indexOf(op->Fail()),
+                        Instr::OP };
+        if (dynamic_cast<ConstOp *>(op))
+        {
+            instr.kind = Instr::CONST;
+        }
+        else if (ValueOp *value = dynamic_cast<ValueOp *>(op))
+        {
+            instr.kind = Instr::VALUE;
+            instr.a = value->id;
+        }
+        else if (StoreOp *store = dynamic_cast<StoreOp *>(op))
+        {
+            instr.kind = Instr::STORE;
+            instr.a = store->id;
+        }
+        else if (ClearOp *clear = dynamic_cast<ClearOp *>(op))
+        {
+            instr.kind = Instr::CLEAR;
+            instr.a = clear->lo;
+            instr.b = clear->hi;
+        }
+        else if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+        {
+            instr.kind = Instr::EVAL;
+            instr.a = eval->id;
+            instr.b = Lower(eval->ops, lowered);
+        }
+        else if (WhenClauseOp *when = dynamic_cast<WhenClauseOp *>(op))
+        {
+            instr.kind = Instr::WHEN;
+            instr.a = when->whenID;
+        }
+        else if (NumericOp *num = dynamic_cast<NumericOp *>(op))
+        {
+            instr.kind = Instr::ARITH;
+            instr.a = num->left;
+            instr.b = num->right;
+        }
+        stream.push_back(instr);
+    }
+
+    streams[streamID].swap(stream);
+    return streamID;
+}
+
+
+void Code::Execute(Data data)
+// ----------------------------------------------------------------------------
+//   Execute the lowered code if there is one, otherwise follow the ops
+// ----------------------------------------------------------------------------
+{
+    if (lowered->size())
+    {
+        // The result escapes, so it needs to be boxed if it is a register
+        Registers regs;
+        Execute(0, data, regs);
+        if (regs.live)
+            Box(data, regs);
+        return;
+    }
+
+    Op *op = ops;
+    while (op)
+        op = op->Run(data);
+}
+
+
+void Code::Execute(uint streamID, Data data, Registers &regs)
+// ----------------------------------------------------------------------------
+//   Execute one of the flat streams
+// ----------------------------------------------------------------------------
+{
+    Stream &code   = (*lowered)[streamID];
+    Instr  *stream = code.data();
+    uint    max    = code.size();
+    uint   pc     = 0;
+
+    while (pc < max)
+    {
+        Instr &instr = stream[pc];
+        switch(instr.kind)
+        {
+        // Values move between slots without escaping the frame
+        case Instr::CONST:
+            data[0] = ((ConstOp *) instr.op)->value;
+            regs.Kill(0);
+            pc = instr.next;
+            break;
+
+        case Instr::VALUE:
+            if (regs.Live(instr.a))
+            {
+                regs.Copy(0, instr.a);
+            }
+            else
+            {
+                data[0] = data[instr.a];
+                regs.Kill(0);
+            }
+            pc = instr.next;
+            break;
+
+        case Instr::STORE:
+            if (regs.Live(0))
+            {
+                if (uint(instr.a) < Registers::COUNT)
+                {
+                    regs.Copy(instr.a, 0);
+                    pc = instr.next;
+                    break;
+                }
+                Box(data, regs, 0);
+            }
+            data[instr.a] = data[0];
+            regs.Kill(instr.a);
+            pc = instr.next;
+            break;
+
+        case Instr::CLEAR:
+            for (int v = instr.a; v <= instr.b; v++)
+            {
+                regs.Kill(v);
+                if (data[v].Pointer())
+                    data[v] = nullptr;
+            }
+            pc = instr.next;
+            break;
+
+        case Instr::EVAL:
+            if (regs.Live(instr.a))
+            {
+                regs.Copy(0, instr.a);
+                pc = instr.next;
+                break;
+            }
+            if (data[instr.a].Pointer())
+            {
+                data[0] = data[instr.a];
+                regs.Kill(0);
+                pc = instr.next;
+                break;
+            }
+            Execute(instr.b, data, regs);
+            if (regs.Live(0))
+            {
+                if (uint(instr.a) < Registers::COUNT)
+                {
+                    regs.Copy(instr.a, 0);
+                    pc = instr.next;
+                    break;
+                }
+                Box(data, regs, 0);
+            }
+            if (data[0].Pointer())
+            {
+                data[instr.a] = data[0];
+                pc = instr.next;
+                break;
+            }
+
+            // The evaluation gave up, so do we
+            return;
+
+        case Instr::WHEN:
+            if (regs.Live(instr.a))
+                Box(data, regs, instr.a);
+            pc = data[instr.a] == xl_true ? instr.next : instr.fail;
+            break;
+
+        case Instr::ARITH:
+            if (((NumericOp *) instr.op)->Compute(data, regs))
+            {
+                pc = instr.next;
+                break;
+            }
+            // Fall through - the generic path reports errors
+
+        case Instr::OP:
+        {
+            // Generic ops may look at any slot, box all registers
+            if (regs.live)
+                Box(data, regs);
+
+            Op *op = instr.op;
+            Op *next = op->Run(data);
+            if (next == op->success)
+            {
+                pc = instr.next;
+                break;
+            }
+            if (next && next == op->Fail())
+            {
+                pc = instr.fail;
+                break;
+            }
+
+            // The op went somewhere that was not lowered, follow it
+            while (next)
+                next = next->Run(data);
+            return;
+        }
+        }
+    }
+}
+
+
+bool Code::Runnable(CodeSet &checked)
+// ----------------------------------------------------------------------------
+//   Check that the code only uses ops that behave like the interpreter
+// ----------------------------------------------------------------------------
+//   Other ops, e.g. builtins with side effects or lazy arguments, may have
+//   run when the code gives up and the interpreter evaluates it again.
+{
+    if (checked.count(this))
+        return true;
+    checked.insert(this);
+    if (Procedure *proc = dynamic_cast<Procedure *>(this))
+        if (proc->Closures())
+            return false;
+
+    std::set<Op *> owned(instrs.begin(), instrs.end());
+    for (Op *op : instrs)
+    {
+        if (ConstOp *constant = dynamic_cast<ConstOp *>(op))
+        {
+            if (!constant->value->IsConstant())
+                return false;
+        }
+        else if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+        {
+            Op *ops = eval->ops;
+            if (Code *code = dynamic_cast<Code *>(ops))
+            {
+                if (!code->Runnable(checked))
+                    return false;
+            }
+            else if (!dynamic_cast<NameOpcode *>(ops) && !owned.count(ops))
+            {
+                return false;
+            }
+        }
+        else if (CallOp *call = dynamic_cast<CallOp *>(op))
+        {
+            if (!call->target || !call->target->Runnable(checked))
+                return false;
+        }
+        else if (!dynamic_cast<ValueOp *>(op)           &&
+                 !dynamic_cast<StoreOp *>(op)           &&
+                 !dynamic_cast<ClearOp *>(op)           &&
+                 !dynamic_cast<NumericOp *>(op)         &&
+                 !dynamic_cast<TypeCheckOp *>(op)       &&
+                 !dynamic_cast<WhenClauseOp *>(op)      &&
+                 !dynamic_cast<MatchOp<Natural> *>(op)  &&
+                 !dynamic_cast<MatchOp<Real> *>(op)     &&
+                 !dynamic_cast<MatchOp<Text> *>(op)     &&
+                 !dynamic_cast<NameMatchOp *>(op)       &&
+                 !dynamic_cast<NameOpcode *>(op)        &&
+                 !dynamic_cast<GlobalOp *>(op)          &&
+                 typeid(*op) != typeid(FormErrorOp))
+        {
+            record(bytecode, "Code for %t cannot run %O", self, op);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void Code::Box(Data data, Registers &regs)
+// ----------------------------------------------------------------------------
+//   Box all live registers into their slots
+// ----------------------------------------------------------------------------
+{
+    for (int id = 0; regs.live; id++)
+        if (regs.Live(id))
+            Box(data, regs, id);
+}
+
+
+void Code::Box(Data data, Registers &regs, int id)
+// ----------------------------------------------------------------------------
+//   Box a live register into a natural or real tree in its slot
+// ----------------------------------------------------------------------------
+{
+    Register &value = regs.value[id];
+    TreePosition pos = self.Pointer()->Position();
+    if (regs.IsReal(id))
+        data[id] = new Real(value.real, pos);
+    else
+        data[id] = new Natural(value.natural, pos);
+    regs.Kill(id);
+}
+
 XL_END
 
 
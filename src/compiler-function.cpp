@@ -361,6 +361,7 @@ JIT::Value_p CompilerFunction::Compile(Tree *call,
             }
 
             evalfn.Finalize(false);
+            unit.Emitted(scope, rc, args, function);
         }
     }
 
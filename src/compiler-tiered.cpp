@@ -0,0 +1,367 @@
+// *****************************************************************************
+// compiler-tiered.cpp                                                XL project
+// *****************************************************************************
+//
+// File description:
+//
+//     Tiered execution: interpret first, compile hot declarations,
+//     then call the compiled code.
+//
+//     The interpreter counts the invocations of each declaration.
+//     When a declaration reaches the threshold, a call with the same
+//     arguments is compiled in the declaration scope by the optimizing
+//     compiler, which emits a function specialized for the argument types.
+//     That function is then found in the compiler's shared functions,
+//     and called directly by the interpreter for later invocations.
+//
+//     Compilation happens on the evaluating thread, at the invocation
+//     that makes the declaration hot. At that point, the arguments are
+//     bound and no tree, scope or context table is being modified.
+//
+// *****************************************************************************
+// This software is licensed under the GNU General Public License v3+
+// (C) 2020, Christophe de Dinechin <christophe@dinechin.org>
+// *****************************************************************************
+// This file is part of XL
+//
+// XL is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License,
+// or (at your option) any later version.
+//
+// XL is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with XL, in a file named COPYING.
+// If not, see <https://www.gnu.org/licenses/>.
+// *****************************************************************************
+
+#include "compiler-tiered.h"
+#include "compiler-unit.h"
+#include "errors.h"
+#include "options.h"
+#include "runtime.h"
+
+#include <recorder/recorder.h>
+
+
+RECORDER(tiered, 64, "Tiered execution (interpreter and compiler)");
+
+XL_BEGIN
+
+namespace Opt
+{
+NaturalOption   tierThreshold("tier_threshold",
+                              "Invocations before a declaration is compiled",
+                              100, 1, ~0U);
+}
+
+
+
+// ============================================================================
+//
+//    Tiered execution state for a declaration
+//
+// ============================================================================
+
+TieredInfo::TieredInfo(TreeList &args)
+// ----------------------------------------------------------------------------
+//   Check if the declaration can be compiled given its first arguments
+// ----------------------------------------------------------------------------
+    : calls(0),
+      state(COUNTING),
+      argKind(args.size() ? args[0]->Kind() : NAME),
+      arity(args.size()),
+      resultKind(NAME),
+      code(nullptr)
+{
+    bool ok = arity > 0 && arity <= MAX_ARGS;
+    ok = ok && (argKind == NATURAL || argKind == REAL);
+    for (Tree *arg : args)
+        ok = ok && arg->Kind() == argKind;
+    if (!ok)
+        state = FAILED;
+}
+
+
+template <typename Result, typename Arg>
+static Result call(void *code, Arg a[TieredInfo::MAX_ARGS], uint arity)
+// ----------------------------------------------------------------------------
+//   Call the compiled code with the unboxed arguments
+// ----------------------------------------------------------------------------
+{
+    switch(arity)
+    {
+    case 1: return ((Result (*)(Arg)) code)(a[0]);
+    case 2: return ((Result (*)(Arg, Arg)) code)(a[0], a[1]);
+    case 3: return ((Result (*)(Arg, Arg, Arg)) code)(a[0], a[1], a[2]);
+    case 4: return ((Result (*)(Arg,Arg,Arg,Arg)) code)(a[0],a[1],a[2],a[3]);
+    }
+    XL_ASSERT(!"Invalid arity for compiled declaration");
+    return Result();
+}
+
+
+template <typename Arg>
+static Tree *box(void *code, kind resultKind,
+                 Arg a[TieredInfo::MAX_ARGS], uint arity, TreePosition pos)
+// ----------------------------------------------------------------------------
+//   Call the compiled code, and box the result as a tree
+// ----------------------------------------------------------------------------
+{
+    switch(resultKind)
+    {
+    case NATURAL:
+        return new Natural(call<Natural::value_t>(code, a, arity), pos);
+    case REAL:
+        return new Real(call<Real::value_t>(code, a, arity), pos);
+    default:
+        return call<bool>(code, a, arity) ? xl_true : xl_false;
+    }
+}
+
+
+Tree *TieredInfo::Call(Tree *self, TreeList &args)
+// ----------------------------------------------------------------------------
+//   Call the compiled code if the arguments are of the expected kind
+// ----------------------------------------------------------------------------
+{
+    if (args.size() != arity)
+        return nullptr;
+    for (Tree *arg : args)
+        if (arg->Kind() != argKind)
+            return nullptr;
+
+    TreePosition pos = self->Position();
+    if (argKind == NATURAL)
+    {
+        Natural::value_t a[MAX_ARGS];
+        for (uint i = 0; i < arity; i++)
+            a[i] = ((Natural *) args[i].Pointer())->value;
+        return box(code, resultKind, a, arity, pos);
+    }
+
+    Real::value_t a[MAX_ARGS];
+    for (uint i = 0; i < arity; i++)
+        a[i] = ((Real *) args[i].Pointer())->value;
+    return box(code, resultKind, a, arity, pos);
+}
+
+
+
+// ============================================================================
+//
+//    Tiered compiler
+//
+// ============================================================================
+
+TieredCompiler::TieredCompiler(kstring name, unsigned opts,
+                               int argc, char **argv)
+// ----------------------------------------------------------------------------
+//   Create the tiered compiler
+// ----------------------------------------------------------------------------
+    : compiler(name, opts < 2 ? 2 : opts, argc, argv)
+{
+    tiered = this;
+    record(tiered, "Created tiered compiler %p", this);
+}
+
+
+TieredCompiler::~TieredCompiler()
+// ----------------------------------------------------------------------------
+//   Stop calling compiled code
+// ----------------------------------------------------------------------------
+{
+    if (tiered == this)
+        tiered = nullptr;
+    record(tiered, "Destroyed tiered compiler %p", this);
+}
+
+
+Tree *TieredCompiler::Invoke(Scope *scope, Tree *self,
+                             Infix *decl, TreeList &args)
+// ----------------------------------------------------------------------------
+//   Count invocations, compile hot declarations, call them once compiled
+// ----------------------------------------------------------------------------
+{
+    TieredInfo *info = decl->GetInfo<TieredInfo>();
+    if (!info)
+    {
+        info = new TieredInfo(args);
+        decl->SetInfo<TieredInfo>(info);
+    }
+
+    switch(info->state)
+    {
+    case TieredInfo::COUNTING:
+    {
+        if (++info->calls < Opt::tierThreshold)
+            return nullptr;
+
+        // Errors here only mean we keep interpreting the declaration
+        Errors errors;
+        bool compiled = Compile(scope, decl, args, info);
+        bool ok = !errors.Swallowed() && compiled;
+        record(tiered, "Compiled %t after %u calls: %+s",
+               decl->left, info->calls, ok ? "ready" : "failed");
+        info->state = ok ? TieredInfo::COMPILED : TieredInfo::FAILED;
+        if (!ok)
+            return nullptr;
+        return info->Call(self, args);
+    }
+
+    case TieredInfo::COMPILED:
+        return info->Call(self, args);
+
+    default:
+        return nullptr;
+    }
+}
+
+
+void TieredCompiler::Invalidate(Tree *source)
+// ----------------------------------------------------------------------------
+//   Forget the compiled code for a declaration that was reloaded
+// ----------------------------------------------------------------------------
+//   The declaration starts counting calls again, and is recompiled with its
+//   new body once hot.
+{
+    Interpreter::Invalidate(source);
+    if (Infix *decl = source->AsInfix())
+        if (decl->Purge<TieredInfo>())
+            record(tiered, "Invalidated %t", decl->left);
+}
+
+
+bool TieredCompiler::Compile(Scope *scope, Infix *decl, TreeList &args,
+                             TieredInfo *info)
+// ----------------------------------------------------------------------------
+//   Compile a call to the declaration, and find the specialized function
+// ----------------------------------------------------------------------------
+{
+    // Build a call like 'fib 17' from a pattern like 'fib N:natural'
+    uint index = 0;
+    Tree_p call = Instance(PatternBase(decl->left), args, index);
+    if (!call || index != args.size())
+        return false;
+
+    // Compile that call, which emits a function for the declaration
+    {
+        CompilerUnit unit(compiler, scope, call);
+        eval_fn code = unit.Compile();
+        if (!code || code == xl_identity)
+            return false;
+    }
+
+    // Find the function specialized for the argument types
+    for (auto &shared : compiler.functions)
+    {
+        const CompiledKey &key = shared.first;
+        if (key.kind != CompiledKey::REWRITE ||
+            key.tree != decl ||
+            key.types.size() != info->arity)
+            continue;
+
+        bool natural = info->argKind == NATURAL;
+        bool match = true;
+        for (JIT::Type_p type : key.types)
+            match = match && (natural
+                              ? type->isIntegerTy(64)
+                              : type->isDoubleTy());
+        if (!match)
+            continue;
+
+        JIT::Type_p ret = shared.second.type->getReturnType();
+        if (ret->isIntegerTy(64))
+            info->resultKind = NATURAL;
+        else if (ret->isDoubleTy())
+            info->resultKind = REAL;
+        else if (ret->isIntegerTy(1))
+            info->resultKind = NAME;
+        else
+            return false;
+
+        info->code = compiler.jit.ExecutableCode(shared.second.name);
+        return info->code != nullptr;
+    }
+    return false;
+}
+
+
+Tree *TieredCompiler::Instance(Tree *pattern, TreeList &args, uint &index)
+// ----------------------------------------------------------------------------
+//   Replace the parameters in a pattern with argument values
+// ----------------------------------------------------------------------------
+//   The parameters are visited in the same order as interpreter bindings
+{
+    switch(pattern->Kind())
+    {
+    case NATURAL:
+    case REAL:
+    case TEXT:
+        return pattern;
+
+    case NAME:
+        if (index >= args.size())
+            return nullptr;
+        return args[index++];
+
+    case BLOCK:
+    {
+        Block *block = (Block *) pattern;
+        Tree *child = Instance(block->child, args, index);
+        if (!child)
+            return nullptr;
+        return new Block(block, child);
+    }
+
+    case PREFIX:
+    {
+        Prefix *prefix = (Prefix *) pattern;
+        Tree *left = prefix->left;
+        if (!left->AsName())
+            left = Instance(left, args, index);
+        Tree *right = left ? Instance(prefix->right, args, index) : nullptr;
+        if (!right)
+            return nullptr;
+        return new Prefix(prefix, left, right);
+    }
+
+    case POSTFIX:
+    {
+        Postfix *postfix = (Postfix *) pattern;
+        Tree *right = postfix->right;
+        if (!right->AsName())
+            right = Instance(right, args, index);
+        Tree *left = right ? Instance(postfix->left, args, index) : nullptr;
+        if (!left)
+            return nullptr;
+        return new Postfix(postfix, left, right);
+    }
+
+    case INFIX:
+    {
+        Infix *infix = (Infix *) pattern;
+        if (infix->name == ":")
+        {
+            if (index >= args.size())
+                return nullptr;
+            return args[index++];
+        }
+        if (IsTypeAnnotation(infix) || IsPatternCondition(infix))
+            return Instance(infix->left, args, index);
+
+        Tree *left = Instance(infix->left, args, index);
+        Tree *right = left ? Instance(infix->right, args, index) : nullptr;
+        if (!right)
+            return nullptr;
+        return new Infix(infix, left, right);
+    }
+    }
+    return nullptr;
+}
+
+XL_END
@@ -0,0 +1,96 @@
+#ifndef COMPILER_TIERED_H
+#define COMPILER_TIERED_H
+// *****************************************************************************
+// compiler-tiered.h                                                  XL project
+// *****************************************************************************
+//
+// File description:
+//
+//     Tiered execution, where code starts running in the interpreter,
+//     and declarations that are invoked often are compiled by the
+//     optimizing compiler.
+//
+//     Once the compiled code for a declaration is ready, the interpreter
+//     calls it directly instead of evaluating the body of the declaration.
+//
+//
+// *****************************************************************************
+// This software is licensed under the GNU General Public License v3+
+// (C) 2020, Christophe de Dinechin <christophe@dinechin.org>
+// *****************************************************************************
+// This file is part of XL
+//
+// XL is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License,
+// or (at your option) any later version.
+//
+// XL is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with XL, in a file named COPYING.
+// If not, see <https://www.gnu.org/licenses/>.
+// *****************************************************************************
+
+#include "interpreter.h"
+#include "compiler.h"
+
+
+XL_BEGIN
+
+struct TieredInfo : Info
+// ----------------------------------------------------------------------------
+//   Tiered execution state, recorded on a declaration
+// ----------------------------------------------------------------------------
+//   Only declarations taking up to MAX_ARGS arguments that are all naturals
+//   or all reals are compiled, since the interpreter must then call the
+//   specialized function directly with unboxed values.
+{
+    enum State { COUNTING, COMPILED, FAILED };
+    enum { MAX_ARGS = 4 };
+
+    TieredInfo(TreeList &args);
+    Tree *              Call(Tree *self, TreeList &args);
+
+public:
+    uint                calls;          // Invocations while counting
+    State               state;          // Compilation state
+    kind                argKind;        // NATURAL or REAL
+    uint                arity;          // Number of arguments
+    kind                resultKind;     // NATURAL, REAL or NAME for booleans
+    void *              code;           // Compiled code once COMPILED
+};
+
+
+struct TieredCompiler : Interpreter
+// ----------------------------------------------------------------------------
+//   Interpreter that compiles hot declarations
+// ----------------------------------------------------------------------------
+//   The compiler reads trees, scopes and their Info chains, which the
+//   interpreter modifies as it evaluates. So it runs on the evaluating
+//   thread, when the interpreter invokes a declaration that became hot.
+{
+    TieredCompiler(kstring name, unsigned opts, int argc, char **argv);
+    ~TieredCompiler();
+
+    Tree *              Invoke(Scope *scope, Tree *self,
+                               Infix *decl, TreeList &args) override;
+    void                Invalidate(Tree *source) override;
+
+private:
+    bool                Compile(Scope *scope, Infix *decl, TreeList &args,
+                                TieredInfo *info);
+    static Tree *       Instance(Tree *pattern, TreeList &args, uint &index);
+
+private:
+    Compiler            compiler;
+};
+
+XL_END
+
+RECORDER_DECLARE(tiered);
+
+#endif // COMPILER_TIERED_H
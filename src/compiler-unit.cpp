@@ -58,10 +58,13 @@
 #include "runtime.h"
 #include "llvm-crap.h"
 #include "native.h"
+#include "main.h"
+#include "serializer.h"
 
 #include <recorder/recorder.h>
 #include <stdio.h>
 #include <sstream>
+#include <algorithm>
 
 
 RECORDER(compiler_unit, 64, "Compilation unit (where all compilation happens)");
@@ -81,7 +84,8 @@ CompilerUnit::CompilerUnit(Compiler &compiler, Scope *scope, Tree *source)
       source(source),
       types(new CompilerTypes(scope)),
       globals(),
-      compiled()
+      compiled(),
+      emitted()
 {
     // Local copy of the types for the macro below
     JIT::IntegerType_p  booleanTy        = compiler.booleanTy;
@@ -184,14 +188,100 @@ eval_fn CompilerUnit::Compile()
         return xl_identity;
     }
 
+    if (Opt::jitCache)
+        jit.CacheKey(CacheKey());
     eval_fn result = function.Finalize(true);
     record(compiler_unit, "Compilation of %t returned %p",
            source, (void *) result);
     if (errors.HadErrors())
     {
         Ooops("Finalization failed", source);
-        result = xl_identity;
+        return xl_identity;
     }
+
+    // The code now exists, later units can link to the functions we emitted
+    for (auto &e : emitted)
+        compiler.functions.insert(e);
+    record(compiler_unit, "Unit %p shared %u functions, %u total",
+           this, emitted.size(), compiler.functions.size());
+    return result;
+}
+
+
+static void CacheKeyPositions(Serializer &serializer, Tree *tree)
+// ----------------------------------------------------------------------------
+//   Add the positions in a tree, since boxing code embeds them
+// ----------------------------------------------------------------------------
+{
+    while (tree)
+    {
+        serializer.WriteUnsigned(tree->Position());
+        switch(tree->Kind())
+        {
+        case INFIX:
+            CacheKeyPositions(serializer, ((Infix *) tree)->left);
+            tree = ((Infix *) tree)->right;
+            break;
+        case PREFIX:
+            CacheKeyPositions(serializer, ((Prefix *) tree)->left);
+            tree = ((Prefix *) tree)->right;
+            break;
+        case POSTFIX:
+            CacheKeyPositions(serializer, ((Postfix *) tree)->right);
+            tree = ((Postfix *) tree)->left;
+            break;
+        case BLOCK:
+            tree = ((Block *) tree)->child;
+            break;
+        default:
+            tree = nullptr;
+            break;
+        }
+    }
+}
+
+
+text CompilerUnit::CacheKey()
+// ----------------------------------------------------------------------------
+//   Describe what the unit is built from, to identify it in the JIT cache
+// ----------------------------------------------------------------------------
+//   This is the source and the compiled rewrites with their machine types.
+//   Each rewrite is described separately, and the descriptions are sorted,
+//   because the order of the compiled table depends on addresses.
+{
+    Serializer serializer;
+    std::vector<text> parts;
+    for (auto &c : compiled)
+    {
+        const CompiledKey &key = c.first;
+        if (!c.second)
+            continue;
+        serializer.Reset();
+        serializer.WriteUnsigned(key.kind);
+        if (key.tree)
+        {
+            key.tree->Do(serializer);
+            CacheKeyPositions(serializer, key.tree);
+        }
+        for (JIT::Type_p type : key.types)
+        {
+            text name;
+            raw_string_ostream os(name);
+            type->print(os);
+            serializer.WriteText(os.str());
+        }
+        serializer.WriteText(c.second->getName().str());
+        parts.push_back(serializer.Buffer());
+    }
+    std::sort(parts.begin(), parts.end());
+
+    serializer.Reset();
+    serializer.WriteUnsigned(Opt::optimize.value);
+    source->Do(serializer);
+    CacheKeyPositions(serializer, source);
+    text result = serializer.Buffer();
+    for (auto &part : parts)
+        result += part;
     return result;
 }
 
@@ -217,24 +307,84 @@ void CompilerUnit::Global(Tree *tree, JIT::Value_p value)
 }
 
 
+static JIT::Signature CompiledTypes(const JIT::Values &args)
+// ----------------------------------------------------------------------------
+//    Return the machine types of the arguments, used as part of the key
+// ----------------------------------------------------------------------------
+{
+    JIT::Signature types;
+    for (auto value : args)
+        types.push_back(JIT::Type(value));
+    return types;
+}
+
+
+static inline bool SharedFunctions()
+// ----------------------------------------------------------------------------
+//    Check if code emitted by a unit outlives it, so that others can use it
+// ----------------------------------------------------------------------------
+{
+#if LLVM_VERSION < 900
+    return false;               // Modules are removed with the unit
+#else
+    return !Opt::emitIR;        // Nothing gets emitted with -emit_ir
+#endif
+}
+
+
 JIT::Function_p &CompilerUnit::Compiled(Scope *scope,
                                         RewriteCandidate *rc,
                                         const JIT::Values &args)
 // ----------------------------------------------------------------------------
 //    Return a unique entry corresponding to this overload
 // ----------------------------------------------------------------------------
+//    If the function is not in this unit, but an earlier unit emitted code
+//    for the same rewrite, scope and argument types, declare it so we link
+//    to it. The same key is used for both tables, see Emitted
 {
-    // Build a unique key to check if we already have the function in cache
-    std::ostringstream os;
-    os << (void *) rc->rewrite << "@" << (void *) scope;
-    for (auto value : args)
+    JIT::Signature types = CompiledTypes(args);
+    CompiledKey key(CompiledKey::REWRITE, rc->rewrite, scope, types);
+    JIT::Function_p &function = compiled[key];
+    if (!function && SharedFunctions())
     {
-        JIT::Type_p type = JIT::Type(value);
-        os << '|' << (void *) type;
+        auto found = compiler.functions.find(key);
+        if (found != compiler.functions.end())
+        {
+            CompiledFunction &cf = found->second;
+            function = jit.Function(cf.type, cf.name);
+            record(compiler_unit, "Reusing %s for %t in unit %p",
+                   cf.name.c_str(), rc->rewrite, this);
+        }
     }
-    text key = os.str();
+    return function;
+}
 
-    return compiled[key];
+
+void CompilerUnit::Emitted(Scope *scope,
+                           RewriteCandidate *rc,
+                           const JIT::Values &args,
+                           JIT::Function_p function)
+// ----------------------------------------------------------------------------
+//    Record a function this unit generated, to share it if compilation works
+// ----------------------------------------------------------------------------
+{
+    if (!SharedFunctions())
+        return;
+
+    // Boxed return types are specific to a unit and cannot be shared
+    JIT::FunctionType_p type = function->getFunctionType();
+    if (type->getReturnType()->isStructTy())
+        return;
+
+    // Give the function a unique name, so that symbols never collide
+    std::ostringstream os;
+    os << rc->FunctionName() << "." << compiler.functionsEmitted++;
+    text name = os.str();
+    function->setName(name);
+
+    JIT::Signature types = CompiledTypes(args);
+    CompiledKey key(CompiledKey::REWRITE, rc->rewrite, scope, types);
+    emitted.push_back(std::make_pair(key, CompiledFunction{rc, name, type}));
 }
 
 
@@ -243,10 +393,7 @@ JIT::Function_p &CompilerUnit::CompiledUnbox(JIT::Type_p type)
 //    Return a unique entry corresponding to this unbox function
 // ----------------------------------------------------------------------------
 {
-    // Build a unique key to check if we already have the function in cache
-    std::ostringstream os;
-    os << "Unbox" << (void *) type;
-    text key = os.str();
+    CompiledKey key(CompiledKey::UNBOX, nullptr, nullptr, { type });
     return compiled[key];
 }
 
@@ -256,9 +403,7 @@ JIT::Function_p &CompilerUnit::CompiledClosure(Scope *scope, Tree *expr)
 //    Return a unique function entry for the closure function
 // ----------------------------------------------------------------------------
 {
-    std::ostringstream os;
-    os << "Closure" << (void *) expr << "@" << (void *) scope;
-    text key = os.str();
+    CompiledKey key(CompiledKey::CLOSURE, expr, scope);
     return compiled[key];
 }
 
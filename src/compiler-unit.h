@@ -41,11 +41,15 @@
 #include "compiler-types.h"
 #include "llvm-crap.h"
 #include <map>
+#include <unordered_map>
+#include <vector>
 
 XL_BEGIN
 
 typedef std::map<Tree *, JIT::Value_p>  value_map;
-typedef std::map<text, JIT::Function_p> compiled_map;
+typedef std::unordered_map<CompiledKey, JIT::Function_p, CompiledKey::Hash>
+                                        compiled_map;
+typedef std::vector<std::pair<CompiledKey, CompiledFunction>> emitted_list;
 typedef std::set<JIT::Type_p>           closure_set;
 
 class CompilerUnit
@@ -61,6 +65,7 @@ class CompilerUnit
     CompilerTypes_p     types;          // Type inferences for this unit
     value_map           globals;        // Global definitions in the unit
     compiled_map        compiled;       // Already compiled functions
+    emitted_list        emitted;        // Functions to share once compiled
     closure_set         clotypes;       // Closure types
 
     friend class        CompilerPrototype;
@@ -86,11 +91,18 @@ public:
                                  const JIT::Values &);
     JIT::Function_p &   CompiledUnbox(JIT::Type_p type);
     JIT::Function_p &   CompiledClosure(Scope *, Tree *expr);
+    void                Emitted(Scope *,
+                                RewriteCandidate *,
+                                const JIT::Values &,
+                                JIT::Function_p function);
 
     // Closure types management
     bool                IsClosureType(JIT::Type_p type);
     void                AddClosureType(JIT::Type_p type);
 
+    // Identification of the unit for the JIT object cache
+    text                CacheKey();
+
 private:
     // Import all runtime functions
 #define MTYPE(Name, Arity, Code)
@@ -120,7 +120,9 @@ Compiler::Compiler(kstring moduleName, unsigned opts, int argc, char **argv)
 #undef TREE2
 
       evalTy            (jit.FunctionType(treePtrTy, {scopePtrTy, treePtrTy})),
-      evalFnTy          (jit.PointerType(evalTy))
+      evalFnTy          (jit.PointerType(evalTy)),
+      functions         (),
+      functionsEmitted  (0)
 {
     record(compiler, "Created compiler %p", this);
 
@@ -40,9 +40,11 @@
 #include "tree.h"
 #include "context.h"
 #include "evaluator.h"
+#include "rewrites.h"
 #include "llvm-crap.h"
 #include <map>
 #include <set>
+#include <unordered_map>
 
 
 
@@ -57,6 +59,69 @@ RECORDER_DECLARE(compiler_warning);
 RECORDER_DECLARE(compiler_error);
 
 XL_BEGIN
+// ============================================================================
+//
+//    Cache of specialized functions
+//
+// ============================================================================
+
+struct CompiledKey
+// ----------------------------------------------------------------------------
+//   Identify a specialized function: tree, scope and argument machine types
+// ----------------------------------------------------------------------------
+{
+    enum Kind { REWRITE, UNBOX, CLOSURE };
+
+    CompiledKey(Kind kind, Tree *tree, Scope *scope,
+                const JIT::Signature &types = JIT::Signature())
+        : kind(kind), tree(tree), scope(scope), types(types) {}
+
+    bool operator==(const CompiledKey &o) const
+    {
+        return kind == o.kind && tree == o.tree && scope == o.scope &&
+            types == o.types;
+    }
+
+    struct Hash
+    {
+        size_t operator()(const CompiledKey &key) const
+        {
+            size_t h = key.kind;
+            auto combine = [&h](const void *p)
+            {
+                h ^= std::hash<const void *>()(p)
+                    + 0x9e3779b9 + (h << 6) + (h >> 2);
+            };
+            combine(key.tree);
+            combine(key.scope);
+            for (JIT::Type_p type : key.types)
+                combine(type);
+            return h;
+        }
+    };
+
+    Kind                kind;
+    Tree *              tree;
+    Scope *             scope;
+    JIT::Signature      types;
+};
+
+
+struct CompiledFunction
+// ----------------------------------------------------------------------------
+//   A function emitted by an earlier unit, which later units can link to
+// ----------------------------------------------------------------------------
+//   The candidate keeps the pattern and scopes that the code refers to alive
+{
+    RewriteCandidate_p  candidate;
+    text                name;
+    JIT::FunctionType_p type;
+};
+typedef std::unordered_map<CompiledKey, CompiledFunction, CompiledKey::Hash>
+    compiled_functions;
+
+
+
 // ============================================================================
 //
 //    Global structures to access the LLVM just-in-time compiler
@@ -126,6 +191,10 @@ public:
     JIT::PointerType_p  scopePtrTy;
     JIT::FunctionType_p evalTy;
     JIT::PointerType_p  evalFnTy;
+
+    // Functions emitted by earlier units, see CompilerUnit::Compiled
+    compiled_functions  functions;
+    uint                functionsEmitted;
 };
 
 
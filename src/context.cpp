@@ -54,8 +54,10 @@
 #include "compiler.h"
 #endif // INTERPRETER_ONLY
 
+#include <algorithm>
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
 #include <sstream>
 #include <sys/stat.h>
 
@@ -64,13 +66,30 @@ RECORDER(scope_lookup, 16, "Lookup items from a scope");
 
 XL_BEGIN
 
+// ============================================================================
+//
+//   Options
+//
+// ============================================================================
+
+namespace Opt
+{
+NaturalOption   tableScopeDepth("table_scope_depth",
+                                "Depth of a scope that triggers building "
+                                "a flat table for it (0 to disable)",
+                                16, 0, 64);
+}
+
+
+
 // ============================================================================
 //
 //   Context: Representation of execution context
 //
 // ============================================================================
 
-uint Context::hasRewritesForKind = 0;
+uint  Context::hasRewritesForKind = 0;
+ulong Context::generation = 0;
 
 Context::Context()
 // ----------------------------------------------------------------------------
@@ -166,6 +185,22 @@ bool Context::ProcessDeclarations(Tree *what)
 // ----------------------------------------------------------------------------
 //   Process all declarations, return true if there are instructions
 // ----------------------------------------------------------------------------
+//   Declarations are collected first, then entered as a batch
+{
+    RewriteList decls;
+    bool result = CollectDeclarations(what, decls);
+    if (decls.size() > 1)
+        EnterAll(decls);
+    else if (decls.size())
+        Enter(decls[0]);
+    return result;
+}
+
+
+bool Context::CollectDeclarations(Tree *what, RewriteList &decls)
+// ----------------------------------------------------------------------------
+//   Collect all declarations in order, return true if there are instructions
+// ----------------------------------------------------------------------------
 {
     Tree_p next   = nullptr;
     bool   result = false;
@@ -177,7 +212,7 @@ bool Context::ProcessDeclarations(Tree *what)
         {
             if (IsDeclaration(infix))
             {
-                Enter(infix);
+                decls.push_back(infix);
                 isInstruction = false;
             }
             else if (IsSequence(infix))
@@ -187,13 +222,13 @@ bool Context::ProcessDeclarations(Tree *what)
                 {
                     isInstruction = false;
                     if (IsDeclaration(left))
-                        Enter(left);
+                        decls.push_back(left);
                     else
-                        isInstruction = ProcessDeclarations(left);
+                        isInstruction = CollectDeclarations(left, decls);
                 }
                 else if (Prefix *left = infix->left->AsPrefix())
                 {
-                    isInstruction = ProcessDeclarations(left);
+                    isInstruction = CollectDeclarations(left, decls);
                 }
                 next = infix->right;
             }
@@ -204,7 +239,9 @@ bool Context::ProcessDeclarations(Tree *what)
             {
                 if (pname->value == "data")
                 {
-                    Define(prefix->right, xl_self);
+                    Tree *pattern = prefix->right;
+                    decls.push_back(new Infix("is", pattern, xl_self,
+                                              pattern->Position()));
                     isInstruction = false;
                 }
                 else if (pname->value == "extern")
@@ -215,7 +252,10 @@ bool Context::ProcessDeclarations(Tree *what)
                     if (normalForm)
                     {
                         // Process C declarations only in optimized mode
-                        Define(normalForm->left, normalForm->right);
+                        Tree *pattern = normalForm->left;
+                        decls.push_back(new Infix("is",
+                                                  pattern, normalForm->right,
+                                                  pattern->Position()));
                         prefix->SetInfo<CDeclaration>(pcd);
                         isInstruction = false;
                     }
@@ -309,14 +349,14 @@ Rewrite *Context::Define(text name, Tree *value, bool overwrite)
 }
 
 
-Rewrite *Context::Enter(Infix *rewrite, bool overwrite)
+static bool AcceptDeclaration(Infix *rewrite)
 // ----------------------------------------------------------------------------
-//   Enter a known declaration
+//   Check if a declaration should be entered, validate it if so
 // ----------------------------------------------------------------------------
 {
     // If the rewrite is not good, just exit
     if (!IsDeclaration(rewrite))
-        return nullptr;
+        return false;
 
     // In interpreted mode, just skip any C declaration
 #ifndef INTERPRETER_ONLY
@@ -325,21 +365,59 @@ Rewrite *Context::Enter(Infix *rewrite, bool overwrite)
         if (Prefix *cdecl = rewrite->right->AsPrefix())
             if (Name *cname = cdecl->left->AsName())
                 if (cname->value == "C")
-                    return nullptr;
+                    return false;
 
-    // Find 'from', 'to' and 'hash' for the rewrite
+    // Record which kinds we have rewrites for
     Tree *from = rewrite->left;
-
-    // Check what we are really defining, and verify if it's a name
     Tree *defined = PatternBase(from);
-    Name *name = defined->AsName();
-    ulong h = Hash(defined);
-
-    // Record which kinds we have rewrites for
-    HasOneRewriteFor(defined->Kind());
+    Context::HasOneRewriteFor(defined->Kind());
 
     // Validate form names, emit errors in case of problem.
     ValidateNames(from);
+    return true;
+}
+
+
+static inline bool IsRedefinition(Rewrite *entry, ulong hash, Name *name)
+// ----------------------------------------------------------------------------
+//   Check if the entry defines the same name
+// ----------------------------------------------------------------------------
+{
+    if (name && RewriteHash(entry) == hash)
+    {
+        Infix *decl = RewriteDeclaration(entry);
+        Tree *declDef = PatternBase(decl->left);
+        if (Name *declName = declDef->AsName())
+            return declName->value == name->value;
+    }
+    return false;
+}
+
+
+static inline Rewrite *NewRewrite(Infix *decl, ulong hash)
+// ----------------------------------------------------------------------------
+//   Create a rewrite entry with nil children
+// ----------------------------------------------------------------------------
+{
+    RewriteChildren *nil_children = new RewriteChildren(xl_nil, xl_nil, hash,
+                                                        decl->Position());
+    return new Rewrite(REWRITE_NAME, decl, nil_children, decl->Position());
+}
+
+
+Rewrite *Context::Enter(Infix *rewrite, bool overwrite)
+// ----------------------------------------------------------------------------
+//   Enter a known declaration
+// ----------------------------------------------------------------------------
+{
+    if (!AcceptDeclaration(rewrite))
+        return nullptr;
+
+    // Check what we are really defining, and verify if it's a name
+    Tree *defined = PatternBase(rewrite->left);
+    Name *name = defined->AsName();
+    ulong h0 = Hash(defined);
+    ulong h = h0;
 
     // Find locals symbol table, populate it
     // The context always has the locals on the left and enclosing on the right.
@@ -353,24 +431,25 @@ Rewrite *Context::Enter(Infix *rewrite, bool overwrite)
     Tree_p  &locals = ScopeLocals(scope);
     Tree_p  *parent = &locals;
     Rewrite *result = nullptr;
+    uint     depth  = 0;
+    ScopeChanged(scope);
     while (!result)
     {
         // If we have found a nil spot, that's where we can insert
         if (*parent == xl_nil)
         {
-            // Initialize the local entry with nil children
-            RewriteChildren *nil_children =
-                new RewriteChildren(REWRITE_CHILDREN_NAME,
-                                    xl_nil, xl_nil,
-                                    rewrite->Position());
-
             // Create the local entry
-            Rewrite *entry = new Rewrite(REWRITE_NAME, rewrite, nil_children,
-                                         rewrite->Position());
+            Rewrite *entry = NewRewrite(rewrite, h0);
 
             // Insert the entry in the parent
             *parent = entry;
 
+            // Keep the flat table in sync, or build it for deep scopes
+            if (ScopeTable *table = Table(scope))
+                table->Insert(h0, rewrite);
+            else if (Opt::tableScopeDepth && depth >= Opt::tableScopeDepth)
+                Compact();
+
             // We are done
             result = entry;
             break;
@@ -380,34 +459,25 @@ Rewrite *Context::Enter(Infix *rewrite, bool overwrite)
         Rewrite *entry = (*parent)->As<Rewrite>();
 
         // If we are definig a name, signal if we redefine it
-        if (name)
+        if (IsRedefinition(entry, h0, name))
         {
             Infix *decl = RewriteDeclaration(entry);
-            Tree *declDef = PatternBase(decl->left);
-            if (Name *declName = declDef->AsName())
+            if (overwrite)
             {
-                if (declName->value == name->value)
-                {
-                    if (overwrite)
-                    {
-                        decl->right = rewrite->right;
-                        return entry;
-                    }
-                    else
-                    {
-                        Ooops("Name $1 is redefined", name);
-                        Ooops("Previous definition was in $1", decl);
-                    }
-                }
+                decl->right = rewrite->right;
+                return entry;
             }
+            Ooops("Name $1 is redefined", name);
+            Ooops("Previous definition was in $1", decl);
         }
 
-        RewriteChildren *children = RewriteNext(entry);
+        Infix *children = RewriteNext(entry);
         if (h & 1)
             parent = &children->right;
         else
             parent = &children->left;
         h = Rehash(h);
+        depth++;
     }
 
     // Return the entry we created
@@ -415,6 +485,104 @@ Rewrite *Context::Enter(Infix *rewrite, bool overwrite)
 }
 
 
+struct BatchEntry
+// ----------------------------------------------------------------------------
+//   A declaration waiting to be entered by Context::EnterAll
+// ----------------------------------------------------------------------------
+{
+    Infix *     decl;
+    Name *      name;
+    ulong       hash;           // Hash of what the declaration defines
+    ulong       path;           // Remaining bits to walk the symbol table
+    bool        right;          // Goes right at the current level
+};
+typedef std::vector<BatchEntry> BatchEntries;
+
+
+static uint EnterBatch(Tree_p &slot, BatchEntry *first, BatchEntry *last)
+// ----------------------------------------------------------------------------
+//   Enter a range of declarations at a given position, return max depth
+// ----------------------------------------------------------------------------
+//   The range is in declaration order. The first declaration takes the slot
+//   if it is free. Others are checked for redefinitions, then partitioned
+//   by the next bit of their path, keeping their relative order.
+//   This builds the same tree as entering the declarations one at a time,
+//   but each level of the tree is visited only once for the whole batch.
+{
+    if (first == last)
+        return 0;
+
+    if (slot == xl_nil)
+    {
+        slot = NewRewrite(first->decl, first->hash);
+        first++;
+    }
+
+    Rewrite *entry = slot->As<Rewrite>();
+    for (BatchEntry *e = first; e != last; e++)
+    {
+        if (IsRedefinition(entry, e->hash, e->name))
+        {
+            Ooops("Name $1 is redefined", e->name);
+            Ooops("Previous definition was in $1", RewriteDeclaration(entry));
+        }
+        e->right = e->path & 1;
+        e->path = Context::Rehash(e->path);
+    }
+
+    BatchEntry *middle = std::stable_partition(first, last,
+                                               [](const BatchEntry &e)
+                                               { return !e.right; });
+    Infix *children = RewriteNext(entry);
+    uint left = EnterBatch(children->left, first, middle);
+    uint right = EnterBatch(children->right, middle, last);
+    return 1 + std::max(left, right);
+}
+
+
+uint Context::EnterAll(RewriteList &decls)
+// ----------------------------------------------------------------------------
+//   Enter a batch of declarations, return how many were entered
+// ----------------------------------------------------------------------------
+//   This is used when processing the declarations of a whole file or block.
+//   Hashes are computed once, and the declarations are then distributed
+//   along the hash bits, much like a radix sort, in a single pass.
+{
+    BatchEntries batch;
+    batch.reserve(decls.size());
+    for (Infix *decl : decls)
+    {
+        if (!AcceptDeclaration(decl))
+            continue;
+        Tree *defined = PatternBase(decl->left);
+        ulong hash = Hash(defined);
+        batch.push_back(BatchEntry { decl, defined->AsName(),
+                                     hash, hash, false });
+    }
+    if (batch.empty())
+        return 0;
+
+    // Keep the flat table in sync, in declaration order
+    Scope *scope = symbols;
+    ScopeTable *table = Table(scope);
+    if (table)
+        for (BatchEntry &e : batch)
+            table->Insert(e.hash, e.decl);
+
+    ScopeChanged(scope);
+    uint count = batch.size();
+    uint depth = EnterBatch(ScopeLocals(scope),
+                            &batch.front(), &batch.front() + count);
+    record(scope_enter, "Entered %u declarations in %p, depth %u",
+           count, scope, depth);
+
+    // Build the flat table for deep scopes
+    if (!table && Opt::tableScopeDepth && depth > Opt::tableScopeDepth)
+        Compact();
+    return count;
+}
+
+
 Tree *Context::Assign(Tree *ref, Tree *value)
 // ----------------------------------------------------------------------------
 //   Perform an assignment in the given context
@@ -597,6 +765,26 @@ Tree *Context::Lookup(Tree *what, lookup_fn lookup, void *info, bool recurse)
 
     while (scope)
     {
+        // Use the flat table if the scope has one
+        if (ScopeTable *table = Table(scope))
+        {
+            ScopeTable::Entry *entries = table->entries;
+            uint               mask    = table->mask;
+            for (uint i = h0 & mask; entries[i].decl; i = (i + 1) & mask)
+            {
+                if (entries[i].hash == h0)
+                {
+                    Infix *decl = entries[i].decl;
+                    if (Tree *result = lookup(symbols, scope, what, decl, info))
+                        return result;
+                }
+            }
+            if (!recurse)
+                break;
+            scope = Enclosing(scope);
+            continue;
+        }
+
         // Initialize local scope
         Tree_p &locals = ScopeLocals(scope);
         Tree_p *parent = &locals;
@@ -614,13 +802,11 @@ Tree *Context::Lookup(Tree *what, lookup_fn lookup, void *info, bool recurse)
             XL_ASSERT(entry && entry->name == REWRITE_NAME);
             Infix *decl = RewriteDeclaration(entry);
             XL_ASSERT(!decl || IsDeclaration(decl));
-            RewriteChildren *children = RewriteNext(entry);
+            Infix *children = RewriteNext(entry);
             XL_ASSERT(children && children->name == REWRITE_CHILDREN_NAME);
 
             // Check that hash matches
-            Tree *defined = PatternBase(decl->left);
-            ulong declHash = Hash(defined);
-            if (declHash == h0)
+            if (RewriteHash(entry) == h0)
             {
                 result = lookup(symbols, scope, what, decl, info);
                 if (result)
@@ -647,6 +833,164 @@ Tree *Context::Lookup(Tree *what, lookup_fn lookup, void *info, bool recurse)
 }
 
 
+static uint lookupLocals(Scope *scope, ulong h0,
+                         LookupCache::Candidates &candidates)
+// ----------------------------------------------------------------------------
+//   Collect the declarations matching hash h0 in a scope, return depth
+// ----------------------------------------------------------------------------
+{
+    uint depth = 0;
+    if (ScopeTable *table = Context::Table(scope))
+    {
+        ScopeTable::Entry *entries = table->entries;
+        uint               mask    = table->mask;
+        for (uint i = h0 & mask; entries[i].decl; i = (i + 1) & mask)
+        {
+            if (entries[i].hash == h0)
+                candidates.push_back(entries[i].decl);
+            depth++;
+        }
+        return depth;
+    }
+
+    Tree_p *parent = &ScopeLocals(scope);
+    ulong   h      = h0;
+
+    while (*parent != xl_nil)
+    {
+        Rewrite *entry = (*parent)->As<Rewrite>();
+        XL_ASSERT(entry && entry->name == REWRITE_NAME);
+        Infix *decl = RewriteDeclaration(entry);
+        XL_ASSERT(!decl || IsDeclaration(decl));
+        Infix *children = RewriteNext(entry);
+        XL_ASSERT(children && children->name == REWRITE_CHILDREN_NAME);
+
+        if (RewriteHash(entry) == h0)
+            candidates.push_back(decl);
+
+        if (h & 1)
+            parent = &children->right;
+        else
+            parent = &children->left;
+        h = Context::Rehash(h);
+        depth++;
+    }
+    return depth;
+}
+
+
+Tree *Context::CachedLookup(Tree *what, lookup_fn lookup, void *info)
+// ----------------------------------------------------------------------------
+//   Lookup a tree, using an inline cache recorded on the call site
+// ----------------------------------------------------------------------------
+//   This finds the same candidates, in the same order, as Lookup.
+//   The cache only saves the walk through the hash tree of large scopes.
+{
+    // Quick exit if we have no rewrite for that tree kind
+    if (!HasRewritesFor(what->Kind()))
+        return nullptr;
+
+    // A cache is only attached to trees looked up in deep enough scopes
+    LookupCache *cache = what->GetInfo<LookupCache>();
+    ulong                   h0 = cache ? cache->hash : Hash(what);
+    LookupCache::Candidates walked;
+    for (Scope *scope = symbols; scope; scope = Enclosing(scope))
+    {
+        LookupCache::Candidates *candidates = &walked;
+        LookupCache::Entry *entry = cache ? cache->Find(scope) : nullptr;
+        if (entry)
+        {
+            record(scope_lookup, "Cached %t in %p, %u candidates",
+                   what, scope, entry->candidates.size());
+            candidates = &entry->candidates;
+        }
+        else
+        {
+            walked.clear();
+            uint depth = lookupLocals(scope, h0, walked);
+            if (depth >= LookupCache::MIN_DEPTH)
+            {
+                if (!cache)
+                    cache = what->GetInfo<LookupCache>();
+                if (!cache)
+                {
+                    cache = new LookupCache(h0);
+                    what->SetInfo<LookupCache>(cache);
+                }
+                if (!cache->busy && (entry = cache->Insert(scope)))
+                {
+                    record(scope_lookup, "Caching %t in %p depth %u",
+                           what, scope, depth);
+                    entry->candidates = walked;
+                }
+            }
+        }
+
+        uint idle = 0;
+        Save<uint> busy(cache ? cache->busy : idle,
+                        cache ? cache->busy + 1 : 0);
+        for (Infix *decl : *candidates)
+            if (Tree *result = lookup(symbols, scope, what, decl, info))
+                return result;
+    }
+
+    // Return NULL if all evaluations failed
+    return nullptr;
+}
+
+
+LookupCache::Entry *LookupCache::Find(Scope *scope)
+// ----------------------------------------------------------------------------
+//   Find a valid cache entry for the given scope
+// ----------------------------------------------------------------------------
+{
+    for (uint i = 0; i < count; i++)
+        if (entries[i].scope == scope &&
+            entries[i].generation == Context::generation)
+            return &entries[i];
+    return nullptr;
+}
+
+
+LookupCache::Entry *LookupCache::Insert(Scope *scope)
+// ----------------------------------------------------------------------------
+//   Find a cache entry to record the candidates for a scope
+// ----------------------------------------------------------------------------
+//   We reuse entries for the same scope or stale entries first, then grow
+//   the cache up to SIZE entries, then replace entries round-robin.
+{
+    Entry *entry = nullptr;
+    for (uint i = 0; i < count && !entry; i++)
+        if (entries[i].scope == scope ||
+            entries[i].generation != Context::generation)
+            entry = &entries[i];
+    if (!entry)
+    {
+        if (count < SIZE)
+            entry = &entries[count++];
+        else
+            entry = &entries[victim++ % SIZE];
+    }
+
+    if (!scope->Exists<LookupCacheScope>())
+        scope->SetInfo<LookupCacheScope>(new LookupCacheScope);
+    entry->scope = scope;
+    entry->generation = Context::generation;
+    entry->candidates.clear();
+    return entry;
+}
+
+
+LookupCacheScope::~LookupCacheScope()
+// ----------------------------------------------------------------------------
+//   When a cached scope dies, invalidate all lookup caches
+// ----------------------------------------------------------------------------
+{
+    // May run in the background sweeper, see -gc_thread
+    Atomic<ulong>::Add(Context::generation, 1);
+}
+
+
 static Tree *findReference(Scope *, Scope *, Tree *what, Infix *decl, void *)
 // ----------------------------------------------------------------------------
 //   Return the reference we found
@@ -816,18 +1160,35 @@ ulong Context::ListNames(text begin, RewriteList &list,
 //
 // ============================================================================
 
-static inline ulong HashText(const text &t)
+static inline ulong hashMix(ulong h)
 // ----------------------------------------------------------------------------
-//   Compute the has for some text
+//   Final mixing step, so that all input bits affect all output bits
 // ----------------------------------------------------------------------------
 {
-    ulong h = 0;
-    uint  l = t.length();
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+ulong Context::HashText(const text &t)
+// ----------------------------------------------------------------------------
+//   Compute the hash for some text, using all its characters
+// ----------------------------------------------------------------------------
+//   This is FNV-1a, so that names sharing a long prefix such as
+//   module_path and module_name end up in different places
+{
+    ulong   h   = 0xCBF29CE484222325ULL;
+    size_t  l   = t.length();
     kstring ptr = t.data();
-    if (l > 8)
-        l = 8;
-    for (uint i = 0; i < l; i++)
-        h = (h * 0x301) ^ *ptr++;
+    for (size_t i = 0; i < l; i++)
+    {
+        h ^= (byte) *ptr++;
+        h *= 0x100000001B3ULL;
+    }
     return h;
 }
 
@@ -881,7 +1242,40 @@ ulong Context::Hash(Tree *what)
         break;
     }
 
-    return h;
+    return hashMix(h);
+}
+
+
+void Context::RestoreHashes(Scope *scope)
+// ----------------------------------------------------------------------------
+//   Record declaration hashes in a symbol table that was not entered
+// ----------------------------------------------------------------------------
+//   Scopes read back by the serializer or cloned have plain children nodes,
+//   which are replaced with RewriteChildren holding the hash
+{
+    RewriteList pending;
+    if (Rewrite *rw = ScopeRewrites(scope))
+        pending.push_back(rw);
+    while (!pending.empty())
+    {
+        Rewrite *rw = pending.back();
+        pending.pop_back();
+        Infix *decl = RewriteDeclaration(rw);
+        Infix *children = RewriteNext(rw);
+        if (!decl || !children)
+            continue;
+        if (!Allocator<RewriteChildren>::IsAllocated(children))
+        {
+            ulong h = Hash(PatternBase(decl->left));
+            children = new RewriteChildren(children->left, children->right,
+                                           h, children->Position());
+            rw->right = children;
+        }
+        if (Rewrite *left = children->left->AsInfix())
+            pending.push_back(left);
+        if (Rewrite *right = children->right->AsInfix())
+            pending.push_back(right);
+    }
 }
 
 
@@ -897,10 +1291,144 @@ void Context::Clear()
 //   Clear the symbol table
 // ----------------------------------------------------------------------------
 {
+    ScopeChanged(symbols);
+    symbols->Purge<ScopeTable>();
     symbols->right = xl_nil;
 }
 
 
+void Context::Compact()
+// ----------------------------------------------------------------------------
+//   Build a flat table for the innermost scope
+// ----------------------------------------------------------------------------
+//   The tree is walked in pre-order, so that declarations with the same
+//   hash, which are all on the same path, are inserted in tree order.
+{
+    Scope *scope = symbols;
+    if (Table(scope))
+        return;
+
+    RewriteList rewrites;
+    RewriteList pending;
+    if (Rewrite *rw = ScopeRewrites(scope))
+        pending.push_back(rw);
+    while (!pending.empty())
+    {
+        Rewrite *rw = pending.back();
+        pending.pop_back();
+        rewrites.push_back(rw);
+        Infix *children = RewriteNext(rw);
+        if (Rewrite *right = children->right->AsInfix())
+            pending.push_back(right);
+        if (Rewrite *left = children->left->AsInfix())
+            pending.push_back(left);
+    }
+
+    uint capacity = ScopeTable::MIN_CAPACITY;
+    while (capacity < 2 * rewrites.size())
+        capacity *= 2;
+    ScopeTable *table = new ScopeTable(capacity);
+    for (Rewrite *rw : rewrites)
+        table->Insert(RewriteHash(rw), RewriteDeclaration(rw));
+    scope->SetInfo<ScopeTable>(table);
+    record(scope_enter, "Compacted scope %p, %u entries in %u slots",
+           scope, table->count, capacity);
+}
+
+
+ScopeTable::ScopeTable(uint capacity)
+// ----------------------------------------------------------------------------
+//   Create an empty table with the given power-of-two capacity
+// ----------------------------------------------------------------------------
+    : entries(AllocateEntries(capacity)), mask(capacity - 1), count(0),
+      retired()
+{}
+
+
+ScopeTable::~ScopeTable()
+// ----------------------------------------------------------------------------
+//   Release all the entries we allocated
+// ----------------------------------------------------------------------------
+{
+    free(entries);
+    for (Entry *old : retired)
+        free(old);
+}
+
+
+ScopeTable::Entry *ScopeTable::AllocateEntries(uint capacity)
+// ----------------------------------------------------------------------------
+//   Allocate cleared entries starting on a cache line
+// ----------------------------------------------------------------------------
+{
+    size_t size = capacity * sizeof(Entry);
+    void *result = nullptr;
+#if defined(HAVE_POSIX_MEMALIGN)
+    if (posix_memalign(&result, CACHE_LINE, size))
+        result = nullptr;
+#else // !HAVE_POSIX_MEMALIGN
+    result = malloc(size);
+#endif // HAVE_POSIX_MEMALIGN
+    XL_ASSERT(result && "Unable to allocate scope table");
+    memset(result, 0, size);
+    return (Entry *) result;
+}
+
+
+void ScopeTable::Insert(ulong hash, Infix *decl)
+// ----------------------------------------------------------------------------
+//   Insert a declaration, after all those already entered with same hash
+// ----------------------------------------------------------------------------
+{
+    if (2 * (count + 1) > mask + 1)
+        Grow();
+    uint i = hash & mask;
+    while (entries[i].decl)
+        i = (i + 1) & mask;
+    entries[i].hash = hash;
+    entries[i].decl = decl;
+    count++;
+}
+
+
+void ScopeTable::Grow()
+// ----------------------------------------------------------------------------
+//   Double the size of the table, preserving probing order for each hash
+// ----------------------------------------------------------------------------
+//   Re-inserting slots starting at the beginning of a cluster guarantees
+//   that entries with the same hash are re-inserted in their original order.
+{
+    Entry *old      = entries;
+    uint   oldSize  = mask + 1;
+    uint   start    = 0;
+    while (start < oldSize && old[start].decl)
+        start++;
+
+    entries = AllocateEntries(2 * oldSize);
+    mask = 2 * oldSize - 1;
+    count = 0;
+    for (uint n = 0; n < oldSize; n++)
+    {
+        Entry &e = old[(start + n) & (oldSize - 1)];
+        if (e.decl)
+            Insert(e.hash, e.decl);
+    }
+    retired.push_back(old);
+}
+
+
+void Context::ScopeChanged(Scope *scope)
+// ----------------------------------------------------------------------------
+//   Bump the symbol table generation if the scope was recorded in a cache
+// ----------------------------------------------------------------------------
+//   Scopes that no lookup cache refers to can change without invalidating
+//   anything, which is the common case for freshly created local scopes.
+{
+    if (scope->info && scope->Exists<LookupCacheScope>())
+        generation++;
+}
+
+
 void Context::Dump(std::ostream &out, Scope *scope, bool recurse)
 // ----------------------------------------------------------------------------
 //   Dump the symbol table to the given stream
@@ -48,6 +48,9 @@
 #include <cstdio>
 #include <cstdlib>
 #include <pthread.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 // Windows/MinGW (ancient): When getting in the way becomes an art form...
 #if !defined(HAVE_POSIX_MEMALIGN) && defined(HAVE_MINGW_ALIGNED_MALLOC)
@@ -70,6 +73,7 @@ void *TypeAllocator::highestAddress = (void *) 0;
 void *TypeAllocator::lowestAllocatorAddress = (void *) ~0;
 void *TypeAllocator::highestAllocatorAddress = (void *) 0;
 Atomic<uint> TypeAllocator::finalizing = 0;
+bool TypeAllocator::atomicCounts = false;
 
 // Identifier of the thread currently collecting if any
 #define PTHREAD_NULL ((pthread_t) 0)
@@ -77,6 +81,18 @@ static pthread_t collecting = PTHREAD_NULL;
 
 RECORDER_DEFINE(memory, 64, "Memory allocation and garbage collector");
 
+namespace Opt
+{
+CodeOption atomicCounts("atomic_counts",
+                        "Use atomic reference counts (multiple threads)",
+                        [](Option &opt, Options &opts)
+                        {
+                            TypeAllocator::atomicCounts = true;
+                        });
+BooleanOption gcThread("gc_thread",
+                       "Finalize released objects in a background thread");
+}
+
 
 TypeAllocator::TypeAllocator(kstring tn, uint os)
 // ----------------------------------------------------------------------------
@@ -84,8 +100,9 @@ TypeAllocator::TypeAllocator(kstring tn, uint os)
 // ----------------------------------------------------------------------------
     : gc(nullptr), name(tn), locked(0), lowestInUse(~0UL), highestInUse(0),
       chunks(), freeList(nullptr), toDelete(nullptr),
+      foreground(nullptr),
       available(0), freedCount(0),
-      chunkSize(1022), objectSize(os), alignedSize(os),
+      index(0), chunkSize(1022), objectSize(os), alignedSize(os),
       allocatedCount(0), scannedCount(0), collectedCount(0), totalCount(0)
 {
     record(memory, "New type allocator %p name '%s' object size %u",
@@ -134,6 +151,43 @@ TypeAllocator::~TypeAllocator()
 }
 
 
+struct ArenaRegion
+// ----------------------------------------------------------------------------
+//   Chunks where the current thread bump-allocates for one allocator
+// ----------------------------------------------------------------------------
+//   Blocks have the same layout as the allocator chunks, so that a block
+//   holding objects that escaped the arena can be handed over as is
+{
+    ArenaRegion(): allocator(nullptr), block(0), used(0) {}
+    TypeAllocator *                      allocator;
+    std::vector<char *>                  blocks;  // Allocated blocks
+    std::vector<bool>                    escaped; // Blocks to hand over
+    uint                                 block;   // Block being filled
+    uint                                 used;    // Items used in block
+};
+
+
+struct ArenaLog
+// ----------------------------------------------------------------------------
+//   Objects allocated by the current thread while an arena is active
+// ----------------------------------------------------------------------------
+{
+    ~ArenaLog()
+    {
+        // Blocks that were not handed over only contain dead objects
+        if (!depth)
+            for (ArenaRegion &region : regions)
+                for (char *block : region.blocks)
+                    free(block);
+    }
+    std::vector<TypeAllocator::Chunk_vp> chunks;
+    std::vector<ArenaRegion>             regions;
+    uint                                 limit;
+    uint                                 depth;
+};
+static thread_local ArenaLog arenaLog;
+
+
 void *TypeAllocator::Allocate()
 // ----------------------------------------------------------------------------
 //   Allocate a chunk of the given size
@@ -142,74 +196,38 @@ void *TypeAllocator::Allocate()
     record(memory, "Allocate in '%+s', free list %p",
            this->name, (void *) freeList.Get());
 
+    // Bump-allocate in the evaluation arena if there is one
+    ArenaLog &arena = arenaLog;
+    bool inArena = arena.depth && arena.chunks.size() < arena.limit;
     Chunk_vp result;
-    do
+    if (inArena)
     {
-        result = freeList;
-        while (!result)
-        {
-            // Make sure only one thread allocates chunks
-            uint wasLocked = locked++;
-            if (wasLocked)
-            {
-                locked--;
-                result = freeList;
-                continue;
-            }
-
-            // Nothing free: allocate a big enough chunk
-            size_t  itemSize  = alignedSize + sizeof(Chunk);
-            size_t  allocSize = (chunkSize + 1) * itemSize;
-
-            void   *allocated = malloc(allocSize);
-            (void)VALGRIND_MAKE_MEM_NOACCESS(allocated, allocSize);
-
-            record(memory, "New chunk %p in '%+s'", allocated, this->name);
-
-            char *chunkBase = (char *) allocated + alignedSize;
-            Chunk_vp last = (Chunk_vp) chunkBase;
-            Chunk_vp free = result;
-            for (uint i = 0; i < chunkSize; i++)
-            {
-                Chunk_vp ptr = (Chunk_vp) (chunkBase + i * itemSize);
-                VALGRIND_MAKE_MEM_UNDEFINED(&ptr->next,sizeof(ptr->next));
-                ptr->next = free;
-                free = ptr;
-            }
-
-            // Update the chunks list
-            chunks.push_back((Chunk *) allocated);
-            available += chunkSize;
-            if (lowestAddress > allocated)
-                lowestAddress = allocated;
-            char *highMark = (char *) allocated + (chunkSize+1) * itemSize;
-            if (highestAddress < (void *) highMark)
-                highestAddress = highMark;
-
-            // Update the freelist
-            while (!freeList.SetQ(result, free))
-            {
-                result = freeList;
-                last->next = result;
-            }
-
-            // Unlock the chunks
-            --locked;
-
-            // Read back the free list
-            result = freeList;
-        }
+        result = ArenaAllocate();
+    }
+    else
+    {
+        // Allocate from the per-thread magazine, refill it if empty
+        Magazine &magazine = LocalMagazine();
+        result = magazine.free;
+        if (!result)
+            result = Refill(magazine);
+        magazine.free = result->next;
+        magazine.count--;
+        magazine.allocated++;
     }
-    while (!freeList.SetQ(result, result->next));
 
     VALGRIND_MAKE_MEM_UNDEFINED(result, sizeof(Chunk));
     result->allocator = this;
     result->bits |= IN_USE;     // Mark it as in use for current collection
     result->count = 0;
     UpdateInUseRange(result);
-    allocatedCount++;
-    if (--available < chunkSize * 0.9)
-        gc->MustRun();
+
+    // Record allocations in the arena, to release them when it ends
+    if (inArena)
+    {
+        result->bits |= IN_ARENA;
+        arena.chunks.push_back(result);
+    }
 
     void *ret =  (void *) &result[1];
     VALGRIND_MEMPOOL_ALLOC(this, ret, objectSize);
@@ -237,14 +255,20 @@ void TypeAllocator::Delete(void *ptr)
     XL_ASSERT(!chunk->count &&
                  "Deleted pointer has live references");
 
-    // Put the pointer back on the free list
-    do
-    {
-        chunk->next = freeList;
-    }
-    while (!freeList.SetQ(chunk->next, chunk));
-    available++;
-    freedCount++;
+    // Arena memory is reclaimed when the arena ends
+    if (chunk->bits & IN_ARENA)
+        return;
+
+    // Put the pointer back in the per-thread magazine
+    Magazine &magazine = LocalMagazine();
+    chunk->next = magazine.free;
+    magazine.free = chunk;
+    magazine.count++;
+    magazine.freed++;
+
+    // Return half of the magazine to the shared free list if it's too large
+    if (magazine.count >= 2 * MAGAZINE_SIZE)
+        Drain(magazine, MAGAZINE_SIZE);
 
 #ifdef DEBUG
     // Scrub all the pointers
@@ -269,13 +293,26 @@ void TypeAllocator::Finalize(void *ptr)
 }
 
 
+bool TypeAllocator::CanSweep(void *)
+// ----------------------------------------------------------------------------
+//   Only typed allocators know if the background sweeper can finalize
+// ----------------------------------------------------------------------------
+{
+    return false;
+}
+
+
 void TypeAllocator::ScheduleDelete(TypeAllocator::Chunk_vp ptr)
 // ----------------------------------------------------------------------------
 //   Delete now if possible, or record that we will need to delete it later
 // ----------------------------------------------------------------------------
 {
     RECORD(memory, "Schedule delete %p (bits %lx)", (void *)(ptr+1), ptr->bits);
-    if (ptr->bits & IN_USE)
+    if (ptr->bits & IN_ARENA)
+    {
+        // Released when the evaluation arena ends
+    }
+    else if (ptr->bits & IN_USE)
     {
         UpdateInUseRange(ptr);
     }
@@ -289,6 +326,12 @@ void TypeAllocator::ScheduleDelete(TypeAllocator::Chunk_vp ptr)
             // Put it on the to-delete list to avoid deep recursion
             LinkedListInsert(allocator->toDelete, ptr);
         }
+        else if (GarbageCollector::Background())
+        {
+            // Let the background sweeper finalize it after next collection
+            LinkedListInsert(allocator->toDelete, ptr);
+            GarbageCollector::MustRun();
+        }
         else
         {
             // Delete current object immediately
@@ -301,10 +344,12 @@ void TypeAllocator::ScheduleDelete(TypeAllocator::Chunk_vp ptr)
 }
 
 
-bool TypeAllocator::CheckLeakedPointers()
+bool TypeAllocator::CheckLeakedPointers(bool defer)
 // ----------------------------------------------------------------------------
 //   Check if any pointers were allocated and not captured between safe points
 // ----------------------------------------------------------------------------
+//   If 'defer' is set, dead objects are put on the to-delete list instead
+//   of being finalized, so that the background sweeper finalizes them
 {
     record(memory, "CheckLeaks in '%+s'", name);
 
@@ -339,10 +384,13 @@ bool TypeAllocator::CheckLeakedPointers()
                 if (AllocatorPointer(ptr->allocator) == this)
                 {
                     Atomic<uintptr_t>::And(ptr->bits, ~(uintptr_t) IN_USE);
-                    if (!ptr->count)
+                    if (!ptr->count && !(ptr->bits & IN_ARENA))
                     {
                         // It is dead, Jim
-                        Finalize((void *) (ptr+1));
+                        if (defer)
+                            LinkedListInsert(toDelete, ptr);
+                        else
+                            Finalize((void *) (ptr+1));
                         collected++;
                     }
                 }
@@ -357,21 +405,52 @@ bool TypeAllocator::CheckLeakedPointers()
 }
 
 
-bool TypeAllocator::Sweep()
+bool TypeAllocator::Sweep(bool background)
 // ----------------------------------------------------------------------------
 //    Remove all the things that we have pushed on the toDelete list
 // ----------------------------------------------------------------------------
+//    In the background sweeper, objects whose finalizer may touch state
+//    owned by the evaluation thread are moved to the foreground list
 {
-    record(memory, "Sweep '%+s'", name);
+    record(memory, "Sweep '%+s'%+s", name, background ? " in background" : "");
     bool result = false;
+    uint deferred = 0;
     while (toDelete)
     {
         Chunk_vp next = LinkedListPopFront(toDelete);
         next->allocator = this;
+        void *object = (void *) (next+1);
+        if (background && !CanSweep(object))
+        {
+            LinkedListInsert(foreground, next);
+            deferred++;
+            continue;
+        }
+        Finalize(object);
+        result = true;
+    }
+    record(memory, "Swept '%+s' %+s objects deleted, %u deferred",
+           name, result ? "with" : "without", deferred);
+    return result;
+}
+
+
+bool TypeAllocator::SweepForeground()
+// ----------------------------------------------------------------------------
+//    Finalize the objects the background sweeper left to the owning thread
+// ----------------------------------------------------------------------------
+//    Children released meanwhile go to the to-delete lists, since the
+//    caller holds 'finalizing'
+{
+    bool result = false;
+    while (foreground)
+    {
+        Chunk_vp next = LinkedListPopFront(foreground);
+        next->allocator = this;
         Finalize((void *) (next+1));
         result = true;
     }
-    record(memory, "Swept '%+s' %+s objects deleted",
+    record(memory, "Foreground sweep '%+s' %+s objects deleted",
            name, result ? "with" : "without");
     return result;
 }
@@ -456,6 +535,505 @@ bool TypeAllocator::CanDelete(void *obj)
 
 
 
+// ============================================================================
+//
+//    Per-thread magazines
+//
+// ============================================================================
+//
+//    Each thread keeps a small private free list (a 'magazine') for each
+//    allocator, so that allocating or deleting a tree does not touch
+//    the shared free list. Magazines are refilled and drained in batches,
+//    and their statistics are only reported to the allocator at that time.
+
+struct ThreadMagazines
+// ----------------------------------------------------------------------------
+//   The magazines of one thread, indexed by allocator
+// ----------------------------------------------------------------------------
+{
+    ~ThreadMagazines()
+    {
+        // Give the chunks back to the shared free lists on thread exit
+        if (GarbageCollector::GC())
+            TypeAllocator::DrainMagazines();
+    }
+    std::vector<TypeAllocator::Magazine> magazines;
+};
+static thread_local ThreadMagazines threadMagazines;
+
+
+TypeAllocator::Magazine &TypeAllocator::LocalMagazine()
+// ----------------------------------------------------------------------------
+//   Return the magazine for the current thread
+// ----------------------------------------------------------------------------
+{
+    std::vector<Magazine> &magazines = threadMagazines.magazines;
+    if (index >= magazines.size())
+        magazines.resize(gc->allocators.size(), Magazine());
+    return magazines[index];
+}
+
+
+void *TypeAllocator::AllocateChunk()
+// ----------------------------------------------------------------------------
+//   Allocate memory for chunkSize items, and extend the known address range
+// ----------------------------------------------------------------------------
+{
+    size_t  itemSize  = alignedSize + sizeof(Chunk);
+    size_t  allocSize = (chunkSize + 1) * itemSize;
+
+    void   *allocated = malloc(allocSize);
+    (void)VALGRIND_MAKE_MEM_NOACCESS(allocated, allocSize);
+
+    record(memory, "New chunk %p in '%+s'", allocated, this->name);
+
+    if (lowestAddress > allocated)
+        lowestAddress = allocated;
+    char *highMark = (char *) allocated + allocSize;
+    if (highestAddress < (void *) highMark)
+        highestAddress = highMark;
+    return allocated;
+}
+
+
+TypeAllocator::Chunk_vp TypeAllocator::Refill(Magazine &magazine)
+// ----------------------------------------------------------------------------
+//   Take a batch of chunks from the shared free list
+// ----------------------------------------------------------------------------
+{
+    record(memory, "Refill magazine in '%+s'", name);
+    Report(magazine);
+
+    // Detach the whole shared free list, allocating more chunks if empty
+    Chunk_vp result;
+    do
+    {
+        result = freeList;
+        while (!result)
+        {
+            // Make sure only one thread allocates chunks
+            uint wasLocked = locked++;
+            if (wasLocked)
+            {
+                locked--;
+                result = freeList;
+                continue;
+            }
+
+            // Nothing free: allocate a big enough chunk
+            size_t  itemSize  = alignedSize + sizeof(Chunk);
+            void   *allocated = AllocateChunk();
+
+            char *chunkBase = (char *) allocated + alignedSize;
+            Chunk_vp last = (Chunk_vp) chunkBase;
+            Chunk_vp free = result;
+            for (uint i = 0; i < chunkSize; i++)
+            {
+                Chunk_vp ptr = (Chunk_vp) (chunkBase + i * itemSize);
+                VALGRIND_MAKE_MEM_UNDEFINED(&ptr->next,sizeof(ptr->next));
+                ptr->next = free;
+                free = ptr;
+            }
+
+            // Update the chunks list
+            chunks.push_back((Chunk *) allocated);
+            available += chunkSize;
+
+            // Update the freelist
+            while (!freeList.SetQ(result, free))
+            {
+                result = freeList;
+                last->next = result;
+            }
+
+            // Unlock the chunks
+            --locked;
+
+            // Read back the free list
+            result = freeList;
+        }
+    }
+    while (!freeList.SetQ(result, nullptr));
+
+    // Keep one magazine worth of chunks
+    uint taken = 1;
+    Chunk_vp last = result;
+    while (taken < MAGAZINE_SIZE && last->next)
+    {
+        last = last->next;
+        taken++;
+    }
+    Chunk_vp rest = last->next;
+    last->next = nullptr;
+
+    // Give the rest back, at once unless another thread pushed meanwhile
+    if (rest && !freeList.SetQ(nullptr, rest))
+    {
+        Chunk_vp tail = rest;
+        while (tail->next)
+            tail = tail->next;
+        Chunk_vp head;
+        do
+        {
+            head = freeList;
+            tail->next = head;
+        }
+        while (!freeList.SetQ(head, rest));
+    }
+
+    magazine.free = result;
+    magazine.count = taken;
+    uint left = available.Sub(taken) - taken; // Sub returns previous value
+    if (left < chunkSize * 0.9)
+        gc->MustRun();
+    return result;
+}
+
+
+void TypeAllocator::Drain(Magazine &magazine, uint keep)
+// ----------------------------------------------------------------------------
+//   Return chunks from a magazine to the shared free list
+// ----------------------------------------------------------------------------
+{
+    Report(magazine);
+    if (magazine.count <= keep)
+        return;
+
+    uint moved = magazine.count - keep;
+    Chunk_vp first = magazine.free;
+    Chunk_vp last = first;
+    for (uint i = 1; i < moved; i++)
+        last = last->next;
+    magazine.free = last->next;
+    magazine.count = keep;
+
+    Chunk_vp head;
+    do
+    {
+        head = freeList;
+        last->next = head;
+    }
+    while (!freeList.SetQ(head, first));
+    available += moved;
+
+    record(memory, "Drained %u chunks to '%+s'", moved, name);
+}
+
+
+void TypeAllocator::Report(Magazine &magazine)
+// ----------------------------------------------------------------------------
+//   Report the statistics accumulated in a magazine
+// ----------------------------------------------------------------------------
+{
+    allocatedCount += magazine.allocated;
+    freedCount += magazine.freed;
+    magazine.allocated = 0;
+    magazine.freed = 0;
+}
+
+
+void TypeAllocator::DrainMagazines()
+// ----------------------------------------------------------------------------
+//   Return all the chunks held by the current thread
+// ----------------------------------------------------------------------------
+{
+    GarbageCollector *gc = GarbageCollector::GC();
+    std::vector<Magazine> &magazines = threadMagazines.magazines;
+    uint count = magazines.size();
+    for (uint i = 0; i < count && i < gc->allocators.size(); i++)
+        gc->allocators[i]->Drain(magazines[i], 0);
+}
+
+
+void TypeAllocator::ReportMagazines()
+// ----------------------------------------------------------------------------
+//   Report the statistics of the current thread to all allocators
+// ----------------------------------------------------------------------------
+{
+    GarbageCollector *gc = GarbageCollector::GC();
+    std::vector<Magazine> &magazines = threadMagazines.magazines;
+    uint count = magazines.size();
+    for (uint i = 0; i < count && i < gc->allocators.size(); i++)
+        gc->allocators[i]->Report(magazines[i]);
+}
+
+
+
+// ============================================================================
+//
+//    Evaluation arena
+//
+// ============================================================================
+
+GCArena::GCArena(uint limit)
+// ----------------------------------------------------------------------------
+//   Start recording allocations, up to the given number of objects
+// ----------------------------------------------------------------------------
+{
+    ArenaLog &arena = arenaLog;
+    if (!arena.depth++)
+        arena.limit = limit;
+}
+
+
+GCArena::~GCArena()
+// ----------------------------------------------------------------------------
+//   Finalize all the objects in the outermost arena that were not captured
+// ----------------------------------------------------------------------------
+{
+    typedef TypeAllocator TA;
+    ArenaLog &arena = arenaLog;
+    if (--arena.depth)
+        return;
+
+    // Walk newest first, so that containers release their children
+    // before we reach them. Objects still referenced at that point escape.
+    uint released = 0, escaped = 0;
+    TA::Chunks &chunks = arena.chunks;
+    for (auto c = chunks.rbegin(); c != chunks.rend(); c++)
+    {
+        TA::Chunk_vp chunk = *c;
+        TA *allocator = TA::ValidPointer(chunk->allocator);
+        if (chunk->count)
+        {
+            // Back to normal refcounting, its block will be handed over
+            Atomic<uintptr_t>::And(chunk->bits, ~(uintptr_t) TA::IN_ARENA);
+            allocator->ArenaEscape(chunk);
+            escaped++;
+        }
+        else
+        {
+            // Finalize it, the memory stays in the region
+            allocator->Finalize((void *) (chunk + 1));
+            released++;
+        }
+    }
+    chunks.clear();
+
+    // Hand over blocks with escaped objects, reuse the others as is
+    for (ArenaRegion &region : arena.regions)
+    {
+        TA *allocator = region.allocator;
+        uint kept = 0;
+        for (uint b = 0; b < region.blocks.size(); b++)
+        {
+            char *block = region.blocks[b];
+            if (region.escaped[b])
+            {
+                uint used = b < region.block ? allocator->chunkSize
+                          : b == region.block ? region.used
+                          : 0;
+                allocator->ArenaDonate(block, used);
+            }
+            else
+            {
+                region.blocks[kept++] = block;
+            }
+        }
+        region.blocks.resize(kept);
+        region.escaped.assign(kept, false);
+        region.block = 0;
+        region.used = 0;
+    }
+
+    // Children released above went to the to-delete lists. With a
+    // background sweeper, they are left to the next collection.
+    if (!GarbageCollector::Background())
+        GarbageCollector::Sweep();
+
+    record(memory, "Arena released %u objects, %u escaped", released, escaped);
+}
+
+
+TypeAllocator::Chunk_vp TypeAllocator::ArenaAllocate()
+// ----------------------------------------------------------------------------
+//   Bump-allocate an item in the region of the current thread
+// ----------------------------------------------------------------------------
+{
+    ArenaLog &arena = arenaLog;
+    if (index >= arena.regions.size())
+        arena.regions.resize(gc->allocators.size());
+    ArenaRegion &region = arena.regions[index];
+    region.allocator = this;
+
+    if (region.used == chunkSize)
+    {
+        region.block++;
+        region.used = 0;
+    }
+    if (region.block == region.blocks.size())
+    {
+        region.blocks.push_back((char *) AllocateChunk());
+        region.escaped.push_back(false);
+    }
+
+    size_t itemSize = alignedSize + sizeof(Chunk);
+    char  *base = region.blocks[region.block] + alignedSize;
+    return (Chunk_vp) (base + region.used++ * itemSize);
+}
+
+
+void TypeAllocator::ArenaEscape(Chunk_vp chunk)
+// ----------------------------------------------------------------------------
+//   Record that the region block containing the chunk must be handed over
+// ----------------------------------------------------------------------------
+{
+    ArenaRegion &region = arenaLog.regions[index];
+    size_t blockSize = (chunkSize + 1) * (alignedSize + sizeof(Chunk));
+    for (uint b = 0; b < region.blocks.size(); b++)
+    {
+        char *block = region.blocks[b];
+        if ((char *) chunk >= block && (char *) chunk < block + blockSize)
+        {
+            region.escaped[b] = true;
+            break;
+        }
+    }
+
+    // It now counts as a regular allocation
+    LocalMagazine().allocated++;
+}
+
+
+void TypeAllocator::ArenaDonate(char *block, uint used)
+// ----------------------------------------------------------------------------
+//   Turn a region block into a regular chunk, freeing all but escaped items
+// ----------------------------------------------------------------------------
+//   Escaped items had their IN_ARENA bit cleared. Items released since
+//   are on a free list, and their 'next' pointer never has that bit set.
+{
+    size_t   itemSize  = alignedSize + sizeof(Chunk);
+    char    *chunkBase = block + alignedSize;
+    Chunk_vp free = nullptr;
+    Chunk_vp last = nullptr;
+    uint     count = 0;
+    for (uint i = chunkSize; i-- > 0; )
+    {
+        Chunk_vp ptr = (Chunk_vp) (chunkBase + i * itemSize);
+        if (i < used && (~ptr->bits & IN_ARENA))
+            continue;
+        ptr->next = free;
+        free = ptr;
+        if (!last)
+            last = ptr;
+        count++;
+    }
+
+    // Only one thread updates the chunks list, see Refill
+    while (locked++)
+        locked--;
+    chunks.push_back((Chunk *) block);
+    --locked;
+
+    if (free)
+    {
+        Chunk_vp head;
+        do
+        {
+            head = freeList;
+            last->next = head;
+        }
+        while (!freeList.SetQ(head, free));
+        available += count;
+    }
+    record(memory, "Arena block %p handed over to '%+s' with %u free items",
+           block, name, count);
+}
+
+
+
+// ============================================================================
+//
+//    Background sweeper
+//
+// ============================================================================
+//
+//    With -gc_thread, dead objects are put on the to-delete lists by the
+//    collector and by ScheduleDelete, and this thread finalizes them.
+//    The sweeper holds 'finalizing' while it runs, so that objects released
+//    meanwhile by the evaluator are queued rather than finalized inline.
+//    A collection is skipped while a sweep is in progress, so that leak
+//    checking never looks at chunks being finalized.
+//
+//    The sweeper only finalizes objects whose allocator says CanSweep,
+//    i.e. trees without any Info attached. Info destructors (compiled code,
+//    tiered and bytecode state, load_data caches, lookup caches) and other
+//    types such as Context or RewriteCalls touch state that belongs to the
+//    evaluation thread. The sweeper puts them on the foreground list, and
+//    the evaluation thread finalizes them at its next collection.
+
+struct BackgroundSweeper
+// ----------------------------------------------------------------------------
+//   A thread finalizing objects on the to-delete lists
+// ----------------------------------------------------------------------------
+{
+    BackgroundSweeper()
+        : busy(false), stop(false), thread(&BackgroundSweeper::Run, this)
+    {
+        record(memory, "Started background sweeper");
+    }
+
+    ~BackgroundSweeper()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wake.notify_one();
+        thread.join();
+        record(memory, "Stopped background sweeper");
+    }
+
+    bool Busy()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return busy;
+    }
+
+    void Start()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busy = true;
+        }
+        wake.notify_one();
+    }
+
+    void Run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            wake.wait(lock, [this] { return busy || stop; });
+            if (!busy)
+                break;
+            lock.unlock();
+
+            TypeAllocator::finalizing++;
+            uint passes = 0;
+            while (GarbageCollector::Sweep(true))
+                passes++;
+            TypeAllocator::finalizing--;
+
+            // Return the freed chunks to the shared free lists
+            TypeAllocator::DrainMagazines();
+            record(memory, "Background sweep done in %u passes", passes);
+
+            lock.lock();
+            busy = false;
+        }
+    }
+
+private:
+    std::mutex                  mutex;
+    std::condition_variable     wake;
+    bool                        busy;
+    bool                        stop;
+    std::thread                 thread;
+};
+
+
+
 // ============================================================================
 //
 //   Garbage Collector class
@@ -466,7 +1044,7 @@ GarbageCollector::GarbageCollector()
 // ----------------------------------------------------------------------------
 //   Create the garbage collector
 // ----------------------------------------------------------------------------
-    : mustRun(false), running(false)
+    : mustRun(false), running(false), sweeper(nullptr)
 {}
 
 
@@ -475,9 +1053,14 @@ GarbageCollector::~GarbageCollector()
 //    Destroy the garbage collector
 // ----------------------------------------------------------------------------
 {
+    // Finish pending work in the background, then collect synchronously
+    delete sweeper;
+    sweeper = nullptr;
+
     MustRun();
     Collect();
     Collect();
+    TypeAllocator::DrainMagazines();
 
     Allocators::iterator i;
     for (i = allocators.begin(); i != allocators.end(); i++)
@@ -497,19 +1080,29 @@ void GarbageCollector::Register(TypeAllocator *allocator)
 //    Record each individual allocator
 // ----------------------------------------------------------------------------
 {
+    allocator->index = allocators.size();
     allocators.push_back(allocator);
 }
 
 
-bool GarbageCollector::Sweep()
+bool GarbageCollector::Sweep(bool background)
 // ----------------------------------------------------------------------------
 //    Cleanup all the pending deletions
 // ----------------------------------------------------------------------------
+//    Once there is a background sweeper, it is the only one popping the
+//    to-delete lists, the evaluation threads only push to them. A caller
+//    that checked Background() just before the sweeper started gets here.
 {
+    if (!background && gc->sweeper)
+    {
+        record(memory, "Foreground sweep left to the background sweeper");
+        return false;
+    }
+
     bool purging = false;
     Allocators &allocators = gc->allocators;
     for (Allocators::iterator a=allocators.begin(); a!=allocators.end(); a++)
-        purging |= (*a)->Sweep();
+        purging |= (*a)->Sweep(background);
     return purging;
 }
 
@@ -523,6 +1116,13 @@ bool GarbageCollector::Collect()
 
     // If we get here, we are at a safe point.
     // Only one thread enters collecting, the others spin and wait
+    if (sweeper && sweeper->Busy())
+    {
+        // Previous sweep still running, retry at next safe point
+        record(memory, "Garbage collection waiting for background sweep");
+        return false;
+    }
+
     if (Atomic<pthread_t>::SetQ(collecting, PTHREAD_NULL, self))
     {
         record(memory, "Garbage collection in thread %p", self);
@@ -540,14 +1140,38 @@ bool GarbageCollector::Collect()
         for (l = listeners.begin(); l != listeners.end(); l++)
             (*l)->BeginCollection();
 
-        // Cleanup pending purges to maximize the effect of garbage collection
-        bool sweeping = true;
-        while (sweeping)
+        // Start the background sweeper if requested. It releases objects
+        // while this thread runs, so reference counts must be atomic.
+        if (Opt::gcThread && !sweeper)
         {
-            // Check if any object was allocated and not captured at this stage
+            TypeAllocator::atomicCounts = true;
+            sweeper = new BackgroundSweeper;
+        }
+
+        // Finalize what the sweeper left to us since last collection
+        TypeAllocator::finalizing++;
+        for (a = allocators.begin(); a != allocators.end(); a++)
+            (*a)->SweepForeground();
+        TypeAllocator::finalizing--;
+
+        if (sweeper)
+        {
+            // Only hand over dead objects, the sweeper finalizes them
             for (a = allocators.begin(); a != allocators.end(); a++)
-                (*a)->CheckLeakedPointers();
-            sweeping = Sweep();
+                (*a)->CheckLeakedPointers(true);
+            sweeper->Start();
+        }
+        else
+        {
+            // Cleanup pending purges to maximize the effect of collection
+            bool sweeping = true;
+            while (sweeping)
+            {
+                // Check if any object was allocated and not captured yet
+                for (a = allocators.begin(); a != allocators.end(); a++)
+                    (*a)->CheckLeakedPointers();
+                sweeping = Sweep();
+            }
         }
 
         // Notify all the listeners that we completed the collection
@@ -579,6 +1203,7 @@ void GarbageCollector::PrintStatistics()
 // ----------------------------------------------------------------------------
 {
     uint tot = 0, alloc = 0, avail = 0, freed = 0, scan = 0, collect = 0;
+    TypeAllocator::ReportMagazines();
     printf("%24s %8s %8s %8s %8s %8s %8s\n",
            "NAME", "TOTAL", "AVAIL", "ALLOC", "FREED", "SCANNED", "COLLECT");
 
@@ -616,6 +1241,7 @@ void GarbageCollector::Statistics(uint &total,
 // ----------------------------------------------------------------------------
 {
     uint tot = 0, alloc = 0, avail = 0, free = 0, scan = 0, collect = 0;
+    TypeAllocator::ReportMagazines();
     std::vector<TypeAllocator *>::iterator a;
     for (a = allocators.begin(); a != allocators.end(); a++)
     {
@@ -744,6 +1370,21 @@ void *GarbageCollector::DebugPointer(void *ptr)
                         prev = f;
                     }
 
+                    freeIndex = 0;
+                    prev = nullptr;
+                    TA::Magazine &magazine = alloc->LocalMagazine();
+                    for (Chunk_vp f = magazine.free; f; f = f->next)
+                    {
+                        freeIndex++;
+                        if (f == chunk)
+                        {
+                            std::cerr << " magazine #" << freeIndex
+                                      << " after " << prev << " ";
+                            found++;
+                        }
+                        prev = f;
+                    }
+
                     freeIndex = 0;
                     prev = nullptr;
                     for (Chunk_vp f = alloc->toDelete; f; f = f->next)
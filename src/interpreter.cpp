@@ -62,6 +62,9 @@ namespace Opt
 NaturalOption   stackDepth("stack_depth",
                            "Maximum stack depth for interpreter",
                            1000, 25, 25000);
+BooleanOption   lookupCache("lookup_cache",
+                            "Cache lookup candidates on interpreter call sites",
+                            false);
 }
 
 
@@ -72,7 +75,10 @@ NaturalOption   stackDepth("stack_depth",
 //
 // ============================================================================
 
-typedef std::map<Tree_p, Tree_p> EvalCache;
+//   The keys are borrowed: they are either parts of the tree being evaluated
+//   or values held by the cache itself, so they outlive the cache
+
+typedef std::map<Tree *, Tree_p> EvalCache;
 
 
 
@@ -101,6 +107,19 @@ Interpreter::~Interpreter()
 }
 
 
+Interpreter *Interpreter::tiered = nullptr;
+
+
+Tree *Interpreter::Invoke(Scope *scope XL_UNUSED, Tree *self XL_UNUSED,
+                          Infix *decl XL_UNUSED, TreeList &args XL_UNUSED)
+// ----------------------------------------------------------------------------
+//    By default, there is no compiled code, evaluate the body
+// ----------------------------------------------------------------------------
+{
+    return nullptr;
+}
+
+
 Tree *Interpreter::Evaluate(Scope *scope, Tree *what)
 // ----------------------------------------------------------------------------
 //    Evaluate 'what', finding the final, non-closure result
@@ -191,7 +210,7 @@ struct Bindings
 
 private:
     Context_p  context;
-    Context_p  locals;
+    Context *  locals;          // Borrowed from the caller
     Tree_p     test;
     EvalCache  &cache;
 
@@ -251,7 +270,7 @@ inline bool Bindings::Do(Name *what)
     Save<Context_p> saveContext(context, context);
 
     // The test value may have been evaluated
-    EvalCache::iterator found = cache.find(test);
+    EvalCache::iterator found = cache.find(test.Pointer());
     if (found != cache.end())
         test = (*found).second;
 
@@ -476,11 +495,12 @@ void Bindings::MustEvaluate(bool updateContext)
 //   Evaluate 'test', ensuring that each bound arg is evaluated at most once
 // ----------------------------------------------------------------------------
 {
-    Tree *evaluated = cache[test];
+    Tree_p &cached = cache[test.Pointer()];
+    Tree *evaluated = cached;
     if (!evaluated)
     {
         evaluated = Interpreter::EvaluateClosure(context, test);
-        cache[test] = evaluated;
+        cached = evaluated;
         record(interpreter_lazy, "Test %t = new %t", test, evaluated);
     }
     else
@@ -506,11 +526,12 @@ Tree *Bindings::MustEvaluate(Context *context, Tree *tval)
 //   Ensure that each bound arg is evaluated at most once
 // ----------------------------------------------------------------------------
 {
-    Tree *evaluated = cache[tval];
+    Tree_p &cached = cache[tval];
+    Tree *evaluated = cached;
     if (!evaluated)
     {
         evaluated = Interpreter::EvaluateClosure(context, tval);
-        cache[tval] = evaluated;
+        cached = evaluated;
         record(interpreter_lazy, "Evaluate %t in context %t is new %t",
                tval, context, evaluated);
     }
@@ -652,6 +673,17 @@ static Tree *evalLookup(Scope *evalScope, Scope *declScope,
         return result;
     }
 
+    // Check if the declaration was compiled in the meantime
+    if (Interpreter *tiered = Interpreter::tiered)
+    {
+        if (Tree *compiled = tiered->Invoke(declScope, self, decl, args))
+        {
+            record(interpreter_eval, "Eval%u %t compiled, result %t",
+                   depth, self, compiled);
+            return compiled;
+        }
+    }
+
     // Normal case: evaluate body of the declaration in the new context
     result = decl->right;
     if (resultType != tree_type)
@@ -688,7 +720,11 @@ Tree *Interpreter::Instructions(Context_p context, Tree_p what)
     {
         // First attempt to look things up
         EvalCache cache;
-        if (Tree *eval = context->Lookup(what, evalLookup, &cache))
+        // 'what' holds the tree, so lookup can borrow it
+        Tree *eval = Opt::lookupCache
+            ? context->CachedLookup(what.Pointer(), evalLookup, &cache)
+            : context->Lookup(what.Pointer(), evalLookup, &cache);
+        if (eval)
         {
             if (eval == xl_error)
                 return eval;
@@ -718,7 +754,7 @@ Tree *Interpreter::Instructions(Context_p context, Tree_p what)
         {
             // Evaluate child in a new context
             context->CreateScope();
-            what = ((Block *) (Tree *) what)->child;
+            what = ((Block *) what.Pointer())->child;
             bool hasInstructions = context->ProcessDeclarations(what);
             if (context->IsEmpty())
                 context->PopScope();
@@ -737,7 +773,7 @@ Tree *Interpreter::Instructions(Context_p context, Tree_p what)
             }
 
             // If we have a name on the left, lookup name and start again
-            Prefix *pfx = (Prefix *) (Tree *) what;
+            Prefix *pfx = (Prefix *) what.Pointer();
             Tree   *callee = pfx->left;
 
             // Check if we had something like '(X->X+1) 31' as closure
@@ -820,7 +856,7 @@ Tree *Interpreter::Instructions(Context_p context, Tree_p what)
 
         case INFIX:
         {
-            Infix *infix = (Infix *) (Tree *) what;
+            Infix *infix = (Infix *) what.Pointer();
             text name = infix->name;
 
             // Check sequences
@@ -189,6 +189,11 @@
 # include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #else
 # include "llvm/ExecutionEngine/Orc/LLJIT.h"
+# include "llvm/ExecutionEngine/ObjectCache.h"
+# include <llvm/Support/FileSystem.h>
+# include <llvm/Support/MD5.h>
+# include <llvm/Support/MemoryBuffer.h>
+# include <llvm/Support/Path.h>
 #endif
 
 // Finally, link everything together.
@@ -212,8 +217,11 @@
 #include <cstdlib>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
+#include <unistd.h>
+#include <sys/time.h>
 
 
 
@@ -239,6 +247,7 @@ RECORDER(llvm_stats,            16, "LLVM statistics");
 RECORDER(llvm_code,             16, "LLVM code generation");
 RECORDER(llvm_gc,               16, "LLVM garbage collection");
 RECORDER(llvm_ir,               16, "LLVM intermediate representation");
+RECORDER(llvm_cache,            16, "LLVM on-disk object cache");
 
 
 
@@ -311,6 +320,19 @@ typedef VModuleKey                                   ModuleHandle;
 #endif // LLVM_VERSION vs. 700
 
 
+namespace Opt
+{
+BooleanOption   jitCache("jit_cache",
+                         "Keep machine code generated by the JIT on disk");
+TextOption      jitCacheDir("jit_cache_dir",
+                            "Directory for the JIT cache (default ~/.cache/xl)",
+                            "");
+NaturalOption   jitCacheSize("jit_cache_size",
+                             "Maximum size of the JIT cache in megabytes",
+                             128, 1, 1U<<20);
+}
+
+
 
 // ============================================================================
 //
@@ -355,6 +377,43 @@ JITInitializer::JITInitializer(int argc, char **argv)
 }
 
 
+#if LLVM_VERSION >= 900
+class JITObjectCache : public ObjectCache
+// ----------------------------------------------------------------------------
+//   Keep object files generated by the JIT on disk, for use by later runs
+// ----------------------------------------------------------------------------
+//   The key is the structural hash the compiler attaches to the module with
+//   JIT::CacheKey, combined with the functions of the part being compiled.
+//   Modules that embed the address of a tree are never cached, since such
+//   addresses are not stable from one run to the next.
+//   The directory is kept under jit_cache_size by removing the least
+//   recently used objects.
+{
+public:
+    JITObjectCache(unsigned &optLevel)
+        : optLevel(optLevel), used(0), hits(0), misses(0), stored(0) {}
+    ~JITObjectCache();
+
+    void notifyObjectCompiled(const llvm::Module *module,
+                              MemoryBufferRef object) override;
+    std::unique_ptr<MemoryBuffer> getObject(const llvm::Module *module) override;
+
+private:
+    text                Directory();
+    text                Path(const llvm::Module *module);
+    void                Evict();
+
+private:
+    unsigned &          optLevel;
+    text                directory;
+    std::mutex          lock;
+    std::map<const llvm::Module *, text> pending;
+    uint64_t            used;
+    uint                hits, misses, stored;
+};
+#endif // LLVM_VERSION >= 900
+
+
 class JITPrivate
 // ----------------------------------------------------------------------------
 //   JIT private data (from Kaleidoscope)
@@ -390,6 +449,7 @@ class JITPrivate
     IndirectStubs_u     stubs;
 #endif // LLVM_VERSION
 #else
+    JITObjectCache      objectCache;
     std::unique_ptr<LLLazyJIT> magic;
     ExecutionSession &  session;
     ThreadSafeContext   threadSafeContext;
@@ -501,6 +561,245 @@ static void logErrorsToStdErr(llvm::Error err) {
 #endif
 
 
+#if LLVM_VERSION >= 900
+JITObjectCache::~JITObjectCache()
+// ----------------------------------------------------------------------------
+//   Report cache statistics
+// ----------------------------------------------------------------------------
+{
+    if (hits || misses)
+        record(llvm_cache, "Object cache %u hits %u misses %u stored",
+               hits, misses, stored);
+}
+
+
+text JITObjectCache::Directory()
+// ----------------------------------------------------------------------------
+//   Return the cache directory, creating it if necessary
+// ----------------------------------------------------------------------------
+//   An empty result means that the cache cannot be used
+{
+    if (directory.empty())
+    {
+        text dir = Opt::jitCacheDir;
+        if (dir.empty())
+        {
+            if (kstring xdg = getenv("XDG_CACHE_HOME"))
+                dir = text(xdg) + "/xl";
+            else if (kstring home = getenv("HOME"))
+                dir = text(home) + "/.cache/xl";
+        }
+        if (dir.empty() || sys::fs::create_directories(dir))
+        {
+            record(llvm_cache, "Cannot use cache directory '%s'", dir);
+            Opt::jitCache.value = false;
+            return "";
+        }
+        directory = dir;
+
+        // Account for what earlier runs left in the directory
+        std::error_code ec;
+        for (sys::fs::directory_iterator it(dir, ec), end;
+             it != end && !ec;
+             it.increment(ec))
+        {
+            auto status = it->status();
+            if (status && sys::path::extension(it->path()) == ".o")
+                used += status->getSize();
+        }
+        record(llvm_cache, "Cache directory %s uses %u bytes", dir, used);
+    }
+    return directory;
+}
+
+
+static bool EmbedsAddress(const Value *value)
+// ----------------------------------------------------------------------------
+//   Check if a value refers to a constant address, e.g. that of a tree
+// ----------------------------------------------------------------------------
+{
+    const ConstantExpr *expr = dyn_cast<ConstantExpr>(value);
+    if (expr && expr->getOpcode() == Instruction::IntToPtr)
+        return true;
+    if (!isa<Constant>(value) || isa<GlobalValue>(value))
+        return false;
+    for (const Use &operand : cast<Constant>(value)->operands())
+        if (EmbedsAddress(operand.get()))
+            return true;
+    return false;
+}
+
+
+text JITObjectCache::Path(const llvm::Module *module)
+// ----------------------------------------------------------------------------
+//   Compute the path of the object file for a given module
+// ----------------------------------------------------------------------------
+//   An empty result means that the module cannot be cached
+{
+    // Only modules the compiler identified by their source can be cached.
+    // The metadata is copied into the parts the JIT splits the module into
+    NamedMDNode *named = module->getNamedMetadata("xl.cache");
+    if (!named || named->getNumOperands() != 1)
+        return "";
+    MDNode *node = named->getOperand(0);
+    MDString *key = node->getNumOperands() == 1
+        ? dyn_cast<MDString>(node->getOperand(0))
+        : nullptr;
+    if (!key)
+        return "";
+
+    // Code referring to a tree embeds its address, which the next run changes
+    for (const llvm::Function &function : *module)
+        for (const BasicBlock &block : function)
+            for (const Instruction &instruction : block)
+                for (const Use &operand : instruction.operands())
+                    if (EmbedsAddress(operand.get()))
+                        return "";
+    for (const GlobalVariable &global : module->globals())
+        if (global.hasInitializer() && EmbedsAddress(global.getInitializer()))
+            return "";
+
+    text dir = Directory();
+    if (dir.empty())
+        return "";
+
+    // Identify the part of the module by the symbols it defines and uses
+    MD5 md5;
+    md5.update(std::to_string(LLVM_VERSION) + ';' +
+               std::to_string(optLevel) + ';' +
+               module->getTargetTriple() + ';');
+    md5.update(key->getString());
+    for (const llvm::GlobalValue &global : module->global_values())
+    {
+        md5.update(global.isDeclaration() ? ";U " : ";D ");
+        md5.update(global.getName());
+    }
+    MD5::MD5Result digest;
+    md5.final(digest);
+    SmallString<32> hex;
+    MD5::stringifyResult(digest, hex);
+    return dir + "/" + text(hex.str()) + ".o";
+}
+
+
+void JITObjectCache::Evict()
+// ----------------------------------------------------------------------------
+//   Remove the least recently used objects until the cache fits its size
+// ----------------------------------------------------------------------------
+//   Hits touch the object, so the modification time is the last use
+{
+    uint64_t limit = uint64_t(Opt::jitCacheSize.value) << 20;
+    if (used <= limit)
+        return;
+
+    struct Entry
+    {
+        text                    path;
+        uint64_t                size;
+        sys::TimePoint<>        time;
+    };
+    std::vector<Entry> entries;
+    std::error_code ec;
+    used = 0;
+    for (sys::fs::directory_iterator it(directory, ec), end;
+         it != end && !ec;
+         it.increment(ec))
+    {
+        auto status = it->status();
+        if (!status || sys::path::extension(it->path()) != ".o")
+            continue;
+        entries.push_back({ it->path(),
+                            status->getSize(),
+                            status->getLastModificationTime() });
+        used += status->getSize();
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry &a, const Entry &b) { return a.time < b.time; });
+
+    uint removed = 0;
+    for (auto &entry : entries)
+    {
+        if (used <= limit)
+            break;
+        if (!sys::fs::remove(entry.path))
+        {
+            used -= entry.size;
+            removed++;
+        }
+    }
+    record(llvm_cache, "Evicted %u objects, cache now uses %u bytes",
+           removed, used);
+}
+
+
+std::unique_ptr<MemoryBuffer>
+JITObjectCache::getObject(const llvm::Module *module)
+// ----------------------------------------------------------------------------
+//   Return the object for the module if we have one on disk
+// ----------------------------------------------------------------------------
+{
+    if (!Opt::jitCache)
+        return nullptr;
+
+    std::lock_guard<std::mutex> guard(lock);
+    text path = Path(module);
+    if (path.empty())
+        return nullptr;
+
+    auto object = MemoryBuffer::getFile(path);
+    if (!object)
+    {
+        misses++;
+        pending[module] = path;
+        record(llvm_cache, "Miss %s (%u hits %u misses)",
+               path, hits, misses);
+        return nullptr;
+    }
+    hits++;
+    utimes(path.c_str(), nullptr);
+    record(llvm_cache, "Hit %s (%u hits %u misses)", path, hits, misses);
+    return std::move(*object);
+}
+
+
+void JITObjectCache::notifyObjectCompiled(const llvm::Module *module,
+                                          MemoryBufferRef object)
+// ----------------------------------------------------------------------------
+//   Write a newly compiled object to disk
+// ----------------------------------------------------------------------------
+//   Objects are written to a temporary file then renamed, so that concurrent
+//   runs never see a partially written object
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto found = pending.find(module);
+    if (found == pending.end())
+        return;
+    text path = found->second;
+    pending.erase(found);
+
+    text temp = path + "." + std::to_string(getpid());
+    std::error_code ec;
+    {
+        raw_fd_ostream out(temp, ec, sys::fs::OF_None);
+        if (!ec)
+            out.write(object.getBufferStart(), object.getBufferSize());
+    }
+    if (!ec)
+        ec = sys::fs::rename(temp, path);
+    if (ec)
+    {
+        record(llvm_cache, "Unable to write %s: %s", path, ec.message());
+        sys::fs::remove(temp);
+        return;
+    }
+    stored++;
+    used += object.getBufferSize();
+    record(llvm_cache, "Stored %s size %u", path, object.getBufferSize());
+    Evict();
+}
+#endif // LLVM_VERSION >= 900
+
+
 extern "C" Natural *xl_new_natural(TreePosition pos, ulonglong value);
 JITPrivate::JITPrivate(int argc, char **argv)
 // ----------------------------------------------------------------------------
@@ -582,7 +881,26 @@ JITPrivate::JITPrivate(int argc, char **argv)
       stubs(createStubs(*target)),
 #endif // LLVM_VERSION 380
 #else // LLVM_VERSION >= 900
-      magic(exitOnError(LLLazyJITBuilder().create())),
+      objectCache(optLevel),
+      magic(exitOnError(
+                LLLazyJITBuilder()
+                .setCompileFunctionCreator(
+                    [this](JITTargetMachineBuilder jtmb)
+#if LLVM_VERSION < 1100
+                    -> Expected<IRCompileLayer::CompileFunction>
+                    {
+                        return IRCompileLayer::CompileFunction(
+                            ConcurrentIRCompiler(std::move(jtmb),
+                                                 &objectCache));
+                    })
+#else // LLVM_VERSION >= 1100
+                    -> Expected<std::unique_ptr<IRCompileLayer::IRCompiler>>
+                    {
+                        return std::make_unique<ConcurrentIRCompiler>(
+                            std::move(jtmb), &objectCache);
+                    })
+#endif // LLVM_VERSION 1100
+                .create())),
       session(magic->getExecutionSession()),
 #if LLVM_VERSION < 1000
       threadSafeContext(make_unique<LLVMContext>()),
@@ -1249,6 +1567,31 @@ void JIT::DeleteModule(JIT::ModuleID modID)
 }
 
 
+void JIT::CacheKey(text description)
+// ----------------------------------------------------------------------------
+//   Identify the current module for the object cache
+// ----------------------------------------------------------------------------
+//   The description is what the compiler built the module from, i.e. the
+//   source and the machine types, never the resulting IR
+{
+#if LLVM_VERSION >= 900
+    JIT::Module_p module = p.Module();
+    assert(module && "Setting cache key without a module");
+    MD5 md5;
+    md5.update(description);
+    MD5::MD5Result digest;
+    md5.final(digest);
+    SmallString<32> hex;
+    MD5::stringifyResult(digest, hex);
+
+    NamedMDNode *named = module->getOrInsertNamedMetadata("xl.cache");
+    named->clearOperands();
+    named->addOperand(MDNode::get(p.context, MDString::get(p.context, hex)));
+    record(llvm_cache, "Module %p cache key %s", module, text(hex.str()));
+#endif // LLVM_VERSION >= 900
+}
+
+
 JIT::Function_p JIT::Function(JIT::FunctionType_p type, text name)
 // ----------------------------------------------------------------------------
 //    Create a function with the given name and type
@@ -1292,6 +1635,17 @@ void *JIT::ExecutableCode(JIT::Function_p f)
 }
 
 
+void *JIT::ExecutableCode(text name)
+// ----------------------------------------------------------------------------
+//   Return an executable pointer to a function emitted by an earlier module
+// ----------------------------------------------------------------------------
+{
+    JITTargetAddress address = p.Address(name);
+    record(llvm_functions, "Address of %s is %p", name.c_str(), (void *) address);
+    return (void *) address;
+}
+
+
 JIT::Function_p JIT::ExternFunction(JIT::FunctionType_p type, text name)
 // ----------------------------------------------------------------------------
 //    Create an extern function with the given name and type
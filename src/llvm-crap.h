@@ -224,11 +224,13 @@ public:
     // Modules
     ModuleID            CreateModule(text name);
     void                DeleteModule(ModuleID id);
+    void                CacheKey(text description);
 
     // Functions
     Function_p          Function(FunctionType_p type, text name);
     void                Finalize(Function_p function);
     void *              ExecutableCode(Function_p f);
+    void *              ExecutableCode(text name);
 
     // Prototypes and external functions
     Function_p          ExternFunction(FunctionType_p fty, text name);
@@ -52,14 +52,17 @@
 #include "opcodes.h"
 #include "remote.h"
 #include "interpreter.h"
+#include "bytecode.h"
 #ifndef INTERPRETER_ONLY
 #include "compiler.h"
 #include "compiler-fast.h"
+#include "compiler-tiered.h"
 #endif // INTERPRETER_ONLY
 
 #include <recorder/recorder.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <map>
 #include <iostream>
 #include <fstream>
@@ -67,6 +70,8 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 
 
 RECORDER(fileload,                      16, "Files being loaded");
@@ -126,6 +131,9 @@ NaturalOption   remoteForks("remote_forks",
                             "Select the number of forks for remote access",
                             20, 0, 1000);
 
+BooleanOption   reload("reload",
+                       "Reload modified source files between remote requests");
+
 BooleanOption   showSource("show",
                            "Show the source code");
 
@@ -148,6 +156,24 @@ BooleanOption   writeEncrypted("encrypted_writes",
 BooleanOption   writePacked("packed_writes",
                      "Pack files as they are written");
 
+TextOption      builtinsImage("builtins_image",
+                              "Set the path for the precompiled builtins image",
+                              "");
+
+BooleanOption   dumpImage("dump_image",
+                          "Write the precompiled builtins image");
+
+BooleanOption   arena("arena",
+                      "Release evaluation temporaries at once after evaluation");
+
+NaturalOption   arenaSize("arena_size",
+                          "Maximum number of objects in the evaluation arena",
+                          1 << 20, 0, 1 << 30);
+
+BooleanOption   tiered("tiered",
+                       "Interpret first, compile hot declarations");
+BooleanOption   bytecode("bytecode",
+                         "Evaluate using the bytecode engine");
 BooleanOption   emitIR("emit_ir", "Generate LLVM IR suitable for llvmc");
 AliasOption     emitIRAlias("B", emitIR);
 }
@@ -160,19 +186,51 @@ AliasOption     emitIRAlias("B", emitIR);
 //
 // ============================================================================
 
+static bool ReadSource(text name, text &source)
+// ----------------------------------------------------------------------------
+//   Read the contents of a source file
+// ----------------------------------------------------------------------------
+{
+    utf8_ifstream input(name.c_str(), std::ios::in|std::ios::binary);
+    if (!input.good())
+        return false;
+    std::stringstream contents;
+    contents << input.rdbuf();
+    source = contents.str();
+    return true;
+}
+
+
+static time_t SourceModified(const utf8_filestat_t &st)
+// ----------------------------------------------------------------------------
+//   Modification time to remember for a source file
+// ----------------------------------------------------------------------------
+//   A file modified during the current second may change again within that
+//   second without a new modification time, so it has to be checked again.
+//   The hash of the contents avoids parsing it again if it did not change.
+{
+    return st.st_mtime < time(nullptr) ? st.st_mtime : 0;
+}
+
+
 SourceFile::SourceFile(text n, Tree *t, Scope *scope, bool ro)
 // ----------------------------------------------------------------------------
 //   Construct a source file given a name
 // ----------------------------------------------------------------------------
     : name(n), tree(t), scope(scope),
-      modified(0), changed(false), readOnly(ro)
+      modified(0), hash(0), changed(false), readOnly(ro)
 {
     utf8_filestat_t st;
     if (utf8_stat (n.c_str(), &st) < 0)
         return;
-    modified = st.st_mtime;
+    modified = SourceModified(st);
     if (utf8_access (n.c_str(), W_OK) != 0)
         readOnly = true;
+
+    // Remember the contents, to ignore changes to modification time only
+    text source;
+    if (ReadSource(n, source))
+        hash = Context::HashText(source);
 }
 
 
@@ -181,7 +239,7 @@ SourceFile::SourceFile()
 //   Default constructor
 // ----------------------------------------------------------------------------
     : name(""), tree(nullptr), scope(nullptr),
-      modified(0), changed(false), readOnly(false)
+      modified(0), hash(0), changed(false), readOnly(false)
 {}
 
 
@@ -244,18 +302,25 @@ Main::Main(int inArgc,
     }
 #endif // INTERPRETER_ONLY
     Opcode::Enter(&context);
+    context.Compact();
 
     // Once all options have been read, enter symbols and setup compiler
 #ifndef INTERPRETER_ONLY
     compilerName = SearchFile(compilerName, bin_paths);
     kstring cname = compilerName.c_str();
     uint opt = Opt::optimize.value;
-    if (opt == 1)
+#endif // INTERPRETER_ONLY
+    if (Opt::bytecode)
+        evaluator = new Bytecode;
+#ifndef INTERPRETER_ONLY
+    else if (Opt::tiered)
+        evaluator = new TieredCompiler(cname, opt, inArgc, inArgv);
+    else if (opt == 1)
         evaluator = new FastCompiler(cname, opt, inArgc, inArgv);
     else if (opt >= 2)
         evaluator = new Compiler(cname, opt, inArgc, inArgv);
-    else
 #endif // INTERPRETER_ONLY
+    else
         evaluator = new Interpreter;
 
     // Force a crash if this is requested
@@ -285,7 +350,16 @@ Tree *Main::Evaluate(Scope *scope, Tree *source)
 //   Dispatch evaluation to the appropriate engine for the given opt level
 // ----------------------------------------------------------------------------
 {
-    return evaluator->Evaluate(scope, source);
+    if (!Opt::arena)
+        return evaluator->Evaluate(scope, source);
+
+    // Temporaries not captured by the result are released at once
+    Tree_p result;
+    {
+        GCArena arena(Opt::arenaSize);
+        result = evaluator->Evaluate(scope, source);
+    }
+    return result;
 }
 
 
@@ -441,14 +515,32 @@ int Main::LoadFile(text file, text modname)
     }
 
     // Check if we need to deserialize the input file first
+    // It is read in memory, so that it can still be parsed if not packed
     if (Opt::writePacked)
     {
-        Deserializer deserializer(*input);
+        if (input != &inputStream)
+        {
+            inputStream << input->rdbuf();
+            input = &inputStream;
+        }
+        text packed = inputStream.str();
+        Deserializer deserializer(packed.data(), packed.size());
         tree = deserializer.ReadTree();
         if (deserializer.IsValid())
-        {
             record(fileload, "Input was in serialized format");
-        }
+        else
+            tree = nullptr;
+    }
+
+    // Check if we can use the precompiled image of the builtins
+    bool isBuiltins = file == Opt::builtinsPath.value;
+    bool useImage = isBuiltins && Opt::builtinsImage.value != "";
+    if (!tree && useImage && !Opt::dumpImage)
+    {
+        tree = LoadImage(file, Opt::builtinsImage);
+        if (tree)
+            record(fileload, "Builtins loaded from image %s",
+                   Opt::builtinsImage.value.c_str());
     }
 
     // Read in standard format if we could not read it from packed format
@@ -460,6 +552,10 @@ int Main::LoadFile(text file, text modname)
             errName = "<stdin>";
         Parser parser (*input, syntax, positions, topLevelErrors, errName);
         tree = parser.Parse();
+
+        // Write the builtins image for subsequent runs if requested
+        if (tree && useImage && Opt::dumpImage)
+            SaveImage(file, Opt::builtinsImage, tree);
     }
 
     // If at this stage we don't have a tree, this is an error
@@ -472,17 +568,17 @@ int Main::LoadFile(text file, text modname)
     // Output packed if this was requested
     if (Opt::writePacked)
     {
-        std::stringstream output;
-        Serializer serialize(output);
-        tree->Do(serialize);
-        text packed = output.str();
+        if (!writer)
+            writer = new Serializer;
+        writer->Reset();
+        tree->Do(writer);
         if (Opt::writeEncrypted)
         {
-            text crypted = Encrypt(packed);
+            text crypted = Encrypt(writer->Buffer());
             if (crypted == "")
             {
                 record(fileload, "No encryption, output is packed");
-                std::cout << packed;
+                std::cout.write(writer->Data(), writer->Size());
             }
             else
             {
@@ -493,7 +589,7 @@ int Main::LoadFile(text file, text modname)
         else
         {
             record(fileload, "Packed output");
-            std::cout << packed;
+            std::cout.write(writer->Data(), writer->Size());
         }
     }
 
@@ -568,6 +664,9 @@ int Main::Run()
                 errors.Display();
                 errors.Clear();
             }
+
+            // Declarations are now all in, switch to a flat table
+            Context(sf.scope).Compact();
         }
 
         if (!result)
@@ -586,6 +685,437 @@ int Main::Run()
 
 
 
+// ============================================================================
+//
+//   Incremental reload
+//
+// ============================================================================
+//
+//   A modified file is parsed again, and its top-level statements compared
+//   with the ones already loaded. Unchanged statements are kept, along with
+//   everything cached on them. A declaration whose pattern did not change
+//   gets its new body in place, so that its entry in the symbol table and
+//   the lookup caches referring to it remain valid. The symbol table is only
+//   rebuilt if declarations were added or removed. Code compiled for the
+//   changed declarations, and for those that may call them, is invalidated.
+
+static void SourceStatements(Tree *tree, TreeList &statements)
+// ----------------------------------------------------------------------------
+//   Flatten the top-level sequence of a source file
+// ----------------------------------------------------------------------------
+{
+    while (Infix *infix = IsSequence(tree))
+    {
+        SourceStatements(infix->left, statements);
+        tree = infix->right;
+    }
+    statements.push_back(tree);
+}
+
+
+static Tree *SourceSequence(TreeList &statements)
+// ----------------------------------------------------------------------------
+//   Build a top-level sequence from statements
+// ----------------------------------------------------------------------------
+{
+    size_t count = statements.size();
+    if (!count)
+        return xl_nil;
+    Tree *result = statements[count - 1];
+    for (size_t i = count - 1; i > 0; i--)
+    {
+        Tree *left = statements[i - 1];
+        result = new Infix("\n", left, result, left->Position());
+    }
+    return result;
+}
+
+
+static ulong StatementHash(Tree *tree)
+// ----------------------------------------------------------------------------
+//   Hash a whole statement, to quickly find statements that may be equal
+// ----------------------------------------------------------------------------
+{
+    ulong h = Context::Hash(tree);
+    if (Infix *infix = tree->AsInfix())
+        h ^= Context::Rehash(StatementHash(infix->left) +
+                             3 * StatementHash(infix->right));
+    else if (Prefix *prefix = tree->AsPrefix())
+        h ^= Context::Rehash(StatementHash(prefix->left) +
+                             5 * StatementHash(prefix->right));
+    else if (Postfix *postfix = tree->AsPostfix())
+        h ^= Context::Rehash(StatementHash(postfix->left) +
+                             7 * StatementHash(postfix->right));
+    else if (Block *block = tree->AsBlock())
+        h ^= Context::Rehash(StatementHash(block->child));
+    return h;
+}
+
+
+static bool Mentions(Tree *tree, std::set<ulong> &hashes)
+// ----------------------------------------------------------------------------
+//   Check if a tree may lookup a declaration with one of the given hashes
+// ----------------------------------------------------------------------------
+{
+    while (tree)
+    {
+        if (hashes.count(Context::Hash(tree)))
+            return true;
+        if (Infix *infix = tree->AsInfix())
+        {
+            if (Mentions(infix->left, hashes))
+                return true;
+            tree = infix->right;
+        }
+        else if (Prefix *prefix = tree->AsPrefix())
+        {
+            if (Mentions(prefix->left, hashes))
+                return true;
+            tree = prefix->right;
+        }
+        else if (Postfix *postfix = tree->AsPostfix())
+        {
+            if (Mentions(postfix->left, hashes))
+                return true;
+            tree = postfix->right;
+        }
+        else if (Block *block = tree->AsBlock())
+        {
+            tree = block->child;
+        }
+        else
+        {
+            break;
+        }
+    }
+    return false;
+}
+
+
+static void ScopeDeclarations(Scope *scope, RewriteList &decls)
+// ----------------------------------------------------------------------------
+//   Collect the declarations in a scope, in the order Compact uses
+// ----------------------------------------------------------------------------
+{
+    RewriteList pending;
+    if (Rewrite *rw = ScopeRewrites(scope))
+        pending.push_back(rw);
+    while (!pending.empty())
+    {
+        Rewrite *rw = pending.back();
+        pending.pop_back();
+        decls.push_back(RewriteDeclaration(rw));
+        Infix *children = RewriteNext(rw);
+        if (Rewrite *right = children->right->AsInfix())
+            pending.push_back(right);
+        if (Rewrite *left = children->left->AsInfix())
+            pending.push_back(left);
+    }
+}
+
+
+bool Main::Reload()
+// ----------------------------------------------------------------------------
+//   Reload all the source files that were modified, return true if any
+// ----------------------------------------------------------------------------
+//   This must be called when no evaluation is in progress, e.g. between
+//   two requests of a server. Top-level instructions are not evaluated
+//   again, SourceFile::changed tells the caller if they were modified.
+{
+    bool result = false;
+    for (auto &file : files)
+        if (Reload(file.second))
+            result = true;
+    return result;
+}
+
+
+bool Main::Reload(SourceFile &sf)
+// ----------------------------------------------------------------------------
+//   Reload a single source file if it was modified
+// ----------------------------------------------------------------------------
+{
+    // Check if the file contents really changed
+    utf8_filestat_t st;
+    if (!sf.tree || !sf.scope || sf.name == "-" ||
+        utf8_stat(sf.name.c_str(), &st) < 0 || st.st_mtime == sf.modified)
+        return false;
+    sf.modified = SourceModified(st);
+    text source;
+    if (!ReadSource(sf.name, source))
+        return false;
+    uint64 hash = Context::HashText(source);
+    if (hash == sf.hash)
+        return false;
+    sf.hash = hash;
+
+    // Parse the new contents, keep the old ones if there is any error
+    std::istringstream input(source);
+    uint errorCount = topLevelErrors.Count();
+    Parser parser(input, syntax, positions, topLevelErrors, sf.name.c_str());
+    Tree_p tree = parser.Parse();
+    if (!tree || topLevelErrors.Count() != errorCount)
+    {
+        record(fileload, "Reload of %s failed, keeping previous version",
+               sf.name.c_str());
+        return false;
+    }
+    tree = Normalize(tree);
+
+    // Find statements that did not change
+    TreeList oldStatements, newStatements;
+    SourceStatements(sf.tree, oldStatements);
+    SourceStatements(tree, newStatements);
+    std::multimap<ulong, size_t> oldIndex;
+    for (size_t o = 0; o < oldStatements.size(); o++)
+        oldIndex.insert(std::make_pair(StatementHash(oldStatements[o]), o));
+
+    size_t count = newStatements.size();
+    std::vector<bool> kept(oldStatements.size(), false);
+    std::vector<bool> matched(count, false);
+    TreeList statements(newStatements);
+    for (size_t n = 0; n < count; n++)
+    {
+        auto range = oldIndex.equal_range(StatementHash(newStatements[n]));
+        for (auto i = range.first; i != range.second && !matched[n]; i++)
+        {
+            size_t o = i->second;
+            if (!kept[o] && Tree::Equal(oldStatements[o], newStatements[n]))
+            {
+                statements[n] = oldStatements[o];
+                kept[o] = matched[n] = true;
+            }
+        }
+    }
+
+    // Declarations with the same pattern get their new body in place
+    RewriteList updated;
+    for (size_t n = 0; n < count; n++)
+    {
+        Infix *decl = matched[n] ? nullptr : IsDeclaration(newStatements[n]);
+        for (size_t o = 0; decl && o < oldStatements.size(); o++)
+        {
+            Infix *old = kept[o] ? nullptr : IsDeclaration(oldStatements[o]);
+            if (old && Tree::Equal(old->left, decl->left))
+            {
+                evaluator->Invalidate(old);
+                old->right = decl->right;
+                updated.push_back(old);
+                statements[n] = old;
+                kept[o] = matched[n] = true;
+                decl = nullptr;
+            }
+        }
+    }
+
+    // What remains was added or removed
+    bool instructions = false;
+    RewriteList added, removed;
+    Context context(sf.scope);
+    for (size_t n = 0; n < count; n++)
+        if (!matched[n])
+            instructions |= context.CollectDeclarations(newStatements[n],
+                                                        added);
+    for (size_t o = 0; o < oldStatements.size(); o++)
+        if (!kept[o])
+            instructions |= context.CollectDeclarations(oldStatements[o],
+                                                        removed);
+
+    // Rebuild the symbol table if declarations were added or removed
+    if (added.size() || removed.size())
+    {
+        RewriteList entries, decls;
+        ScopeDeclarations(sf.scope, entries);
+        for (Infix *entry : entries)
+        {
+            bool gone = false;
+            for (Infix *decl : removed)
+                if (entry == decl || (Tree::Equal(entry->left, decl->left) &&
+                                      Tree::Equal(entry->right, decl->right)))
+                    gone = true;
+            if (gone)
+                evaluator->Invalidate(entry);
+            else
+                decls.push_back(entry);
+        }
+        decls.insert(decls.end(), added.begin(), added.end());
+
+        bool compact = Context::Table(sf.scope) != nullptr;
+        context.Clear();
+        context.EnterAll(decls);
+        if (compact)
+            context.Compact();
+    }
+
+    // Invalidate code for declarations that may use what changed
+    std::set<ulong> hashes;
+    for (RewriteList *list : { &updated, &added, &removed })
+        for (Infix *decl : *list)
+            hashes.insert(Context::Hash(PatternBase(decl->left)));
+    uint invalidated = 0;
+    if (hashes.size())
+    {
+        RewriteList all;
+        for (auto &file : files)
+            if (file.second.scope)
+                ScopeDeclarations(file.second.scope, all);
+        std::set<Infix *> done(updated.begin(), updated.end());
+        bool more = true;
+        while (more)
+        {
+            more = false;
+            for (Infix *decl : all)
+            {
+                if (done.count(decl) || !Mentions(decl->right, hashes))
+                    continue;
+                evaluator->Invalidate(decl);
+                done.insert(decl);
+                hashes.insert(Context::Hash(PatternBase(decl->left)));
+                invalidated++;
+                more = true;
+            }
+        }
+        for (Tree *statement : statements)
+            if (!IsDeclaration(statement) && Mentions(statement, hashes))
+                evaluator->Invalidate(statement);
+    }
+
+    sf.tree = SourceSequence(statements);
+    sf.changed = instructions;
+    record(fileload, "Reloaded %s: %u updated, %u added, %u removed, "
+           "%u invalidated, instructions %+s",
+           sf.name.c_str(), updated.size(), added.size(), removed.size(),
+           invalidated, instructions ? "changed" : "unchanged");
+    return true;
+}
+
+
+
+// ============================================================================
+//
+//   Precompiled image of the builtins
+//
+// ============================================================================
+//
+//   The image is the serialized parse tree of the builtins file, preceded
+//   by a header identifying the source it was built from. It is mapped
+//   read-only and deserialized in place, skipping the scanner and parser.
+//   A stale or damaged image is simply ignored, and the source is parsed.
+
+struct ImageHeader
+// ----------------------------------------------------------------------------
+//   Header identifying the builtins source an image was built from
+// ----------------------------------------------------------------------------
+{
+    enum { MAGIC = 0x584C494D, VERSION = 1 };
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    serialVersion;
+    uint32_t    padding;
+    int64_t     sourceTime;
+    int64_t     sourceSize;
+};
+
+
+static bool ImageHeaderFor(text file, ImageHeader &header)
+// ----------------------------------------------------------------------------
+//   Build the header expected for an image of the given source file
+// ----------------------------------------------------------------------------
+{
+    struct stat st;
+    if (stat(file.c_str(), &st) < 0)
+        return false;
+    memset(&header, 0, sizeof(header));
+    header.magic = ImageHeader::MAGIC;
+    header.version = ImageHeader::VERSION;
+    header.serialVersion = serialVERSION;
+    header.sourceTime = st.st_mtime;
+    header.sourceSize = st.st_size;
+    return true;
+}
+
+
+Tree *Main::LoadImage(text file, text image)
+// ----------------------------------------------------------------------------
+//   Map a precompiled image and rebuild the tree for the given source
+// ----------------------------------------------------------------------------
+{
+    ImageHeader expected;
+    if (!ImageHeaderFor(file, expected))
+        return nullptr;
+
+    int fd = open(image.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+
+    Tree_p tree = nullptr;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) > sizeof(ImageHeader))
+    {
+        size_t size = st.st_size;
+        void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            const char *data = (const char *) map;
+            if (memcmp(data, &expected, sizeof(expected)) == 0)
+            {
+                Deserializer deserializer(data + sizeof(expected),
+                                          size - sizeof(expected),
+                                          positions.OpenFile(file));
+                tree = deserializer.ReadTree();
+                if (!deserializer.IsValid())
+                    tree = nullptr;
+            }
+            else
+            {
+                record(fileload, "Image %s is stale for %s",
+                       image.c_str(), file.c_str());
+            }
+            munmap(map, size);
+        }
+    }
+    close(fd);
+    return tree;
+}
+
+
+bool Main::SaveImage(text file, text image, Tree *tree)
+// ----------------------------------------------------------------------------
+//   Write a precompiled image for the given source and its parse tree
+// ----------------------------------------------------------------------------
+{
+    ImageHeader header;
+    if (!ImageHeaderFor(file, header))
+        return false;
+
+    // Write to a temporary file and rename, so that readers never see
+    // a partially written image
+    text temp = image + ".tmp";
+    {
+        std::ofstream output(temp.c_str(),
+                             std::ios::out|std::ios::binary|std::ios::trunc);
+        Serializer serialize;
+        tree->Do(serialize);
+        output.write((const char *) &header, sizeof(header));
+        output.write(serialize.Data(), serialize.Size());
+        if (!output.good() || !serialize.IsValid())
+        {
+            unlink(temp.c_str());
+            record(fileload, "Unable to write image %s", image.c_str());
+            return false;
+        }
+    }
+    if (rename(temp.c_str(), image.c_str()) < 0)
+    {
+        unlink(temp.c_str());
+        return false;
+    }
+    record(fileload, "Wrote image %s for %s", image.c_str(), file.c_str());
+    return true;
+}
+
+
+
 // ============================================================================
 //
 //   Configurable hooks for use as an application library
@@ -41,19 +41,28 @@
 #include "main.h"
 #include "save.h"
 #include "tree-clone.h"
-#include "fdstream.hpp"
 
 #include <sys/types.h>
 #ifndef HAVE_SYS_SOCKET_H
 #include "winsock2.h"
 #undef Context
+#define poll            WSAPoll
+struct iovec { void *iov_base; size_t iov_len; };
 #else // HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
 #endif // HAVE_SYS_SOCKET_H
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif // HAVE_SYS_EPOLL_H
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
@@ -61,6 +70,19 @@
 
 #include <string>
 #include <sstream>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL    0
+#endif // MSG_NOSIGNAL
+#ifndef MSG_DONTWAIT
+#define MSG_DONTWAIT    0
+#endif // MSG_DONTWAIT
 
 
 RECORDER(remote,        64, "Remote context information");
@@ -70,10 +92,44 @@ RECORDER(remote_invoke, 32, "Evaluating 'invoke' in remote package");
 RECORDER(remote_listen, 32, "Evaluating 'listen' in remote package");
 RECORDER(remote_reply,  32, "Evaluating 'reply' in remote package");
 RECORDER(remote_error,  64, "Errors from the remote package");
+RECORDER(remote_queue,  64, "Queueing delay of remote requests");
 
 XL_BEGIN
 
 
+// ============================================================================
+//
+//    Options
+//
+// ============================================================================
+
+namespace Opt
+{
+NaturalOption   remoteKeepAlive("remote_keepalive",
+                                "Seconds an idle remote connexion stays open, "
+                                "0 to close after each request",
+                                30, 0, 3600);
+NaturalOption   remoteResolve("remote_resolve",
+                              "Seconds remote host addresses are cached",
+                              60, 0, 24 * 3600);
+NaturalOption   remoteBacklog("remote_backlog",
+                              "Connexions waiting to be accepted by a listener",
+                              64, 1, 65535);
+NaturalOption   remoteQueue("remote_queue",
+                            "Requests a listener reads ahead of evaluation",
+                            64, 1, 65536);
+NaturalOption   remoteScopes("remote_scopes",
+                             "Scopes received from remote hosts kept for "
+                             "other connexions",
+                             1024, 0, 1 << 20);
+NaturalOption   remotePending("remote_pending",
+                              "Results of asynchronous requests kept "
+                              "until awaited",
+                              1024, 1, 1 << 20);
+}
+
+
+
 // ============================================================================
 //
 //    Global state (per thread?)
@@ -82,6 +138,7 @@ XL_BEGIN
 
 static uint        active_children = 0;
 static int         reply_socket    = 0;
+static uint        reply_id        = 0;
 static Tree_p      received        = xl_nil;
 static Tree_p      hook            = xl_true;
 static bool        listening       = true;
@@ -94,34 +151,208 @@ static bool        listening       = true;
 //
 // ============================================================================
 
-static Tree *xl_read_tree(int sock)
+//   Many messages can be exchanged on a single connexion. Each message is
+//   a frame holding its kind and the length of the serialized tree, so that
+//   the receiver knows where it ends without the sender closing the socket.
+//   It also holds the identifier of the request, which responses repeat,
+//   so that a client may send several requests before reading responses.
+
+enum FrameKind
+// ----------------------------------------------------------------------------
+//   The kind of messages exchanged between hosts
+// ----------------------------------------------------------------------------
+{
+    frameTELL,                  // Code to evaluate, no response
+    frameASK,                   // Code to evaluate, replies and result
+    frameREPLY,                 // Code sent back by 'reply'
+    frameDONE,                  // Result of the evaluation, ends the request
+    frameMISSING                // Scopes are missing, send the request again
+};
+const size_t FRAME_HEADER = 3 * sizeof(uint32_t);
+
+
+static bool xl_write_all(int sock, iovec *parts, uint count)
+// ----------------------------------------------------------------------------
+//   Write all the non-empty buffers to the socket, without copying them
+// ----------------------------------------------------------------------------
+{
+    while (count)
+    {
+#ifdef HAVE_SYS_SOCKET_H
+        msghdr message = { 0 };
+        message.msg_iov = parts;
+        message.msg_iovlen = count;
+        ssize_t sent = sendmsg(sock, &message, MSG_NOSIGNAL);
+#else // !HAVE_SYS_SOCKET_H
+        ssize_t sent = send(sock, (const char *) parts->iov_base,
+                            parts->iov_len, MSG_NOSIGNAL);
+#endif // HAVE_SYS_SOCKET_H
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+        {
+            record(remote_error, "Error writing to socket %d: %s (%d)",
+                   sock, strerror(errno), errno);
+            return false;
+        }
+
+        // Skip what was sent, which may end in the middle of a buffer
+        while (count && size_t(sent) >= parts->iov_len)
+        {
+            sent -= parts->iov_len;
+            parts++;
+            count--;
+        }
+        if (count)
+        {
+            parts->iov_base = (char *) parts->iov_base + sent;
+            parts->iov_len -= sent;
+        }
+    }
+    return true;
+}
+
+
+static bool xl_read_all(int sock, char *data, size_t size)
+// ----------------------------------------------------------------------------
+//   Read exactly the given size from the socket
+// ----------------------------------------------------------------------------
+{
+    while (size)
+    {
+        ssize_t got = recv(sock, data, size, 0);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+        {
+            if (got < 0)
+                record(remote_error, "Error reading from socket %d: %s (%d)",
+                       sock, strerror(errno), errno);
+            return false;
+        }
+        data += got;
+        size -= got;
+    }
+    return true;
+}
+
+
+static size_t xl_frame_header(const char *data, uint &kind, uint &id)
+// ----------------------------------------------------------------------------
+//   Decode a frame header, return the size of the tree that follows
+// ----------------------------------------------------------------------------
+{
+    uint32_t header[3];
+    memcpy(header, data, sizeof(header));
+    kind = ntohl(header[0]);
+    id = ntohl(header[1]);
+    return ntohl(header[2]);
+}
+
+
+static Tree *xl_frame_tree(const char *data, size_t size)
+// ----------------------------------------------------------------------------
+//   Decode the tree in a frame, an empty frame being a null tree
+// ----------------------------------------------------------------------------
+{
+    if (!size)
+        return nullptr;
+    return Deserializer::Read(data, size);
+}
+
+
+static bool xl_read_tree(int sock, uint &kind, uint &id, Tree_p &tree)
 // ----------------------------------------------------------------------------
-//   Read a tree directly from the socket
+//   Read a frame from the socket, return false if the connexion was closed
 // ----------------------------------------------------------------------------
 {
-    int fd = dup(sock);         // stdio_filebuf closes its fd in dtor
-    boost::fdistream is(fd);
-    return Deserializer::Read(is);
+    char header[FRAME_HEADER];
+    if (!xl_read_all(sock, header, FRAME_HEADER))
+        return false;
+    size_t size = xl_frame_header(header, kind, id);
+
+    // The buffer is reused, and keeps the size of the largest frame
+    static thread_local text data;
+    data.resize(size);
+    if (size && !xl_read_all(sock, &data[0], size))
+        return false;
+
+    tree = xl_frame_tree(data.data(), size);
+    return true;
 }
 
 
-static void xl_write_tree(int sock, Tree *tree)
+static bool xl_write_tree(int sock, uint kind, uint id, Tree *tree)
 // ----------------------------------------------------------------------------
-//   Write a tree directly into the socket
+//   Write a tree as a single frame into the socket
 // ----------------------------------------------------------------------------
+//   The header and the serialized tree are sent from separate buffers, and
+//   the serializer is reused, so that sending a frame does not allocate.
 {
-    int fd = dup(sock);         // stdio_filebuf closes its fd in dtor
-    boost::fdostream os(fd);
-    Serializer::Write(os, tree);
+    static thread_local Serializer serializer;
+    iovec parts[2];
+    uint count = 1;
+    size_t size = 0;
+    if (tree)
+    {
+        serializer.Reset();
+        tree->Do(serializer);
+        size = serializer.Size();
+        parts[1].iov_base = (void *) serializer.Data();
+        parts[1].iov_len = size;
+        count = 2;
+    }
+
+    uint32_t header[3];
+    header[0] = htonl(kind);
+    header[1] = htonl(id);
+    header[2] = htonl(size);
+    parts[0].iov_base = header;
+    parts[0].iov_len = FRAME_HEADER;
+    return xl_write_all(sock, parts, count);
 }
 
 
 
 // ============================================================================
 //
-//    Clone the symbol tables that go with a tree
+//    Ship the symbol tables that go with a tree
 //
 // ============================================================================
+//
+//   Each scope sent with some code is identified by a hash of its contents
+//   and of the identity of its enclosing scope. A scope is only sent in full
+//   the first time. After that, the identity is enough, since the receiver
+//   keeps the scopes it got on the connexion. When the client assumes that
+//   the host received a scope on another connexion, the host may not have
+//   it, and then answers with a request for the missing scopes, to which the
+//   client responds by sending the same code again with all its scopes.
+//
+//   The attached code takes the form 'Scopes remote_context Code', where
+//   Scopes is nil, the identity of a known scope, or for a new scope,
+//   'Identity (Scopes Declarations)'.
+
+#define REMOTE_CONTEXT  "remote_context"
+
+typedef std::map<ulong, Scope_p>        RemoteScopeMap;
+typedef std::set<ulong>                 RemoteScopeIds;
+typedef std::vector<ulong>              RemoteScopeList;
+
+struct RemoteScopes
+// ----------------------------------------------------------------------------
+//   Scopes exchanged over a connexion
+// ----------------------------------------------------------------------------
+{
+    RemoteScopeIds      known;          // Scopes the peer got from us
+    RemoteScopeMap      received;       // Scopes we got from the peer
+};
+
+// Scopes received on all connexions, for connexions that assume them
+static RemoteScopeMap   remote_scopes;
+
+// Scopes exchanged with the client we reply to
+static RemoteScopes *   reply_scopes = nullptr;
+
 
 struct StopAtGlobalsCloneMode
 // ----------------------------------------------------------------------------
@@ -147,9 +378,25 @@ struct StopAtGlobalsCloneMode
 typedef TreeCloneTemplate<StopAtGlobalsCloneMode> StopAtGlobalsClone;
 
 
-static Tree_p xl_attach_context(Context &context, Tree *code)
+static ulong xl_scope_id(Tree *declarations, ulong parent)
+// ----------------------------------------------------------------------------
+//   Identify a scope by its declarations and its enclosing scope
+// ----------------------------------------------------------------------------
+{
+    static thread_local Serializer serializer;
+    serializer.Reset();
+    declarations->Do(serializer);
+    serializer.WriteUnsigned(parent);
+    return Context::HashText(serializer.Buffer());
+}
+
+
+static Tree_p xl_attach_context(Context &context, Tree *code,
+                                RemoteScopes &scopes,
+                                RemoteScopeIds *assumed,
+                                RemoteScopeList &sent)
 // ----------------------------------------------------------------------------
-//   Attach the scope for the given code
+//   Attach the scopes for the given code, only sending new ones in full
 // ----------------------------------------------------------------------------
 {
     // Find first enclosing scope containing a "module_path"
@@ -158,16 +405,39 @@ static Tree_p xl_attach_context(Context &context, Tree *code)
     Name *module_path = new Name("module_path", code->Position());
     Tree *found = context.Bound(module_path, true, &rewrite, &globals);
 
-    // Do a clone of the symbol table up to that point
+    // Scopes up to that point need to be sent, outermost first
     StopAtGlobalsClone partialClone;
     if (found)
         partialClone.cutpoint = Enclosing(globals);
-    Scope_p symbols = context.Symbols();
-    Tree_p symbolsToSend = partialClone.Clone(symbols);
+    std::vector<Scope *> chain;
+    for (Scope *s = context.Symbols(); s && s != partialClone.cutpoint;
+         s = Enclosing(s))
+        chain.push_back(s);
+
+    ulong id = 0;
+    Tree_p symbolsToSend = xl_nil;
+    for (auto s = chain.rbegin(); s != chain.rend(); s++)
+    {
+        Scope *scope = *s;
+        Tree_p declarations = partialClone.Clone(scope->right);
+        id = xl_scope_id(declarations, id);
+        if (scopes.known.count(id) || (assumed && assumed->count(id)))
+        {
+            symbolsToSend = new Natural(id, scope->Position());
+        }
+        else
+        {
+            Scope *copy = new Scope(symbolsToSend, declarations,
+                                    scope->Position());
+            symbolsToSend = new Prefix(new Natural(id), copy,
+                                       scope->Position());
+            sent.push_back(id);
+        }
+    }
 
     record(remote, "Sending context %t", symbolsToSend.Pointer());
 
-    return new Prefix(symbolsToSend, code, code->Position());
+    return new Infix(REMOTE_CONTEXT, symbolsToSend, code, code->Position());
 }
 
 
@@ -204,14 +474,100 @@ static Tree *xl_restore_nil(Tree *tree)
 }
 
 
-static Tree_p xl_merge_context(Context &context, Tree *code)
+static Scope *xl_received_scope(Tree *symbols, RemoteScopes &scopes,
+                                RemoteScopeIds &missing)
+// ----------------------------------------------------------------------------
+//   Find or record the scopes that were sent, return innermost one
+// ----------------------------------------------------------------------------
+{
+    if (Natural *natural = symbols->AsNatural())
+    {
+        ulong id = natural->value;
+        auto found = scopes.received.find(id);
+        if (found != scopes.received.end())
+            return found->second;
+        found = remote_scopes.find(id);
+        if (found != remote_scopes.end())
+            return scopes.received[id] = found->second;
+        missing.insert(id);
+        return nullptr;
+    }
+
+    Prefix *prefix = symbols->AsPrefix();
+    if (!prefix)
+        return nullptr;
+    Natural *natural = prefix->left->AsNatural();
+    Scope *scope = prefix->right->As<Scope>();
+    if (!natural || !scope)
+        return nullptr;
+
+    Scope *parent = xl_received_scope(scope->left, scopes, missing);
+    if (!missing.empty())
+        return nullptr;
+    scope->left = xl_nil;
+    scope->right = xl_restore_nil(scope->right);
+    Context::RestoreHashes(scope);
+    if (parent)
+        scope->left = parent;
+
+    if (remote_scopes.size() >= (size_t) Opt::remoteScopes)
+        remote_scopes.clear();
+    ulong id = natural->value;
+    scopes.received[id] = scope;
+    remote_scopes[id] = scope;
+    return scope;
+}
+
+
+static Scope *xl_instantiate_scope(Scope *scope, Scope *top)
+// ----------------------------------------------------------------------------
+//   Copy received scopes, so that evaluation does not modify cached ones
+// ----------------------------------------------------------------------------
+{
+    if (!scope)
+        return top;
+    Scope *parent = xl_instantiate_scope(Enclosing(scope), top);
+    StopAtGlobalsClone clone;
+    clone.cutpoint = xl_nil;    // Symbol tables use xl_nil, not any nil
+    Scope *copy = new Scope(parent, clone.Clone(scope->right),
+                            scope->Position());
+    Context::RestoreHashes(copy);
+    return copy;
+}
+
+
+static Tree_p xl_merge_context(Context &context, Tree *code,
+                               RemoteScopes &scopes,
+                               RemoteScopeIds &missing)
 // ----------------------------------------------------------------------------
 //    Merge the code into the current running context
 // ----------------------------------------------------------------------------
 {
     if (code)
     {
-        if (Prefix *prefix = code->AsPrefix())
+        if (Infix *infix = code->AsInfix())
+        {
+            if (infix->name == REMOTE_CONTEXT)
+            {
+                Scope *scope = xl_received_scope(infix->left, scopes, missing);
+                if (!missing.empty())
+                {
+                    record(remote, "Missing %u scopes for %t",
+                           missing.size(), infix->right);
+                    return nullptr;
+                }
+
+                // Reattach the received scopes to the current scope
+                Context_p codeCtx = context.Pointer();
+                if (scope)
+                {
+                    scope = xl_instantiate_scope(scope, context.Symbols());
+                    codeCtx = new Context(scope);
+                }
+                return Interpreter::MakeClosure(codeCtx, infix->right);
+            }
+        }
+        else if (Prefix *prefix = code->AsPrefix())
         {
             Scope *scope = prefix->left->As<Scope>();
             code = prefix->right;
@@ -222,8 +578,12 @@ static Tree_p xl_merge_context(Context &context, Tree *code)
             {
                 scope = xl_restore_nil(scope)->As<Scope>();
                 codeCtx = new Context(scope);
+                Context::RestoreHashes(scope);
                 while (Scope *parent = Enclosing(scope))
+                {
                     scope = parent;
+                    Context::RestoreHashes(scope);
+                }
 
                 // Reattach that end to current scope
                 scope->left = context.Symbols();
@@ -241,21 +601,72 @@ static Tree_p xl_merge_context(Context &context, Tree *code)
 
 // ============================================================================
 //
-//    Simple program exchange over TCP/IP
+//    Connexion pool
 //
 // ============================================================================
+//
+//   Connexions to remote hosts are kept open after a complete request, and
+//   reused by the next request to the same host. Resolved addresses are
+//   also cached, so that a periodic 'ask' costs a single round trip.
+
+struct RemoteConnection
+// ----------------------------------------------------------------------------
+//   A connexion to a remote host, and the scopes exchanged over it
+// ----------------------------------------------------------------------------
+{
+    RemoteConnection(): sock(-1), since(0), reused(false), scopes() {}
+
+    int                 sock;
+    time_t              since;          // When it became idle
+    bool                reused;         // Taken from the pool
+    RemoteScopes        scopes;
+};
+
+
+struct RemoteHost
+// ----------------------------------------------------------------------------
+//   Cached address and idle connexions for a remote host
+// ----------------------------------------------------------------------------
+{
+    RemoteHost(): address(), resolved(0), idle(), known(), multiplexed() {}
+
+    sockaddr_in                         address;
+    time_t                              resolved;
+    std::vector<RemoteConnection>       idle;
+    RemoteScopeIds                      known; // Sent on any connexion
+    RemoteConnection                    multiplexed; // Pipelined requests
+
+    enum { MAX_IDLE = 4 };
+};
+typedef std::map<text, RemoteHost> RemoteHosts;
 
-static int xl_send(Context &context, text host, Tree *code)
+static RemoteHosts remote_hosts;
+static std::mutex  remote_hosts_lock;
+
+
+static bool xl_resolve(text host, sockaddr_in &address)
 // ----------------------------------------------------------------------------
-//   Send the text for the given body to the target host, return open fd
+//   Find the address and port for a host, using cached results if possible
 // ----------------------------------------------------------------------------
 {
+    time_t now = time(nullptr);
+    {
+        std::lock_guard<std::mutex> lock(remote_hosts_lock);
+        RemoteHost &cached = remote_hosts[host];
+        if (cached.resolved && now - cached.resolved < Opt::remoteResolve)
+        {
+            address = cached.address;
+            return true;
+        }
+    }
+
     // Compute port number
+    text name = host;
     int port = XL_DEFAULT_PORT;
-    size_t found = host.rfind(':');
+    size_t found = name.rfind(':');
     if (found != std::string::npos)
     {
-        text portText= host.substr(found+1);
+        text portText= name.substr(found+1);
         port = atoi(portText.c_str());
         if (!port)
         {
@@ -263,50 +674,182 @@ static int xl_send(Context &context, text host, Tree *code)
                    portText.c_str(), XL_DEFAULT_PORT);
             port = XL_DEFAULT_PORT;
         }
-        host = host.substr(0, found);
-    }
-
-    // Open socket
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0)
-    {
-        record(remote_error, "Error opening socket: %s (%d)",
-               strerror(errno), errno);
-        return -1;
+        name = name.substr(0, found);
     }
 
     // Resolve server name
-    struct hostent *server = gethostbyname(host.c_str());
+    struct hostent *server = gethostbyname(name.c_str());
     if (!server)
     {
         record(remote_error, "Error resolving server %s: %s (%d)",
-               host.c_str(), strerror(errno), errno);
-        return -1;
+               name.c_str(), strerror(errno), errno);
+        return false;
     }
 
-    // Initialize socket
-    sockaddr_in address = { 0 };
+    // Initialize address
+    address = sockaddr_in();
     address.sin_family = AF_INET;
     memcpy((char *) &address.sin_addr.s_addr,
            (char *) server->h_addr,
            server->h_length);
     address.sin_port = htons(port);
 
+    std::lock_guard<std::mutex> lock(remote_hosts_lock);
+    RemoteHost &cached = remote_hosts[host];
+    cached.address = address;
+    cached.resolved = now;
+    record(remote, "Resolved %s as %s port %d",
+           host.c_str(), inet_ntoa(address.sin_addr), port);
+    return true;
+}
+
+
+static bool xl_idle_alive(int sock)
+// ----------------------------------------------------------------------------
+//   Check that an idle connexion was not closed by the other end
+// ----------------------------------------------------------------------------
+{
+    char byte;
+    ssize_t got = recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+
+static bool xl_connect(text host, RemoteConnection &connexion)
+// ----------------------------------------------------------------------------
+//   Take an idle connexion to the host, or open a new one
+// ----------------------------------------------------------------------------
+{
+    // Idle connexions are not reused near the end of the server timeout
+    time_t now = time(nullptr);
+    {
+        std::lock_guard<std::mutex> lock(remote_hosts_lock);
+        std::vector<RemoteConnection> &idle = remote_hosts[host].idle;
+        while (!idle.empty())
+        {
+            connexion = std::move(idle.back());
+            idle.pop_back();
+            if (2 * (now - connexion.since) < Opt::remoteKeepAlive &&
+                xl_idle_alive(connexion.sock))
+            {
+                record(remote, "Reusing socket %d for %s",
+                       connexion.sock, host.c_str());
+                connexion.reused = true;
+                return true;
+            }
+            close(connexion.sock);
+        }
+    }
+    connexion = RemoteConnection();
+
+    sockaddr_in address;
+    if (!xl_resolve(host, address))
+        return false;
+
+    // Open socket
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        record(remote_error, "Error opening socket: %s (%d)",
+               strerror(errno), errno);
+        return false;
+    }
+
     // Connect
     if (connect(sock, (struct sockaddr *) &address, sizeof(address)) < 0)
     {
-        record(remote_error, "Error connecting to %s port %d: %s (%d)",
-               host.c_str(), port, strerror(errno), errno);
-        return -1;
+        record(remote_error, "Error connecting to %s: %s (%d)",
+               host.c_str(), strerror(errno), errno);
+        close(sock);
+        return false;
     }
 
-    // Attach the running context, i.e. all symbols we might need
-    code = xl_attach_context(context, code);
+    // Requests are small, do not delay them, and detect dead peers
+    int option = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+               (char *) &option, sizeof(option));
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE,
+               (char *) &option, sizeof(option));
+    record(remote, "Connected socket %d to %s", sock, host.c_str());
+    connexion.sock = sock;
+    return true;
+}
+
+
+static void xl_release(text host, RemoteConnection &connexion)
+// ----------------------------------------------------------------------------
+//   Return a connexion with no pending message to the pool
+// ----------------------------------------------------------------------------
+{
+    if (Opt::remoteKeepAlive)
+    {
+        std::lock_guard<std::mutex> lock(remote_hosts_lock);
+        std::vector<RemoteConnection> &idle = remote_hosts[host].idle;
+        if (idle.size() < RemoteHost::MAX_IDLE)
+        {
+            connexion.since = time(nullptr);
+            idle.push_back(std::move(connexion));
+            return;
+        }
+    }
+    close(connexion.sock);
+}
+
+
+static void xl_close(RemoteConnection &connexion)
+// ----------------------------------------------------------------------------
+//   Close a connexion that may have pending messages
+// ----------------------------------------------------------------------------
+{
+    close(connexion.sock);
+    connexion.sock = -1;
+}
+
+
+
+// ============================================================================
+//
+//    Simple program exchange over TCP/IP
+//
+// ============================================================================
+
+static bool xl_send(Context &context, text host, Tree *code, uint kind,
+                    RemoteConnection &connexion, bool assume, uint id = 0)
+// ----------------------------------------------------------------------------
+//   Send the text for the given body to the target host
+// ----------------------------------------------------------------------------
+//   If assume is set, scopes sent to the host on other connexions are
+//   not sent again, and the host may ask for them if it does not have them.
+{
+    for (uint attempt = 0; attempt < 2; attempt++)
+    {
+        if (connexion.sock < 0 && !xl_connect(host, connexion))
+            return false;
 
-    // Write program to socket
-    xl_write_tree(sock, code);
+        // Attach the running context, i.e. all symbols we might need
+        RemoteScopeIds assumed;
+        if (assume)
+        {
+            std::lock_guard<std::mutex> lock(remote_hosts_lock);
+            assumed = remote_hosts[host].known;
+        }
+        RemoteScopeList sent;
+        Tree_p message = xl_attach_context(context, code, connexion.scopes,
+                                           assume ? &assumed : nullptr, sent);
 
-    return sock;
+        // Write program to socket, retry once if an idle connexion was closed
+        if (xl_write_tree(connexion.sock, kind, id, message))
+        {
+            connexion.scopes.known.insert(sent.begin(), sent.end());
+            std::lock_guard<std::mutex> lock(remote_hosts_lock);
+            remote_hosts[host].known.insert(sent.begin(), sent.end());
+            return true;
+        }
+        xl_close(connexion);
+        if (!connexion.reused)
+            break;
+    }
+    return false;
 }
 
 
@@ -317,14 +860,79 @@ int xl_tell(Scope *scope, text host, Tree *code)
 {
     Context context(scope);
     record(remote_tell, "Telling %s: %t", host.c_str(), code);
-    int sock = xl_send(context, host, code);
-    if (sock < 0)
-        return sock;
-    close(sock);
+    RemoteConnection connexion;
+    if (!xl_send(context, host, code, frameTELL, connexion, false))
+        return -1;
+    xl_release(host, connexion);
     return 0;
 }
 
 
+static void xl_forget_scopes(text host, RemoteConnection &connexion)
+// ----------------------------------------------------------------------------
+//   Stop assuming a host has any of our scopes after it missed some
+// ----------------------------------------------------------------------------
+//   Scopes sent in full along with a missing one were not kept by the host
+//   either, so they are all sent again with the next request.
+{
+    record(remote, "Host %s misses scopes, sending them", host.c_str());
+    connexion.scopes.known.clear();
+    std::lock_guard<std::mutex> lock(remote_hosts_lock);
+    remote_hosts[host].known.clear();
+}
+
+
+static bool xl_request(Context &context, text host, Tree *code,
+                       RemoteConnection &connexion,
+                       uint &kind, Tree_p &response)
+// ----------------------------------------------------------------------------
+//   Send code expecting a response, return the first response
+// ----------------------------------------------------------------------------
+//   If a reused connexion is closed before any response, the server may
+//   have timed it out before reading the request, so it is sent again.
+//   It is also sent again with all its scopes if the server misses some.
+{
+    bool assume = true;
+    for (uint attempt = 0; attempt < 3; attempt++)
+    {
+        uint id = 0;
+        if (!xl_send(context, host, code, frameASK, connexion, assume))
+            return false;
+        if (!xl_read_tree(connexion.sock, kind, id, response))
+        {
+            xl_close(connexion);
+            if (!connexion.reused)
+                return false;
+            record(remote, "Connexion to %s closed, retrying", host.c_str());
+            continue;
+        }
+        if (kind != frameMISSING)
+            return true;
+
+        xl_forget_scopes(host, connexion);
+        assume = false;
+    }
+    xl_close(connexion);
+    return false;
+}
+
+
+static Tree_p xl_response(Context &context, text host, Tree *response,
+                          RemoteConnection &connexion)
+// ----------------------------------------------------------------------------
+//   Merge a response in the current context
+// ----------------------------------------------------------------------------
+{
+    RemoteScopeIds missing;
+    Tree_p result = xl_merge_context(context, response,
+                                     connexion.scopes, missing);
+    if (!missing.empty())
+        record(remote_error, "Response from %s misses %u scopes",
+               host.c_str(), missing.size());
+    return result;
+}
+
+
 Tree_p xl_ask(Scope *scope, text host, Tree *code)
 // ----------------------------------------------------------------------------
 //   Send code to the target, wait for reply
@@ -332,15 +940,20 @@ Tree_p xl_ask(Scope *scope, text host, Tree *code)
 {
     Context context(scope);
     record(remote_ask, "Asking %s: %t", host.c_str(), code);
-    int sock = xl_send(context, host, code);
-    if (sock < 0)
+    uint kind = frameDONE;
+    Tree_p result = nullptr;
+    RemoteConnection connexion;
+    if (!xl_request(context, host, code, connexion, kind, result))
         return xl_nil;
 
-    Tree_p result = xl_read_tree(sock);
-    result = xl_merge_context(context, result);
+    result = xl_response(context, host, result, connexion);
     record(remote_ask, "Response from %s was %t", host.c_str(), result);
 
-    close(sock);
+    // Only keep the connexion if the remote is done with the request
+    if (kind == frameDONE)
+        xl_release(host, connexion);
+    else
+        xl_close(connexion);
 
     return result;
 }
@@ -353,38 +966,396 @@ Tree_p xl_invoke(Scope *scope, text host, Tree *code)
 {
     Context context(scope);
     record(remote_invoke, "Invoking %s: %t", host.c_str(), code);
-    int sock = xl_send(context, host, code);
-    if (sock < 0)
+    uint kind = frameDONE;
+    Tree_p response = nullptr;
+    RemoteConnection connexion;
+    if (!xl_request(context, host, code, connexion, kind, response))
         return xl_nil;
 
     Tree_p result = xl_nil;
     while (true)
     {
-        Tree_p response = xl_read_tree(sock);
         if (response == nullptr)
             break;
 
         record(remote_invoke, "Response from %s was %t",
                host.c_str(), response);
-        response = xl_merge_context(context, response);
+        response = xl_response(context, host, response, connexion);
         record(remote_invoke, "After merge, response was %t", response);
         result = xl_evaluate(context.Symbols(), response);
         record(remote_invoke, "After eval, was %t", result);
-        if (result == xl_nil)
+        if (result == xl_nil || kind == frameDONE)
             break;
+        uint id = 0;
+        if (!xl_read_tree(connexion.sock, kind, id, response))
+        {
+            xl_close(connexion);
+            return result;
+        }
     }
-    close(sock);
+
+    // Only keep the connexion if the remote is done with the request
+    if (kind == frameDONE)
+        xl_release(host, connexion);
+    else
+        xl_close(connexion);
 
     return result;
 }
 
 
-
 // ============================================================================
 //
-//   Listening side
+//    Pipelined requests
 //
 // ============================================================================
+//
+//   Asynchronous requests to a host are all sent on a single connexion,
+//   without waiting for the responses to previous ones. Each request is
+//   identified by a number, which the host repeats in its responses, and
+//   which is returned to the program as a handle to wait for the result.
+//   The host evaluates requests from a connexion in the order they arrive,
+//   so a batch sent to many hosts costs about the time of the slowest one.
+//   Results that are never awaited are dropped beyond -remote_pending.
+
+struct RemotePending
+// ----------------------------------------------------------------------------
+//   A request sent to a host for which we did not get the result yet
+// ----------------------------------------------------------------------------
+{
+    text                host;
+    Scope_p             scope;          // Where the request was made
+    Tree_p              code;           // For sending it again
+    Tree_p              result;
+    bool                replied;        // Got a first reply
+    bool                done;           // Host is done with it
+    uint                attempts;
+};
+typedef std::map<uint, RemotePending> RemotePendingMap;
+
+static RemotePendingMap remote_pending;
+static uint             remote_request_id = 0;
+
+
+static RemoteConnection &xl_multiplexed(text host)
+// ----------------------------------------------------------------------------
+//   Return the connexion used for pipelined requests to a host
+// ----------------------------------------------------------------------------
+{
+    std::lock_guard<std::mutex> lock(remote_hosts_lock);
+    return remote_hosts[host].multiplexed;
+}
+
+
+static bool xl_send_pending(uint id, RemotePending &pending, bool assume)
+// ----------------------------------------------------------------------------
+//   Send a pending request on the multiplexed connexion, fail it if we can't
+// ----------------------------------------------------------------------------
+{
+    RemoteConnection &connexion = xl_multiplexed(pending.host);
+    Context context(pending.scope);
+    pending.attempts++;
+
+    // The host may have closed the connexion if it was idle for too long
+    if (connexion.sock >= 0)
+    {
+        bool idle = true;
+        for (auto &other : remote_pending)
+            if (other.first != id && other.second.host == pending.host &&
+                !other.second.done)
+                idle = false;
+        if (idle && !xl_idle_alive(connexion.sock))
+            xl_close(connexion);
+    }
+
+    if (xl_send(context, pending.host, pending.code, frameASK,
+                connexion, assume, id))
+        return true;
+
+    record(remote_error, "Unable to send request %u to %s",
+           id, pending.host.c_str());
+    pending.result = xl_nil;
+    pending.done = true;
+    return false;
+}
+
+
+static void xl_resend_pending(text host)
+// ----------------------------------------------------------------------------
+//   Send unanswered requests again after the connexion to a host was closed
+// ----------------------------------------------------------------------------
+//   A host may close a connexion with requests it did not read, e.g. when
+//   it does not keep connexions alive. Requests that got a partial response
+//   are not sent again, since the host was evaluating them.
+{
+    for (auto &entry : remote_pending)
+    {
+        RemotePending &pending = entry.second;
+        if (pending.host != host || pending.done)
+            continue;
+        if (pending.replied || pending.attempts >= 3)
+        {
+            record(remote_error, "Connexion to %s closed during request %u",
+                   host.c_str(), entry.first);
+            if (!pending.replied)
+                pending.result = xl_nil;
+            pending.done = true;
+            continue;
+        }
+        record(remote, "Connexion to %s closed, resending request %u",
+               host.c_str(), entry.first);
+        xl_send_pending(entry.first, pending, true);
+    }
+}
+
+
+static void xl_receive(text host)
+// ----------------------------------------------------------------------------
+//   Read one response from a host, and dispatch it to its request
+// ----------------------------------------------------------------------------
+{
+    RemoteConnection &connexion = xl_multiplexed(host);
+    uint kind = frameDONE;
+    uint id = 0;
+    Tree_p response = nullptr;
+    if (connexion.sock < 0 ||
+        !xl_read_tree(connexion.sock, kind, id, response))
+    {
+        xl_close(connexion);
+        xl_resend_pending(host);
+        return;
+    }
+
+    auto found = remote_pending.find(id);
+    if (found == remote_pending.end() || found->second.host != host)
+    {
+        record(remote_error, "Unexpected response %u from %s",
+               id, host.c_str());
+        return;
+    }
+    RemotePending &pending = found->second;
+
+    // Send the request again with all its scopes if the host misses some
+    if (kind == frameMISSING)
+    {
+        xl_forget_scopes(host, connexion);
+        xl_send_pending(id, pending, false);
+        return;
+    }
+
+    // The first reply is the result, otherwise the one sent when done
+    if (!pending.replied && (response || kind == frameDONE))
+    {
+        Context context(pending.scope);
+        pending.result = response
+            ? xl_response(context, host, response, connexion)
+            : Tree_p(xl_nil);
+        pending.replied = true;
+        record(remote_ask, "Response %u from %s was %t",
+               id, host.c_str(), pending.result);
+    }
+    if (kind == frameDONE)
+        pending.done = true;
+}
+
+
+uint xl_ask_async(Scope *scope, text host, Tree *code)
+// ----------------------------------------------------------------------------
+//   Send code to the target, return a request to wait for with 'await'
+// ----------------------------------------------------------------------------
+{
+    uint id = ++remote_request_id;
+    if (!id)
+        id = ++remote_request_id;
+    record(remote_ask, "Asking %s as request %u: %t", host.c_str(), id, code);
+
+    // Drop results the program never waited for, the oldest complete first
+    while (remote_pending.size() >= (size_t) Opt::remotePending)
+    {
+        auto dropped = remote_pending.begin();
+        for (auto i = dropped; i != remote_pending.end(); i++)
+        {
+            if (i->second.done)
+            {
+                dropped = i;
+                break;
+            }
+        }
+        while (!dropped->second.done)
+            xl_receive(dropped->second.host);
+        record(remote_error, "Dropping result of request %u to %s, "
+               "never awaited", dropped->first, dropped->second.host.c_str());
+        remote_pending.erase(dropped);
+    }
+
+    RemotePending &pending = remote_pending[id];
+    pending = RemotePending { host, scope, code, nullptr, false, false, 0 };
+    xl_send_pending(id, pending, true);
+    return id;
+}
+
+
+Tree_p xl_await(Scope *scope, uint id)
+// ----------------------------------------------------------------------------
+//   Wait for the result of a request sent with 'ask_async'
+// ----------------------------------------------------------------------------
+{
+    auto found = remote_pending.find(id);
+    if (found == remote_pending.end())
+    {
+        record(remote_error, "Awaiting unknown request %u", id);
+        return xl_nil;
+    }
+
+    // Responses to other requests on the same connexion may come first
+    text host = found->second.host;
+    while (!remote_pending[id].done)
+        xl_receive(host);
+
+    Tree_p result = remote_pending[id].result;
+    remote_pending.erase(id);
+    if (!result)
+        result = xl_nil;
+    return result;
+}
+
+
+static void xl_await_list(Scope *scope, Tree *requests, Tree_p *&parent)
+// ----------------------------------------------------------------------------
+//   Append the results of all requests in the list
+// ----------------------------------------------------------------------------
+{
+    if (Block *block = requests->AsBlock())
+    {
+        xl_await_list(scope, block->child, parent);
+        return;
+    }
+    if (Infix *infix = requests->AsInfix())
+    {
+        if (IsCommaList(infix))
+        {
+            xl_await_list(scope, infix->left, parent);
+            xl_await_list(scope, infix->right, parent);
+            return;
+        }
+    }
+
+    requests = xl_evaluate(scope, requests);
+    if (requests == xl_nil)
+        return;
+    Natural *request = requests->AsNatural();
+    if (!request)
+    {
+        Ooops("Malformed request $1", requests);
+        return;
+    }
+
+    Tree_p result = xl_await(scope, request->value);
+    if (*parent)
+    {
+        Infix *added = new Infix(",", *parent, result);
+        *parent = added;
+        parent = &added->right;
+    }
+    else
+    {
+        *parent = result;
+    }
+}
+
+
+Tree_p xl_await_all(Scope *scope, Tree *requests)
+// ----------------------------------------------------------------------------
+//   Wait for the results of a list of requests
+// ----------------------------------------------------------------------------
+{
+    Tree_p result = nullptr;
+    Tree_p *parent = &result;
+    xl_await_list(scope, requests, parent);
+    if (!result)
+        result = xl_nil;
+    return result;
+}
+
+
+static void xl_ask_list(Scope *scope, Tree *hosts, Tree *code,
+                        std::vector<uint> &requests)
+// ----------------------------------------------------------------------------
+//   Send the code to all hosts in the list
+// ----------------------------------------------------------------------------
+{
+    if (Block *block = hosts->AsBlock())
+    {
+        xl_ask_list(scope, block->child, code, requests);
+        return;
+    }
+    if (Infix *infix = hosts->AsInfix())
+    {
+        if (IsCommaList(infix))
+        {
+            xl_ask_list(scope, infix->left, code, requests);
+            xl_ask_list(scope, infix->right, code, requests);
+            return;
+        }
+    }
+
+    hosts = xl_evaluate(scope, hosts);
+    if (hosts == xl_nil)
+        return;
+    Text *host = hosts->AsText();
+    if (!host)
+    {
+        Ooops("Malformed host name $1", hosts);
+        return;
+    }
+    requests.push_back(xl_ask_async(scope, host->value, code));
+}
+
+
+Tree_p xl_ask_all(Scope *scope, Tree *hosts, Tree *code)
+// ----------------------------------------------------------------------------
+//   Send code to all hosts, then collect their results in the same order
+// ----------------------------------------------------------------------------
+{
+    std::vector<uint> requests;
+    xl_ask_list(scope, hosts, code, requests);
+
+    Tree_p result = nullptr;
+    Tree_p *parent = &result;
+    for (uint id : requests)
+    {
+        Tree_p response = xl_await(scope, id);
+        if (*parent)
+        {
+            Infix *added = new Infix(",", *parent, response);
+            *parent = added;
+            parent = &added->right;
+        }
+        else
+        {
+            *parent = response;
+        }
+    }
+    if (!result)
+        result = xl_nil;
+    return result;
+}
+
+
+
+
+// ============================================================================
+//
+//   Listening side
+//
+// ============================================================================
+//
+//   Evaluation is not thread-safe, so requests are evaluated one at a time
+//   by each listening process. A listening process waits for events on the
+//   listening socket and on all its client connexions, reads complete
+//   frames into a queue, and evaluates them in the order they arrived.
+//   When forking, a fixed pool of such processes share the listening
+//   socket, and are only replaced if they die.
 
 #ifndef HAVE_SYS_SOCKET_H
 #define waitpid(a,b,c)        0
@@ -393,6 +1364,8 @@ Tree_p xl_invoke(Scope *scope, text host, Tree *code)
 #define WNOHANG               0
 #define SIGCHLD               0
 #define fork()                0
+#define kill(pid, signal)     0
+#define fcntl(fd, cmd, ...)   0
 typedef int socklen_t;
 #endif // HAVE_SYS_SOCKET_H
 
@@ -422,18 +1395,6 @@ static int child_wait(int flag)
 }
 
 
-static void child_died(int)
-// ----------------------------------------------------------------------------
-//    When a child dies, get its exit status
-// ----------------------------------------------------------------------------
-{
-    record(remote, "Child died, waiting");
-    while (child_wait(WNOHANG) > 0)
-        /* Loop */;
-    record(remote, "Child died, end of wait");
-}
-
-
 
 Tree_p  xl_listen_received()
 // ----------------------------------------------------------------------------
@@ -456,10 +1417,424 @@ Tree_p xl_listen_hook(Tree *newHook)
 }
 
 
+struct RemoteEvents
+// ----------------------------------------------------------------------------
+//   The set of sockets a listening process waits on
+// ----------------------------------------------------------------------------
+{
+    RemoteEvents();
+    ~RemoteEvents();
+
+    void        Add(int sock, bool shared = false);
+    void        Remove(int sock);
+    int         Wait(std::vector<int> &ready, int timeout);
+
+private:
+#ifdef HAVE_SYS_EPOLL_H
+    int                 epoll;
+#else // !HAVE_SYS_EPOLL_H
+    std::vector<pollfd> fds;
+#endif // HAVE_SYS_EPOLL_H
+};
+
+
+#ifdef HAVE_SYS_EPOLL_H
+RemoteEvents::RemoteEvents()
+// ----------------------------------------------------------------------------
+//   Create the epoll descriptor
+// ----------------------------------------------------------------------------
+    : epoll(epoll_create1(EPOLL_CLOEXEC))
+{
+    if (epoll < 0)
+        record(remote_error, "Error creating epoll: %s (%d)",
+               strerror(errno), errno);
+}
+
+
+RemoteEvents::~RemoteEvents()
+// ----------------------------------------------------------------------------
+//   Close the epoll descriptor
+// ----------------------------------------------------------------------------
+{
+    if (epoll >= 0)
+        close(epoll);
+}
+
+
+void RemoteEvents::Add(int sock, bool shared)
+// ----------------------------------------------------------------------------
+//   Wait for input on the socket
+// ----------------------------------------------------------------------------
+//   A socket shared between processes only wakes one of them up
+{
+    epoll_event event = epoll_event();
+    event.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+    if (shared)
+        event.events |= EPOLLEXCLUSIVE;
+#endif // EPOLLEXCLUSIVE
+    event.data.fd = sock;
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, sock, &event) < 0)
+        record(remote_error, "Error adding socket %d to epoll: %s (%d)",
+               sock, strerror(errno), errno);
+}
+
+
+void RemoteEvents::Remove(int sock)
+// ----------------------------------------------------------------------------
+//   Stop waiting on the socket
+// ----------------------------------------------------------------------------
+{
+    epoll_ctl(epoll, EPOLL_CTL_DEL, sock, nullptr);
+}
+
+
+int RemoteEvents::Wait(std::vector<int> &ready, int timeout)
+// ----------------------------------------------------------------------------
+//   Wait for sockets to be ready, at most timeout ms
+// ----------------------------------------------------------------------------
+{
+    epoll_event events[64];
+    int count = epoll_wait(epoll, events, 64, timeout);
+    for (int i = 0; i < count; i++)
+        ready.push_back(events[i].data.fd);
+    return count;
+}
+
+#else // !HAVE_SYS_EPOLL_H
+RemoteEvents::RemoteEvents() : fds() {}
+RemoteEvents::~RemoteEvents() {}
+
+
+void RemoteEvents::Add(int sock, bool)
+// ----------------------------------------------------------------------------
+//   Wait for input on the socket
+// ----------------------------------------------------------------------------
+{
+    fds.push_back(pollfd { sock, POLLIN, 0 });
+}
+
+
+void RemoteEvents::Remove(int sock)
+// ----------------------------------------------------------------------------
+//   Stop waiting on the socket
+// ----------------------------------------------------------------------------
+{
+    for (auto fd = fds.begin(); fd != fds.end(); fd++)
+    {
+        if (fd->fd == sock)
+        {
+            fds.erase(fd);
+            break;
+        }
+    }
+}
+
+
+int RemoteEvents::Wait(std::vector<int> &ready, int timeout)
+// ----------------------------------------------------------------------------
+//   Wait for sockets to be ready, at most timeout ms
+// ----------------------------------------------------------------------------
+{
+    int count = poll(fds.data(), fds.size(), timeout);
+    for (size_t i = 0; count > 0 && i < fds.size(); i++)
+        if (fds[i].revents)
+            ready.push_back(fds[i].fd);
+    return count;
+}
+#endif // HAVE_SYS_EPOLL_H
+
+
+struct RemoteServer
+// ----------------------------------------------------------------------------
+//   Clients and queued requests of a listening process
+// ----------------------------------------------------------------------------
+{
+    typedef std::chrono::steady_clock clock;
+
+    RemoteServer(Context &context, int listener)
+        : context(context), listener(listener),
+          events(), clients(), queue() {}
+    ~RemoteServer();
+
+    struct Client
+    {
+        text            input;  // Bytes received, not yet a complete frame
+        time_t          active; // Last time we got data or replied
+        uint            queued; // Requests waiting in the queue
+        RemoteScopes    scopes; // Scopes exchanged with that client
+    };
+
+    struct Request
+    {
+        int             sock;
+        uint            kind;
+        uint            id;
+        Tree_p          code;
+        clock::time_point arrival;
+    };
+
+    void                Run();
+    void                Accept();
+    void                Receive(int sock);
+    void                Evaluate(Request &request);
+    void                Drop(int sock);
+    void                Expire();
+
+    Context &           context;
+    int                 listener;
+    RemoteEvents        events;
+    std::map<int, Client> clients;
+    std::deque<Request> queue;
+};
+
+
+RemoteServer::~RemoteServer()
+// ----------------------------------------------------------------------------
+//   Close remaining client connexions
+// ----------------------------------------------------------------------------
+{
+    for (auto &client : clients)
+        close(client.first);
+}
+
+
+void RemoteServer::Run()
+// ----------------------------------------------------------------------------
+//   Accept connexions and serve requests until told to stop
+// ----------------------------------------------------------------------------
+{
+    events.Add(listener, true);
+
+    std::vector<int> ready;
+    while (listening)
+    {
+        // Only look for more requests if the queue is not full
+        if (queue.size() < (size_t) Opt::remoteQueue)
+        {
+            int timeout = queue.empty() ? 1000 : 0;
+            ready.clear();
+            int count = events.Wait(ready, timeout);
+            if (count < 0 && errno != EINTR)
+            {
+                record(remote_error, "Error waiting for requests: %s (%d)",
+                       strerror(errno), errno);
+                break;
+            }
+            for (int sock : ready)
+            {
+                if (sock == listener)
+                    Accept();
+                else
+                    Receive(sock);
+            }
+        }
+
+        // Evaluate the oldest request
+        if (!queue.empty())
+        {
+            Request request = queue.front();
+            queue.pop_front();
+            Evaluate(request);
+        }
+        Expire();
+    }
+}
+
+
+void RemoteServer::Accept()
+// ----------------------------------------------------------------------------
+//   Accept pending connexions
+// ----------------------------------------------------------------------------
+//   The listening socket is non-blocking, since other processes may have
+//   accepted the connexion first.
+{
+    while (true)
+    {
+        sockaddr_in client = { 0 };
+        socklen_t length = sizeof(client);
+        int sock = accept(listener, (struct sockaddr *) &client, &length);
+        if (sock < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                record(remote_error, "Error accepting connexion: %s (%d)",
+                       strerror(errno), errno);
+            return;
+        }
+
+        int option = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+                   (char *) &option, sizeof(option));
+        clients[sock] = Client { text(), time(nullptr), 0 };
+        events.Add(sock);
+        record(remote_listen, "Got incoming connexion %d from %s",
+               sock, inet_ntoa(client.sin_addr));
+    }
+}
+
+
+void RemoteServer::Receive(int sock)
+// ----------------------------------------------------------------------------
+//   Read available data from a client, and queue complete requests
+// ----------------------------------------------------------------------------
+{
+    auto found = clients.find(sock);
+    if (found == clients.end())
+        return;
+    Client &client = found->second;
+
+    char buffer[4096];
+    ssize_t got = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (got <= 0)
+    {
+        Drop(sock);
+        return;
+    }
+    client.input.append(buffer, got);
+    client.active = time(nullptr);
+
+    // Queue all complete frames
+    clock::time_point now = clock::now();
+    size_t done = 0;
+    size_t available = client.input.size();
+    while (available - done >= FRAME_HEADER)
+    {
+        uint kind = frameTELL;
+        uint id = 0;
+        size_t size = xl_frame_header(client.input.data() + done, kind, id);
+        if (available - done - FRAME_HEADER < size)
+            break;
+        const char *data = client.input.data() + done + FRAME_HEADER;
+        done += FRAME_HEADER + size;
+        queue.push_back(Request { sock, kind, id,
+                                  xl_frame_tree(data, size), now });
+        client.queued++;
+    }
+    client.input.erase(0, done);
+}
+
+
+void RemoteServer::Evaluate(Request &request)
+// ----------------------------------------------------------------------------
+//   Evaluate a request and send the result if the client expects one
+// ----------------------------------------------------------------------------
+{
+    int sock = request.sock;
+    auto found = clients.find(sock);
+    if (found == clients.end())
+        return;
+    Client &client = found->second;
+    client.queued--;
+
+    clock::time_point start = clock::now();
+    ulong delay = std::chrono::duration_cast<std::chrono::microseconds>
+        (start - request.arrival).count();
+    record(remote_queue, "Request from %d waited %luus, %u queued",
+           sock, delay, queue.size());
+
+    // Pick up changes to the source files before evaluating
+    if (Opt::reload && MAIN->Reload())
+        record(remote_listen, "Reloaded modified source files");
+
+    Tree_p code = request.code;
+    Tree_p result = nullptr;
+    Tree_p hookResult = xl_true;
+    if (code)
+    {
+        Scope *scope = context.Symbols();
+        record(remote_listen, "Received code: %t", code);
+        received = code;
+
+        // Ask the client for scopes it assumed we had
+        RemoteScopeIds missing;
+        Tree_p merged = xl_merge_context(context, code, client.scopes, missing);
+        if (!missing.empty())
+        {
+            if (request.kind != frameASK)
+                record(remote_error, "Missing %u scopes from %d",
+                       missing.size(), sock);
+            else if (!xl_write_tree(sock, frameMISSING, request.id, nullptr))
+                Drop(sock);
+            return;
+        }
+
+        hookResult = xl_evaluate(scope, hook);
+        if (hookResult != xl_nil)
+        {
+            Save<int> saveReply(reply_socket,
+                                request.kind == frameASK ? sock : 0);
+            Save<uint> saveId(reply_id, request.id);
+            Save<RemoteScopes *> saveScopes(reply_scopes, &client.scopes);
+            result = xl_evaluate(scope, merged);
+            record(remote_listen, "Evaluated as %t", result);
+        }
+    }
+    if (hookResult == xl_false || hookResult == xl_nil)
+        listening = false;
+
+    // Send the result, which also tells the client we are done
+    if (request.kind == frameASK)
+    {
+        if (!xl_write_tree(sock, frameDONE, request.id, result))
+        {
+            Drop(sock);
+            return;
+        }
+        record(remote_listen, "Response sent");
+    }
+    client.active = time(nullptr);
+    if (!Opt::remoteKeepAlive && !client.queued)
+    {
+        // Serve requests the client already sent before closing
+        Receive(sock);
+        found = clients.find(sock);
+        if (found != clients.end() && !found->second.queued)
+            Drop(sock);
+    }
+}
+
+
+void RemoteServer::Drop(int sock)
+// ----------------------------------------------------------------------------
+//   Close a client connexion, and forget its pending requests
+// ----------------------------------------------------------------------------
+//   The socket number may be reused by the next accepted connexion, so
+//   requests from this client must not be answered on it.
+{
+    record(remote_listen, "Closing connexion %d", sock);
+    for (auto r = queue.begin(); r != queue.end(); )
+        r = r->sock == sock ? queue.erase(r) : r + 1;
+    events.Remove(sock);
+    clients.erase(sock);
+    close(sock);
+}
+
+
+void RemoteServer::Expire()
+// ----------------------------------------------------------------------------
+//   Close connexions that remained idle for too long
+// ----------------------------------------------------------------------------
+{
+    if (!Opt::remoteKeepAlive)
+        return;
+    time_t now = time(nullptr);
+    std::vector<int> expired;
+    for (auto &client : clients)
+        if (!client.second.queued &&
+            now - client.second.active > (time_t) Opt::remoteKeepAlive)
+            expired.push_back(client.first);
+    for (int sock : expired)
+        Drop(sock);
+}
+
+
 int xl_listen(Scope *scope, uint forking, uint port)
 // ----------------------------------------------------------------------------
 //    Listen on the given port for sockets, evaluate programs when received
 // ----------------------------------------------------------------------------
+//    When forking, the argument is the number of listening processes
 {
     // Open the socket
     Context context(scope);
@@ -485,88 +1860,62 @@ int xl_listen(Scope *scope, uint forking, uint port)
     {
         record(remote_error, "Error binding to port %d: %s (%d)",
                port, strerror(errno), errno);
+        close(sock);
         return -1;
     }
 
-    // Listen to socket
-    listen(sock, 5);
+    // Listen to socket, several processes may accept from it
+    listen(sock, Opt::remoteBacklog);
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
 
-    // Make sure we get notified when a child dies
-    signal(SIGCHLD, child_died);
-
-    // Accept client
     listening = true;
-    while (listening)
+    if (!forking)
     {
-        // Block until we can accept more connexions (avoid fork bombs)
-        while (forking && active_children >= forking)
-        {
-            record(remote, "xl_listen: Too many children, waiting");
-            int childPID = child_wait(0);
-            if (childPID > 0)
-                record(remote, "xl_listen: Child %d died, resuming", childPID);
-        }
-
-        // Accept input
-        record(remote, "xl_listen: Accepting input");
-        sockaddr_in client = { 0 };
-        socklen_t length = sizeof(client);
-        int insock = accept(sock, (struct sockaddr *) &client, &length);
-        if (insock < 0)
-        {
-            std::cerr << "xl_listen: Error accepting port " << port << ": "
-                      << strerror(errno) << "\n";
-            continue;
-        }
-        record(remote_listen, "Got incoming connexion");
+        RemoteServer server(context, sock);
+        server.Run();
+        close(sock);
+        return 0;
+    }
 
-        // Fork child for incoming connexion
-        int pid = forking ? fork() : 0;
-        if (pid == -1)
-        {
-            std::cerr << "xl_listen: Error forking child\n";
-        }
-        else if (pid)
-        {
-            record(remote_listen, "Forked pid %d", pid);
-            close(insock);
-            active_children++;
-        }
-        else
+    // Start listening processes, replace those that die
+    std::set<int> workers;
+    while (listening)
+    {
+        while (active_children < forking)
         {
-            // Read data from client
-            Tree_p code = xl_read_tree(insock);
-
-            // Evaluate resulting code
-            if (code)
+            int pid = fork();
+            if (pid == -1)
             {
-                record(remote_listen, "Received code: %t", code);
-                received = code;
-                Tree_p hookResult = xl_evaluate(scope, hook);
-                if (hookResult != xl_nil)
-                {
-                    Save<int> saveReply(reply_socket, insock);
-                    code = xl_merge_context(context, code);
-                    Tree_p result = xl_evaluate(scope, code);
-                    record(remote_listen, "Evaluated as %t", result);
-                    xl_write_tree(insock, result);
-                    record(remote_listen, "Response sent");
-                }
-                if (hookResult == xl_false || hookResult == xl_nil)
-                {
-                    listening = false;
-                }
+                std::cerr << "xl_listen: Error forking child\n";
+                break;
             }
-            close(insock);
-
-            if (forking)
+            if (pid == 0)
             {
+                {
+                    RemoteServer server(context, sock);
+                    server.Run();
+                }
                 record(remote_listen, "Exiting PID %d", getpid());
                 exit(listening ? 0 : 42);
             }
+            record(remote_listen, "Forked listener pid %d", pid);
+            workers.insert(pid);
+            active_children++;
         }
+
+        int childPID = child_wait(0);
+        if (childPID > 0)
+            workers.erase(childPID);
+        else if (errno != EINTR)
+            break;
     }
 
+    // Stop the other listening processes
+    for (int pid : workers)
+        kill(pid, SIGTERM);
+    while (active_children && child_wait(0) > 0)
+        /* Loop */;
+
     close(sock);
     return 0;
 }
@@ -585,9 +1934,12 @@ int xl_reply(Scope *scope, Tree *code)
     }
 
     record(remote_reply, "Replying: %t", code);
-    code = xl_attach_context(context, code);
+    RemoteScopeList sent;
+    code = xl_attach_context(context, code, *reply_scopes, nullptr, sent);
     record(remote_reply, "After replacement: %t", code);
-    xl_write_tree(reply_socket, code);
+    if (!xl_write_tree(reply_socket, frameREPLY, reply_id, code))
+        return -1;
+    reply_scopes->known.insert(sent.begin(), sent.end());
     return 0;
 }
 
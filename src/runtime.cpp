@@ -67,10 +67,41 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <iterator>
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <thread>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
 
 
 XL_BEGIN
 
+// ============================================================================
+//
+//   Options
+//
+// ============================================================================
+
+namespace Opt
+{
+NaturalOption   loadDataThreads("load_data_threads",
+                                "Number of threads parsing large data files "
+                                "(0 for one per core)",
+                                0, 0, 256);
+NaturalOption   loadDataChunk("load_data_chunk",
+                              "Size in kilobytes of data file chunks "
+                              "parsed in parallel",
+                              4096, 64, 1024 * 1024);
+}
+
+
 Tree *  xl_evaluate(Scope *scope, Tree *tree)
 // ----------------------------------------------------------------------------
 //   Dispatch evaluation to the main entry point
@@ -631,259 +662,936 @@ Tree *xl_load(Scope *scope, Tree *self)
 struct LoadDataInfo : Info
 // ----------------------------------------------------------------------------
 //   Information about the data that was loaded
+//
+//   Rows are stored by column, with one typed cell per field, so that
+//   large data sets do not cost one tree per field while they sit in cache.
+//   Trees are only built when the rows are handed to the prefix.
 // ----------------------------------------------------------------------------
 {
     LoadDataInfo(): files() {}
+
+    union Cell
+    {
+        ulonglong   natural;
+        double      real;
+        size_t      text;           // Index in the text pool
+    };
+    struct Column
+    {
+        std::vector<kind>       kinds;
+        std::vector<Cell>       cells;
+    };
+    typedef std::vector<size_t> Cursors;
+
     struct PerFile
     {
-        PerFile(): data(), loaded(), mtime(0) {}
-        struct Row
-        {
-            TreeList        args;
-        };
-        typedef std::vector<Row> Data;
-        Data        data;
-        Tree_p      loaded;
-        time_t      mtime;
+        PerFile(): columns(), widths(), texts(), textEnds(),
+                   loaded(), mtime(0), size(0),
+                   parsed(0), partial(false), boundary() {}
+
+        void    Clear();
+        void    AddNatural(uint column, ulonglong value);
+        void    AddReal(uint column, double value);
+        void    AddText(uint column, const char *start, size_t length);
+        void    AddRow(uint width)      { widths.push_back(width); }
+        size_t  Rows()                  { return widths.size(); }
+        Tree *  Field(uint column, size_t index);
+        void    Args(size_t row, Cursors &cursors, TreeList &args);
+        void    DropRow();
+        void    Append(PerFile &chunk);
+        size_t  Resume(const char *data, size_t length);
+        void    Parsed(const char *data, size_t offset, bool partial);
+
+        std::vector<Column>     columns;
+        std::vector<uint>       widths; // Number of fields in each row
+        text                    texts;  // Text pool for all text fields
+        std::vector<size_t>     textEnds;
+        Tree_p                  loaded;
+        time_t                  mtime;
+        size_t                  size;     // File size when last checked
+        size_t                  parsed;   // Offset after last complete row
+        bool                    partial;  // Last row was not terminated
+        text                    boundary; // Bytes just before 'parsed'
     };
     std::map<text, PerFile> files;
 };
 
 
-Tree *xl_load_data(Scope *scope, Tree *self,
-                   text name, text prefix, text fieldSeps, text recordSeps,
-                   Tree *body)
+void LoadDataInfo::PerFile::Clear()
 // ----------------------------------------------------------------------------
-//    Load a comma-separated or tab-separated file from disk
+//   Drop all cached rows
 // ----------------------------------------------------------------------------
 {
-    // Open data file
-    text path = MAIN->SearchFile(name);
-    if (path == "")
+    columns.clear();
+    widths.clear();
+    texts.clear();
+    textEnds.clear();
+    loaded = nullptr;
+    parsed = 0;
+    partial = false;
+    boundary.clear();
+}
+
+
+void LoadDataInfo::PerFile::AddNatural(uint column, ulonglong value)
+// ----------------------------------------------------------------------------
+//   Record a natural field in the given column
+// ----------------------------------------------------------------------------
+{
+    if (column >= columns.size())
+        columns.resize(column + 1);
+    Cell cell;
+    cell.natural = value;
+    columns[column].kinds.push_back(NATURAL);
+    columns[column].cells.push_back(cell);
+}
+
+
+void LoadDataInfo::PerFile::AddReal(uint column, double value)
+// ----------------------------------------------------------------------------
+//   Record a real field in the given column
+// ----------------------------------------------------------------------------
+{
+    if (column >= columns.size())
+        columns.resize(column + 1);
+    Cell cell;
+    cell.real = value;
+    columns[column].kinds.push_back(REAL);
+    columns[column].cells.push_back(cell);
+}
+
+
+void LoadDataInfo::PerFile::AddText(uint column,
+                                    const char *start, size_t length)
+// ----------------------------------------------------------------------------
+//   Record a text field in the given column, storing it in the text pool
+// ----------------------------------------------------------------------------
+{
+    if (column >= columns.size())
+        columns.resize(column + 1);
+    Cell cell;
+    cell.text = textEnds.size();
+    texts.append(start, length);
+    textEnds.push_back(texts.size());
+    columns[column].kinds.push_back(TEXT);
+    columns[column].cells.push_back(cell);
+}
+
+
+Tree *LoadDataInfo::PerFile::Field(uint column, size_t index)
+// ----------------------------------------------------------------------------
+//   Build the tree for a given cell
+// ----------------------------------------------------------------------------
+{
+    Column &col = columns[column];
+    Cell &cell = col.cells[index];
+    switch(col.kinds[index])
     {
-        Ooops("CSV file $2 not found in $1", self).Arg(name);
-        return XL::xl_false;
+    case NATURAL:
+        return new Natural(cell.natural);
+    case REAL:
+        return new Real(cell.real);
+    case TEXT:
+    {
+        size_t start = cell.text ? textEnds[cell.text - 1] : 0;
+        return new Text(texts.substr(start, textEnds[cell.text] - start));
     }
+    default:
+        break;
+    }
+    return xl_nil;
+}
+
 
-    utf8_ifstream input(path.c_str(), std::ifstream::in);
-    if (!input.good())
+void LoadDataInfo::PerFile::Args(size_t row, Cursors &cursors, TreeList &args)
+// ----------------------------------------------------------------------------
+//   Build the arguments for the given row, advancing column cursors
+// ----------------------------------------------------------------------------
+{
+    uint width = widths[row];
+    if (cursors.size() < width)
+        cursors.resize(width, 0);
+    for (uint column = 0; column < width; column++)
+        args.push_back(Field(column, cursors[column]++));
+}
+
+
+void LoadDataInfo::PerFile::DropRow()
+// ----------------------------------------------------------------------------
+//   Remove the last row, e.g. because it was incomplete
+// ----------------------------------------------------------------------------
+{
+    uint width = widths.back();
+    widths.pop_back();
+    for (uint column = width; column-- > 0; )
     {
-        Ooops("Unable to load data for $1.\n"
-                     "(Accessing $2 resulted in the following error: $3)",
-              self).Arg(path).Arg(strerror(errno));
-        return XL::xl_nil;
+        Column &col = columns[column];
+        if (col.kinds.back() == TEXT)
+        {
+            textEnds.pop_back();
+            texts.resize(textEnds.size() ? textEnds.back() : 0);
+        }
+        col.kinds.pop_back();
+        col.cells.pop_back();
     }
+}
+
 
-    return xl_load_data(scope, self, path,
-                        input, true, true,
-                        prefix, fieldSeps, recordSeps,
-                        body);
+void LoadDataInfo::PerFile::Append(PerFile &chunk)
+// ----------------------------------------------------------------------------
+//   Append the rows parsed for a chunk after the current rows
+// ----------------------------------------------------------------------------
+{
+    size_t textBase = textEnds.size();
+    size_t poolBase = texts.size();
+    if (columns.size() < chunk.columns.size())
+        columns.resize(chunk.columns.size());
+    for (size_t c = 0; c < chunk.columns.size(); c++)
+    {
+        Column &from = chunk.columns[c];
+        Column &to = columns[c];
+        size_t first = to.cells.size();
+        to.kinds.insert(to.kinds.end(), from.kinds.begin(), from.kinds.end());
+        to.cells.insert(to.cells.end(), from.cells.begin(), from.cells.end());
+        for (size_t i = first; i < to.cells.size(); i++)
+            if (to.kinds[i] == TEXT)
+                to.cells[i].text += textBase;
+    }
+    widths.insert(widths.end(), chunk.widths.begin(), chunk.widths.end());
+    texts.append(chunk.texts);
+    for (size_t end : chunk.textEnds)
+        textEnds.push_back(end + poolBase);
+    chunk.Clear();
 }
 
 
-Tree *xl_load_data(Scope *scope, Tree *self, text inputName,
-                   std::istream &input, bool cached, bool statTime,
-                   text prefix, text fieldSeps, text recordSeps,
-                   Tree *body)
+size_t LoadDataInfo::PerFile::Resume(const char *data, size_t length)
 // ----------------------------------------------------------------------------
-//   Variant reading from a stream directly
+//   Return the offset where to resume parsing a file that was modified
+//
+//   If the file only grew since it was last parsed, keep the complete rows
+//   and only parse what follows. Otherwise, start over.
 // ----------------------------------------------------------------------------
 {
-    // Check if the file has already been loaded somehwere.
-    // If so, return the loaded data
-    LoadDataInfo *info = self->GetInfo<LoadDataInfo>();
-    if (!info)
+    size_t keep = boundary.size();
+    if (!loaded || parsed > length || parsed < keep ||
+        memcmp(data + parsed - keep, boundary.data(), keep) != 0)
     {
-        // Create cache
-        info = new LoadDataInfo();
-        self->SetInfo<LoadDataInfo> (info);
+        Clear();
+        return 0;
     }
+    if (partial)
+        DropRow();
+    partial = false;
+    loaded = nullptr;
+    return parsed;
+}
 
-    // Load per-file cached data
-    LoadDataInfo::PerFile &perFile = info->files[inputName];
-    if (perFile.loaded)
+
+void LoadDataInfo::PerFile::Parsed(const char *data, size_t offset,
+                                   bool partial)
+// ----------------------------------------------------------------------------
+//   Remember where the last complete row ends for later appends
+// ----------------------------------------------------------------------------
+{
+    const size_t BOUNDARY = 64;
+    size_t keep = offset < BOUNDARY ? offset : BOUNDARY;
+    this->parsed = offset;
+    this->partial = partial;
+    boundary.assign(data + offset - keep, keep);
+}
+
+
+struct LoadDataScanner
+// ----------------------------------------------------------------------------
+//   Scan CSV or TSV data in memory, filling the columnar cache
+//
+//   Bytes that may end a field (separators and quotes) are located
+//   16 at a time when SSE2 is available. Fields without escaped quotes
+//   are converted directly from the input, without intermediate copy.
+// ----------------------------------------------------------------------------
+{
+    LoadDataScanner(const char *begin, const char *end,
+                    text fieldSeps, text recordSeps);
+
+    bool                Row(LoadDataInfo::PerFile &perFile);
+    const char *        Complete()      { return complete; }
+    bool                Partial()       { return partial; }
+
+private:
+    const char *        Special(const char *ptr);
+    void                Field(LoadDataInfo::PerFile &perFile, uint column,
+                              const char *start, const char *end);
+
+    enum { PLAIN, FIELD, RECORD, QUOTE };
+    enum { MAX_VECTOR = 8 };
+
+    const char *        ptr;
+    const char *        end;
+    const char *        complete;       // End of last terminated record
+    bool                partial;        // Last row was cut by end of input
+    byte                classes[256];
+    text                specials;
+    text                scratch;
+#ifdef __SSE2__
+    __m128i             vectors[MAX_VECTOR];
+#endif
+};
+
+
+LoadDataScanner::LoadDataScanner(const char *begin, const char *end,
+                                 text fieldSeps, text recordSeps)
+// ----------------------------------------------------------------------------
+//   Build the character classification tables for the separators
+// ----------------------------------------------------------------------------
+{
+    ptr = begin;
+    this->end = end;
+    complete = begin;
+    partial = false;
+    memset(classes, PLAIN, sizeof(classes));
+    for (char c : fieldSeps)
+        classes[byte(c)] = FIELD;
+    for (char c : recordSeps)
+        classes[byte(c)] = RECORD;
+    classes[byte('"')] = QUOTE;
+    for (uint c = 0; c < 256; c++)
+        if (classes[c] != PLAIN)
+            specials.push_back(char(c));
+#ifdef __SSE2__
+    for (uint s = 0; s < specials.size() && s < MAX_VECTOR; s++)
+        vectors[s] = _mm_set1_epi8(specials[s]);
+#endif
+}
+
+
+const char *LoadDataScanner::Special(const char *p)
+// ----------------------------------------------------------------------------
+//   Find the next separator or quote in the input
+// ----------------------------------------------------------------------------
+{
+#ifdef __SSE2__
+    uint count = specials.size();
+    if (count <= MAX_VECTOR)
     {
-        if (statTime)
+        while (p + 16 <= end)
         {
-            // Check if we need to reload the contents of the file
-            // because it has been modified
-            utf8_filestat_t st;
-            utf8_stat (inputName.c_str(), &st);
-            if (perFile.mtime != st.st_mtime)
-                cached = false;
-            perFile.mtime = st.st_mtime;
+            __m128i block = _mm_loadu_si128((const __m128i *) p);
+            __m128i hits = _mm_cmpeq_epi8(block, vectors[0]);
+            for (uint s = 1; s < count; s++)
+                hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, vectors[s]));
+            if (int mask = _mm_movemask_epi8(hits))
+                return p + __builtin_ctz(mask);
+            p += 16;
         }
+    }
+#endif
+    while (p < end && classes[byte(*p)] == PLAIN)
+        p++;
+    return p;
+}
+
 
-        if (cached)
+bool LoadDataScanner::Row(LoadDataInfo::PerFile &perFile)
+// ----------------------------------------------------------------------------
+//   Scan one record into the cache, return false at end of input
+// ----------------------------------------------------------------------------
+{
+    uint column = 0;
+    byte sep = PLAIN;
+    while (true)
+    {
+        // Skip leading spaces, but not newlines or separators
+        while (ptr < end && classes[byte(*ptr)] == PLAIN &&
+               *ptr != '\n' && isspace(byte(*ptr)))
+            ptr++;
+        if (ptr >= end && column == 0)
+            return false;
+
+        // Find the end of the field, copying it only for escaped quotes
+        const char *start = ptr;
+        const char *last = end;
+        bool quoted = false;
+        bool copied = false;
+        sep = PLAIN;                    // End of input
+        while (ptr < end)
         {
-            Tree_p result = xl_false;
-            if (prefix.size())
+            const char *next = quoted
+                ? (const char *) memchr(ptr, '"', end - ptr)
+                : Special(ptr);
+            if (!next)
+                next = end;
+            if (next >= end)
+            {
+                if (copied)
+                    scratch.append(ptr, end - ptr);
+                ptr = end;
+                break;
+            }
+
+            byte k = classes[byte(*next)];
+            if (k != QUOTE)
+            {
+                if (copied)
+                    scratch.append(ptr, next - ptr);
+                last = next;
+                ptr = next + 1;
+                sep = k;
+                break;
+            }
+
+            if (quoted && next + 1 < end && next[1] == '"')
             {
-                ulong i, max = perFile.data.size();
-                for (i = 0; i < max; i++)
+                // Escaped quote: keep only one of the two
+                if (!copied)
                 {
-                    LoadDataInfo::PerFile::Row &row = perFile.data[i];
-                    result = xl_call(scope, prefix, row.args);
+                    scratch.assign(start, next - start);
+                    copied = true;
+                    ptr = next;
                 }
-                return result;
+                scratch.append(ptr, next + 1 - ptr);
+                ptr = next + 2;
+                continue;
             }
-            return perFile.loaded;
+            if (copied)
+                scratch.append(ptr, next + 1 - ptr);
+            quoted = !quoted;
+            ptr = next + 1;
         }
 
-        // Restart with clean data
-        perFile.data.clear();
-        perFile.loaded = nullptr;
-    }
+        if (copied)
+            Field(perFile, column,
+                  scratch.data(), scratch.data() + scratch.size());
+        else
+            Field(perFile, column, start, last);
+        column++;
 
-    // Read data from file
-    char     buffer[256];
-    char    *ptr       = buffer;
-    char    *end       = buffer + sizeof(buffer) - 1;
-    Tree_p   tree      = nullptr;
-    Tree_p   line      = nullptr;
-    Tree_p  *treePtr   = &tree;
-    Tree_p  *linePtr   = &line;
-    bool     hasQuote  = false;
-    bool     hasRecord = false;
-    bool     hasField  = false;
-    bool     hasPrefix = prefix.size() != 0;
-
-    LoadDataInfo::PerFile::Row row;
-    *end = 0;
-    while (input.good())
-    {
-        int c = input.get();
+        if (sep != FIELD)
+            break;
+    }
+    perFile.AddRow(column);
+    partial = sep != RECORD;
+    if (!partial)
+        complete = ptr;
+    return true;
+}
 
-        if (!hasQuote && ptr == buffer && c != '\n' && isspace(c))
-            continue;
 
-        if (hasQuote)
-        {
-            hasRecord = false;
-            hasField = false;
-        }
-        else
+void LoadDataScanner::Field(LoadDataInfo::PerFile &perFile, uint column,
+                            const char *start, const char *last)
+// ----------------------------------------------------------------------------
+//   Record a field as a natural, real or text value
+// ----------------------------------------------------------------------------
+{
+    size_t length = last - start;
+    if (length && (isdigit(byte(start[0])) ||
+                   (length > 1 && (start[0] == '-' || start[0] == '+') &&
+                    isdigit(byte(start[1])))))
+    {
+        // Fast path for short unsigned integers
+        const char *p = start;
+        ulonglong value = 0;
+        while (p < last && p < start + 18 && isdigit(byte(*p)))
+            value = 10 * value + (*p++ - '0');
+        if (p == last)
         {
-            hasRecord = recordSeps.find(c) != recordSeps.npos || c == EOF;
-            hasField = fieldSeps.find(c) != fieldSeps.npos;
+            perFile.AddNatural(column, value);
+            return;
         }
-        if (hasRecord || hasField)
+
+        // Otherwise, let the C library parse a terminated copy
+        text number(start, length);
+        char *ptr2 = nullptr;
+        longlong l = strtoll(number.c_str(), &ptr2, 10);
+        if (ptr2 == number.c_str() + length)
         {
-            c = 0;
+            perFile.AddNatural(column, l);
+            return;
         }
-        else if (c == '"')
+        double d = strtod(number.c_str(), &ptr2);
+        if (ptr2 == number.c_str() + length)
         {
-            int next = input.peek();
-            bool escapedQuote = (hasQuote && next == '"');
-            if (escapedQuote)
-                input.get();
-            else
-                hasQuote = !hasQuote;
+            perFile.AddReal(column, d);
+            return;
         }
+    }
 
-        if (ptr < end)
-            *ptr++ = c;
+    // Strip outer quotes on text
+    if (length >= 2 && start[0] == '"' && last[-1] == '"')
+        perFile.AddText(column, start + 1, length - 2);
+    else
+        perFile.AddText(column, start, length);
+}
 
-        if (!c)
-        {
-            text token;
-            Tree *child = nullptr;
 
-            if (isdigit(buffer[0]) ||
-                ((buffer[0] == '-' || buffer[0] == '+') && isdigit(buffer[1])))
-            {
-                char *ptr2 = nullptr;
-                longlong l = strtoll(buffer, &ptr2, 10);
-                if (ptr2 == ptr-1)
-                {
-                    child = new Natural(l);
-                }
-                else
-                {
-                    double d = strtod (buffer, &ptr2);
-                    if (ptr2 == ptr-1)
-                        child = new Real(d);
-                }
-            }
-            if (child == nullptr)
-            {
-                if (buffer[0] == '"' && ptr > buffer+2 && ptr[-2] == '"')
-                    token = text(buffer+1, ptr - buffer - 3);
-                else
-                    token = text(buffer, ptr - buffer - 1);
-                child = new Text(token);
-            }
+struct LoadDataBatch
+// ----------------------------------------------------------------------------
+//   Hand rows to the prefix in batches
+//
+//   The calls for a batch of up to SIZE rows are type-checked and evaluated
+//   together as a single sequence. If the batch does not type-check, for
+//   example because of a header row, each row is type-checked and called
+//   individually so that the errors are reported for the offending row only.
+//
+//   This changes when rows are called, not in which order: the first call
+//   of a batch only happens once the whole batch is parsed and type-checked,
+//   and type errors for a row are reported before any row of its batch runs.
+//   A call that fails at runtime does not stop the following calls, as in
+//   any other sequence, and is not attributed to its row.
+// ----------------------------------------------------------------------------
+{
+    LoadDataBatch(Scope *scope, text prefix, Tree *body)
+        : scope(scope), prefix(prefix), body(body), calls(), result(xl_false),
+          cursors(), next(0) {}
+
+    void        Rows(LoadDataInfo::PerFile &perFile);
+    void        Call(TreeList &args);
+    Tree *      Flush();
+    bool        Analyze(Tree *code, bool report);
+
+    enum { SIZE = 256 };
+
+    Scope_p     scope;
+    text        prefix;
+    Tree_p      body;
+    TreeList    calls;
+    Tree_p      result;
+    LoadDataInfo::Cursors cursors;
+    size_t      next;           // Next row to hand to the prefix
+};
+
+
+void LoadDataBatch::Rows(LoadDataInfo::PerFile &perFile)
+// ----------------------------------------------------------------------------
+//   Add calls for all the rows in the cache that were not handed yet
+// ----------------------------------------------------------------------------
+{
+    size_t max = perFile.Rows();
+    for (; next < max; next++)
+    {
+        TreeList args;
+        perFile.Args(next, cursors, args);
+        Call(args);
+    }
+}
+
+
+void LoadDataBatch::Call(TreeList &args)
+// ----------------------------------------------------------------------------
+//   Add a call for the given row, evaluating the batch when full
+// ----------------------------------------------------------------------------
+{
+    if (body)
+        args.push_back(body);
+    calls.push_back(XLCall(prefix, args).Build());
+    if (calls.size() >= SIZE)
+        Flush();
+}
+
+
+bool LoadDataBatch::Analyze(Tree *code, bool report)
+// ----------------------------------------------------------------------------
+//   Type-check calls, optionally reporting errors like XLCall does
+// ----------------------------------------------------------------------------
+{
+    Errors errors;
+    if (report)
+        errors.Log(Error("Unable to evaluate call $1:", code), true);
+
+    Types types(scope);
+    Tree *type = types.TypeAnalysis(code);
+    bool result = type != nullptr && type != xl_error && !errors.HadErrors();
+    if (!result && !report)
+        errors.Clear();
+    return result;
+}
+
+
+Tree *LoadDataBatch::Flush()
+// ----------------------------------------------------------------------------
+//   Evaluate pending calls, return the result of the last one
+// ----------------------------------------------------------------------------
+{
+    size_t count = calls.size();
+    if (!count)
+        return result;
+
+    Tree_p sequence = calls[count - 1];
+    for (size_t i = count - 1; i > 0; i--)
+        sequence = new Infix("\n", calls[i - 1], sequence);
+
+    if (Analyze(sequence, false))
+    {
+        result = MAIN->Evaluate(scope, sequence);
+    }
+    else
+    {
+        for (Tree *call : calls)
+            result = Analyze(call, true) ? MAIN->Evaluate(scope, call) : xl_nil;
+    }
+    calls.clear();
+    return result;
+}
+
+
+static LoadDataInfo::PerFile &LoadDataCache(Tree *self, text inputName,
+                                            bool &cached, bool statTime)
+// ----------------------------------------------------------------------------
+//   Find the cache for a file, and check if it is still valid
+// ----------------------------------------------------------------------------
+{
+    // Find or create the cache
+    LoadDataInfo *info = self->GetInfo<LoadDataInfo>();
+    if (!info)
+    {
+        info = new LoadDataInfo();
+        self->SetInfo<LoadDataInfo> (info);
+    }
 
-            // Combine data that we just read to current line
-            if (hasPrefix)
+    // Check if we need to reload the contents of the file
+    // because it has been modified. Appends may not change mtime
+    // if they happen within the same second, so check size too.
+    LoadDataInfo::PerFile &perFile = info->files[inputName];
+    utf8_filestat_t st;
+    if (statTime && utf8_stat(inputName.c_str(), &st) == 0)
+    {
+        if (perFile.mtime != st.st_mtime || perFile.size != size_t(st.st_size))
+            cached = false;
+        perFile.mtime = st.st_mtime;
+        perFile.size = st.st_size;
+    }
+    if (!perFile.loaded)
+        cached = false;
+    return perFile;
+}
+
+
+static Tree *LoadDataReplay(Scope *scope, LoadDataInfo::PerFile &perFile,
+                            text prefix, Tree *body)
+// ----------------------------------------------------------------------------
+//   Replay cached data through the prefix, or return the cached tree
+// ----------------------------------------------------------------------------
+{
+    if (!prefix.size())
+        return perFile.loaded;
+
+    LoadDataBatch batch(scope, prefix, body);
+    batch.Rows(perFile);
+    return batch.Flush();
+}
+
+
+static Tree *LoadDataTree(LoadDataInfo::PerFile &perFile, Tree *body)
+// ----------------------------------------------------------------------------
+//   Build a tree with one comma-separated line per row
+// ----------------------------------------------------------------------------
+{
+    Tree_p   tree    = nullptr;
+    Tree_p  *treePtr = &tree;
+    LoadDataInfo::Cursors cursors;
+    size_t max = perFile.Rows();
+    for (size_t row = 0; row < max; row++)
+    {
+        TreeList args;
+        perFile.Args(row, cursors, args);
+        if (body)
+            args.push_back(body);
+
+        Tree_p   line    = nullptr;
+        Tree_p  *linePtr = &line;
+        for (Tree *child : args)
+        {
+            if (*linePtr)
             {
-                row.args.push_back(child);
+                Infix *infix = new Infix(",", *linePtr, child);
+                *linePtr = infix;
+                linePtr = &infix->right;
             }
             else
             {
-                if (*linePtr)
-                {
-                    Infix *infix = new Infix(",", *linePtr, child);
-                    *linePtr = infix;
-                    linePtr = &infix->right;
-                }
-                else
-                {
-                    *linePtr = child;
-                }
+                *linePtr = child;
             }
+        }
 
-            // Combine as line if necessary
-            if (hasRecord)
-            {
-                if (hasPrefix)
-                {
-                    if (body)
-                        row.args.push_back(body);
-                    perFile.data.push_back(row);
-                    tree = xl_call(scope, prefix, row.args);
-                    row.args.clear();
-                }
-                else
-                {
-                    if (body)
-                    {
-                        if (*linePtr)
-                        {
-                            Infix *infix = new Infix(",", *linePtr, body);
-                            *linePtr = infix;
-                            linePtr = &infix->right;
-                        }
-                        else
-                        {
-                            *linePtr = body;
-                        }
-                    }
-                    if (*treePtr)
-                    {
-                        Infix *infix = new Infix("\n", *treePtr, line);
-                        *treePtr = infix;
-                        treePtr = &infix->right;
-                    }
-                    else
-                    {
-                        *treePtr = line;
-                    }
-                    line = nullptr;
-                    linePtr = &line;
-                }
-            }
-            ptr = buffer;
+        if (*treePtr)
+        {
+            Infix *infix = new Infix("\n", *treePtr, line);
+            *treePtr = infix;
+            treePtr = &infix->right;
+        }
+        else
+        {
+            *treePtr = line;
         }
     }
     if (!tree)
         tree = xl_false;
-    perFile.loaded = tree;
-
     return tree;
 }
 
 
+struct LoadDataChunk
+// ----------------------------------------------------------------------------
+//   A range of records parsed by a worker thread
+// ----------------------------------------------------------------------------
+{
+    const char *                begin;
+    const char *                end;
+    const char *                complete;
+    bool                        partial;
+    LoadDataInfo::PerFile       rows;
+    std::promise<void>          done;
+};
+
+
+static void LoadDataSplit(std::vector<LoadDataChunk> &chunks,
+                          const char *begin, const char *end,
+                          size_t chunkSize, text recordSeps)
+// ----------------------------------------------------------------------------
+//   Split input in chunks ending at a record separator outside of quotes
+//
+//   Quotes toggle the quoted state wherever they are, and escaped quotes
+//   come in pairs, so the parity of the quote count tells if we are in a
+//   quoted field. The count is cheap compared to actually parsing fields.
+// ----------------------------------------------------------------------------
+{
+    std::vector<const char *> cuts;
+    const char *ptr = begin;
+    bool quoted = false;
+    while (size_t(end - ptr) > chunkSize)
+    {
+        const char *target = ptr + chunkSize;
+        quoted ^= std::count(ptr, target, '"') & 1;
+        ptr = target;
+        while (ptr < end && (quoted || recordSeps.find(*ptr) == text::npos))
+        {
+            if (*ptr == '"')
+                quoted = !quoted;
+            ptr++;
+        }
+        if (ptr >= end)
+            break;
+        cuts.push_back(++ptr);
+    }
+    if (cuts.empty() || cuts.back() != end)
+        cuts.push_back(end);
+
+    chunks = std::vector<LoadDataChunk>(cuts.size());
+    for (size_t c = 0; c < cuts.size(); c++)
+    {
+        chunks[c].begin = c ? cuts[c-1] : begin;
+        chunks[c].end = cuts[c];
+    }
+}
+
+
+static void LoadDataScan(LoadDataInfo::PerFile &perFile,
+                         const char *begin, const char *end,
+                         text fieldSeps, text recordSeps,
+                         LoadDataBatch *batch,
+                         const char *&complete, bool &partial)
+// ----------------------------------------------------------------------------
+//   Scan data in memory into the cache, calling the prefix as we go
+//
+//   Large inputs are split in chunks parsed by a pool of worker threads.
+//   Chunks are merged in order as soon as they are ready, so that the
+//   prefix can process the first rows while the next ones are parsed.
+// ----------------------------------------------------------------------------
+{
+    size_t chunkSize = Opt::loadDataChunk * 1024;
+    uint threads = Opt::loadDataThreads;
+    if (!threads)
+        threads = std::thread::hardware_concurrency();
+    if (threads <= 1 || size_t(end - begin) < 2 * chunkSize)
+    {
+        LoadDataScanner scanner(begin, end, fieldSeps, recordSeps);
+        while (scanner.Row(perFile))
+            if (batch)
+                batch->Rows(perFile);
+        complete = scanner.Complete();
+        partial = scanner.Partial();
+        return;
+    }
+
+    std::vector<LoadDataChunk> chunks;
+    LoadDataSplit(chunks, begin, end, chunkSize, recordSeps);
+    size_t count = chunks.size();
+    if (threads > count)
+        threads = count;
+    record(fileload, "Parsing %lu bytes in %lu chunks on %u threads",
+           (ulong) (end - begin), (ulong) count, threads);
+
+    std::vector<std::future<void>> ready;
+    for (LoadDataChunk &chunk : chunks)
+        ready.push_back(chunk.done.get_future());
+
+    // Evaluating the prefix may throw: workers stop taking chunks and
+    // are joined before the chunks they fill go out of scope
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    struct JoinWorkers
+    {
+        std::atomic<size_t> &       next;
+        size_t                      count;
+        std::vector<std::thread> &  workers;
+        ~JoinWorkers()
+        {
+            next = count;
+            for (std::thread &worker : workers)
+                worker.join();
+        }
+    } joinWorkers { next, count, workers };
+    for (uint t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&]()
+        {
+            for (size_t c = next++; c < count; c = next++)
+            {
+                LoadDataChunk &chunk = chunks[c];
+                LoadDataScanner scanner(chunk.begin, chunk.end,
+                                        fieldSeps, recordSeps);
+                while (scanner.Row(chunk.rows))
+                    /* Only fill the chunk rows */;
+                chunk.complete = scanner.Complete();
+                chunk.partial = scanner.Partial();
+                chunk.done.set_value();
+            }
+        });
+    }
+
+    for (size_t c = 0; c < count; c++)
+    {
+        ready[c].wait();
+        perFile.Append(chunks[c].rows);
+        if (batch)
+            batch->Rows(perFile);
+    }
+
+    complete = chunks[count-1].complete;
+    partial = chunks[count-1].partial;
+}
+
+
+static Tree *LoadDataParse(Scope *scope, LoadDataInfo::PerFile &perFile,
+                           const char *data, size_t start, size_t length,
+                           text prefix, text fieldSeps, text recordSeps,
+                           Tree *body)
+// ----------------------------------------------------------------------------
+//   Parse data from the given start offset, and hand all rows to the prefix
+// ----------------------------------------------------------------------------
+{
+    const char *complete = data + start;
+    bool partial = false;
+    if (prefix.size())
+    {
+        // Rows kept from a previous load come first
+        LoadDataBatch batch(scope, prefix, body);
+        batch.Rows(perFile);
+        LoadDataScan(perFile, data + start, data + length,
+                     fieldSeps, recordSeps, &batch, complete, partial);
+        perFile.loaded = batch.Flush();
+    }
+    else
+    {
+        LoadDataScan(perFile, data + start, data + length,
+                     fieldSeps, recordSeps, nullptr, complete, partial);
+        perFile.loaded = LoadDataTree(perFile, body);
+    }
+    perFile.Parsed(data, complete - data, partial);
+    record(fileload, "Loaded %lu rows, parsed %lu bytes from offset %lu",
+           perFile.Rows(), (ulong) (length - start), (ulong) start);
+    return perFile.loaded;
+}
+
+
+Tree *xl_load_data(Scope *scope, Tree *self,
+                   text name, text prefix, text fieldSeps, text recordSeps,
+                   Tree *body)
+// ----------------------------------------------------------------------------
+//    Load a comma-separated or tab-separated file from disk
+//
+//    Each row is handed to the prefix, in file order, as a call whose
+//    arguments are the fields of the row. Calls are made in batches of up
+//    to 256 rows, see LoadDataBatch. The result is that of the last call.
+//    Without a prefix, the result is a tree with one line per row.
+// ----------------------------------------------------------------------------
+{
+    // Open data file
+    text path = MAIN->SearchFile(name);
+    if (path == "")
+    {
+        Ooops("CSV file $2 not found in $1", self).Arg(name);
+        return XL::xl_false;
+    }
+
+    // Check if the file has already been loaded somewhere
+    bool cached = true;
+    LoadDataInfo::PerFile &perFile = LoadDataCache(self, path, cached, true);
+    if (cached)
+        return LoadDataReplay(scope, perFile, prefix, body);
+
+    // Map the file and scan it in place
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        Ooops("Unable to load data for $1.\n"
+                     "(Accessing $2 resulted in the following error: $3)",
+              self).Arg(path).Arg(strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        perFile.Clear();
+        return XL::xl_nil;
+    }
+
+    size_t size = st.st_size;
+    void *map = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                     : nullptr;
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        Ooops("Unable to map data for $1.\n"
+                     "(Mapping $2 resulted in the following error: $3)",
+              self).Arg(path).Arg(strerror(errno));
+        perFile.Clear();
+        return XL::xl_nil;
+    }
+    if (map)
+        madvise(map, size, MADV_SEQUENTIAL);
+
+    // If the file only grew, e.g. a log file, only parse the new tail
+    const char *data = (const char *) map;
+    size_t start = perFile.Resume(data, size);
+    Tree_p result = LoadDataParse(scope, perFile, data, start, size,
+                                  prefix, fieldSeps, recordSeps, body);
+    if (map)
+        munmap(map, size);
+    return result;
+}
+
+
+Tree *xl_load_data(Scope *scope, Tree *self, text inputName,
+                   std::istream &input, bool cached, bool statTime,
+                   text prefix, text fieldSeps, text recordSeps,
+                   Tree *body)
+// ----------------------------------------------------------------------------
+//   Variant reading from a stream directly
+// ----------------------------------------------------------------------------
+{
+    LoadDataInfo::PerFile &perFile =
+        LoadDataCache(self, inputName, cached, statTime);
+    if (cached)
+        return LoadDataReplay(scope, perFile, prefix, body);
+
+    // Streams cannot be mapped, so read them in memory before scanning
+    text data((std::istreambuf_iterator<char>(input)),
+              std::istreambuf_iterator<char>());
+    perFile.Clear();
+    return LoadDataParse(scope, perFile, data.data(), 0, data.size(),
+                         prefix, fieldSeps, recordSeps, body);
+}
+
+
 
 // ============================================================================
 //
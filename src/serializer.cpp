@@ -89,12 +89,24 @@ union ieee754_double
 //
 // ============================================================================
 
-Serializer::Serializer(std::ostream &out)
+Serializer::Serializer()
 // ----------------------------------------------------------------------------
-//   Constructor sends the magic and version number
+//   Constructor writes the magic and version number
 // ----------------------------------------------------------------------------
-    : out (out)
+    : buffer(), texts(), valid(true)
 {
+    Reset();
+}
+
+
+void Serializer::Reset()
+// ----------------------------------------------------------------------------
+//   Start a new serialized tree, keeping the allocated storage
+// ----------------------------------------------------------------------------
+{
+    buffer.clear();
+    texts.clear();
+    valid = true;
     WriteUnsigned(serialMAGIC);
     WriteUnsigned(serialVERSION);
 }
@@ -106,6 +118,7 @@ Tree *Serializer::Do(Tree *what)
 // ----------------------------------------------------------------------------
 {
     WriteUnsigned(serialINVALID); // Make stream invalid
+    valid = false;
     assert(!"We should not reach Serializer::Do");
     return what;
 }
@@ -212,6 +225,8 @@ void Serializer::WriteSigned(longlong value)
 //   Write a signed longlong value (largest native machine type)
 // ----------------------------------------------------------------------------
 {
+    char bytes[10];
+    uint count = 0;
     byte b;
     do
     {
@@ -219,8 +234,9 @@ void Serializer::WriteSigned(longlong value)
         value >>= 7;
         if ((value != 0 && value != -1) || (value & 0x40) != (b & 0x40))
             b |= 0x80;
-        out << b;
+        bytes[count++] = b;
     } while (b & 0x80);
+    buffer.append(bytes, count);
 }
 
 
@@ -229,6 +245,8 @@ void Serializer::WriteUnsigned(ulonglong value)
 //   Write an unsigned longlong value (largest native machine type)
 // ----------------------------------------------------------------------------
 {
+    char bytes[10];
+    uint count = 0;
     byte b;
     do
     {
@@ -236,8 +254,9 @@ void Serializer::WriteUnsigned(ulonglong value)
         value >>= 7;
         if (value != 0)
             b |= 0x80;
-        out << b;
+        bytes[count++] = b;
     } while (b & 0x80);
+    buffer.append(bytes, count);
 }
 
 
@@ -258,23 +277,22 @@ void Serializer::WriteReal(double value)
 }
 
 
-void Serializer::WriteText(text value)
+void Serializer::WriteText(const text &value)
 // ----------------------------------------------------------------------------
-//   Write the length followed by data bytes
+//   Write the length followed by data bytes, or the index of a known text
 // ----------------------------------------------------------------------------
 {
-    // texts[value] is created with value 0 if not existing,
-    // and then it increases texts.size by 1.
-    longlong exists = texts[value];
-    if (exists)
+    auto found = texts.find(value);
+    if (found != texts.end())
     {
-        WriteSigned(-exists);
+        WriteSigned(-found->second);
     }
     else
     {
         WriteSigned(value.length());
-        out.write(value.data(), value.length());
-        texts[value] = texts.size();
+        buffer.append(value);
+        longlong index = texts.size() + 1;
+        texts.emplace(value, index);
     }
 }
 
@@ -294,21 +312,21 @@ void Serializer::WriteChild(Tree *child)
 
 // ============================================================================
 //
-//   Class Deserializer : Read back serialized data from a stream
+//   Class Deserializer : Read back serialized data from memory
 //
 // ============================================================================
 
-Deserializer::Deserializer(std::istream &in, TreePosition pos)
+Deserializer::Deserializer(const char *data, size_t size, TreePosition pos)
 // ----------------------------------------------------------------------------
-//   Read a few bytes from the stream, check version and magic value
+//   Read a few bytes from the buffer, check version and magic value
 // ----------------------------------------------------------------------------
-    : in(in), pos(pos)
+    : current(data), end(data + size), valid(true), pos(pos), texts()
 {
     if (ReadUnsigned() != serialMAGIC ||
         ReadUnsigned() != serialVERSION)
     {
-        // Error on input: close the stream
-        in.setstate(in.failbit);
+        // Error on input: stop reading
+        valid = false;
     }
 }
 
@@ -326,7 +344,7 @@ Tree *Deserializer::ReadTree()
 // ----------------------------------------------------------------------------
 {
     // If it's bad to start with, stop reading further...
-    if (!in.good())
+    if (!valid)
         return nullptr;
 
     SerializationTag tag = SerializationTag(ReadUnsigned());
@@ -387,7 +405,7 @@ Tree *Deserializer::ReadTree()
         break;
 
     default:
-        in.setstate(in.failbit);
+        valid = false;
     }
 
     return result;
@@ -396,28 +414,34 @@ Tree *Deserializer::ReadTree()
 
 longlong Deserializer::ReadSigned()
 // ----------------------------------------------------------------------------
-//   Read values from input stream, checking that it fits local longlong
+//   Read values from input buffer, checking that it fits local longlong
 // ----------------------------------------------------------------------------
 {
-    if (!in.good())
-        return 0;
-
-    byte     b;
+    byte     b = 0;
     longlong value = 0;
     longlong shifted = 0;
     uint     shift = 0;
     do
     {
-        b = in.get();
+        if (current >= end || shift >= 64)
+        {
+            valid = false;
+            return 0;
+        }
+        b = *current++;
         shifted = longlong(b & 0x7f) << shift;
         value |= shifted;
-        if ((shifted >> shift) != (b & 0x7f))
-            in.setstate(in.failbit);
+
+        // The last byte of a 64-bit value only holds its sign bit
+        if (shift < 63
+            ? (shifted >> shift) != (b & 0x7f)
+            : (b & 0x7f) != 0 && (b & 0x7f) != 0x7f)
+            valid = false;
         shift += 7;
     }
-    while (in.good() && (b & 0x80));
+    while (b & 0x80);
 
-    if (b & 0x40)
+    if ((b & 0x40) && shift < 64)
         value |= ~0ULL << shift;
 
     return value;
@@ -426,26 +450,28 @@ longlong Deserializer::ReadSigned()
 
 ulonglong Deserializer::ReadUnsigned()
 // ----------------------------------------------------------------------------
-//   Read unsigned values from input stream, checking that it fits local ull
+//   Read unsigned values from input buffer, checking that it fits local ull
 // ----------------------------------------------------------------------------
 {
-    if (!in.good())
-        return 0;
-
-    byte      b;
+    byte      b = 0;
     ulonglong value   = 0;
     ulonglong shifted = 0;
     uint      shift   = 0;
     do
     {
-        b = in.get();
+        if (current >= end || shift >= 64)
+        {
+            valid = false;
+            return 0;
+        }
+        b = *current++;
         shifted = ulonglong(b & 0x7f) << shift;
         value |= shifted;
         if ((shifted >> shift) != (b & 0x7f))
-            in.setstate(in.failbit);
+            valid = false;
         shift += 7;
     }
-    while (in.good() && (b & 0x80));
+    while (b & 0x80);
 
     return value;
 }
@@ -453,12 +479,9 @@ ulonglong Deserializer::ReadUnsigned()
 
 double Deserializer::ReadReal()
 // ----------------------------------------------------------------------------
-//   Read a real number from the input stream
+//   Read a real number from the input buffer
 // ----------------------------------------------------------------------------
 {
-    if (!in.good())
-        return 0;
-
     ieee754_double cvt;
     longlong  exponent = ReadSigned();
     ulonglong mantissa = ReadUnsigned();
@@ -481,30 +504,32 @@ double Deserializer::ReadReal()
 
 text Deserializer::ReadText()
 // ----------------------------------------------------------------------------
-//   Read a text from the input stream
+//   Read a text from the input buffer, or the index of a previous one
 // ----------------------------------------------------------------------------
 {
-    if (!in.good())
+    longlong length = ReadSigned();
+    if (!valid)
         return "";
 
-    text      result;
-    longlong  length = ReadSigned();
-
     if (length < 0)
     {
-        result = texts[-length];
+        ulonglong index = -ulonglong(length);
+        if (index > texts.size())
+        {
+            valid = false;
+            return "";
+        }
+        return texts[index - 1];
     }
-    else
-    {
-        char *    buffer = new char[length];
-        in.read(buffer, length);
-        result.insert(0, buffer, length);
-        delete[] buffer;
 
-        texts[texts.size()+1] = result;
+    if (ulonglong(length) > ulonglong(end - current))
+    {
+        valid = false;
+        return "";
     }
-
-    return result;
+    texts.emplace_back(current, length);
+    current += length;
+    return texts.back();
 }
 
 XL_END